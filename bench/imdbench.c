@@ -0,0 +1,327 @@
+/*
+    imdbench: measure how fast .IMD images can be processed
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    Each operation is run in a child process, so that its peak RSS can be
+    measured separately. Speeds are in MB/s of .IMD file processed.
+
+    The "sectors" benchmark reads every sector through an imdindex, and
+    checks that it gets the same results as load_imd.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "disk.h"
+#include "imd.h"
+#include "imdindex.h"
+#include "show.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *image_filename;
+static const char *imdcat_filename;
+
+// Something for bench_load to write to, so the compiler can't skip reading.
+static volatile unsigned int sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static FILE *open_null(void) {
+    FILE *f = fopen("/dev/null", "wb");
+    if (f == NULL) {
+        die_errno("cannot open /dev/null");
+    }
+    return f;
+}
+
+// Each operation returns the time it took, not counting setup.
+
+static double bench_load(void) {
+    disk_t disk;
+    init_disk(&disk);
+
+    const double start = now();
+    load_imd(image_filename, IMD_LOAD_DATA, &disk);
+    // Make sure the data has actually been read from the file.
+    unsigned int sum = 0;
+    for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < disk.num_phys_heads; head++) {
+            const track_t *track = disk_find_track(&disk, cyl, head);
+            for (int i = 0; i < track->num_sectors; i++) {
+                if (track->sectors[i].data != NULL) {
+                    sum += track->sectors[i].data[0];
+                }
+            }
+        }
+    }
+    const double end = now();
+
+    sink = sum;
+    free_disk(&disk);
+    return end - start;
+}
+
+static double bench_save(void) {
+    disk_t disk;
+    init_disk(&disk);
+    load_imd(image_filename, IMD_LOAD_DATA, &disk);
+    FILE *out = open_null();
+
+    const double start = now();
+    write_imd_header(&disk, out);
+    for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < disk.num_phys_heads; head++) {
+            write_imd_track(disk_find_track(&disk, cyl, head), out);
+        }
+    }
+    fflush(out);
+    const double end = now();
+
+    fclose(out);
+    free_disk(&disk);
+    return end - start;
+}
+
+static double bench_dump(void) {
+    disk_t disk;
+    init_disk(&disk);
+    load_imd(image_filename, IMD_LOAD_DATA, &disk);
+    FILE *out = open_null();
+
+    const double start = now();
+    show_disk(&disk, true, out);
+    fflush(out);
+    const double end = now();
+
+    fclose(out);
+    free_disk(&disk);
+    return end - start;
+}
+
+static double bench_sectors(void) {
+    disk_t disk;
+    init_disk(&disk);
+    load_imd(image_filename, IMD_LOAD_DATA, &disk);
+
+    const double start = now();
+    imd_index_t index;
+    open_imd_index(image_filename, &index);
+    for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < disk.num_phys_heads; head++) {
+            const track_t *track = disk_find_track(&disk, cyl, head);
+            const int size = sector_bytes(track->sector_size_code);
+            uint8_t buf[size];
+
+            for (int i = 0; i < track->num_sectors; i++) {
+                const sector_t *sector = &track->sectors[i];
+                const imd_index_entry_t *entry
+                    = find_imd_sector(&index, sector->log_cyl,
+                                      sector->log_head, sector->log_sector);
+                if (entry == NULL) {
+                    die("sector %d.%d.%d missing from index",
+                        sector->log_cyl, sector->log_head,
+                        sector->log_sector);
+                }
+                if (entry->offset != sector->data_offset) {
+                    // Only the first sector with an address is indexed.
+                    continue;
+                }
+
+                const bool have_data = read_imd_sector(&index, entry, buf);
+                if (entry->status != sector->status
+                    || entry->deleted != sector->deleted
+                    || have_data != (sector->data != NULL)
+                    || (have_data && memcmp(buf, sector->data, size) != 0)) {
+                    die("sector %d.%d.%d differs between index and load_imd",
+                        sector->log_cyl, sector->log_head,
+                        sector->log_sector);
+                }
+            }
+        }
+    }
+    close_imd_index(&index);
+    const double end = now();
+
+    free_disk(&disk);
+    return end - start;
+}
+
+// Flattening is done by imdcat itself, so this includes loading the image.
+static double bench_flatten(void) {
+    const double start = now();
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        die_errno("fork failed");
+    } else if (pid == 0) {
+        execl(imdcat_filename, imdcat_filename, "-p", "-o", "/dev/null",
+              image_filename, (char *) NULL);
+        die_errno("cannot run %s", imdcat_filename);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        die_errno("waitpid failed");
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        die("%s failed", imdcat_filename);
+    }
+
+    return now() - start;
+}
+
+typedef struct {
+    const char *name;
+    double (*run)(void);
+    bool in_child; // whether the work is done by a child of the benchmark
+} bench_t;
+
+// What a benchmark child sends back to the parent.
+typedef struct {
+    double time;
+    long child_rss;
+} bench_result_t;
+
+static const bench_t BENCHES[] = {
+    { "load", bench_load, false },
+    { "save", bench_save, false },
+    { "dump", bench_dump, false },
+    { "sectors", bench_sectors, false },
+    { "flatten", bench_flatten, true },
+    { NULL, NULL, false }
+};
+
+// Run an operation in a child process. Return its time, and its peak RSS
+// in kilobytes.
+static double run_bench(const bench_t *bench, long *max_rss) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        die_errno("pipe failed");
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        die_errno("fork failed");
+    } else if (pid == 0) {
+        close(fds[0]);
+
+        bench_result_t result;
+        result.time = bench->run();
+        struct rusage children;
+        getrusage(RUSAGE_CHILDREN, &children);
+        result.child_rss = children.ru_maxrss;
+
+        if (write(fds[1], &result, sizeof result) != sizeof result) {
+            die_errno("write failed");
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+
+    bench_result_t result;
+    if (read(fds[0], &result, sizeof result) != sizeof result) {
+        die("%s benchmark failed", bench->name);
+    }
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        die_errno("wait4 failed");
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        die("%s benchmark failed", bench->name);
+    }
+
+    *max_rss = bench->in_child ? result.child_rss : usage.ru_maxrss;
+    return result.time;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: imdbench [-n REPEAT] IMAGE-FILE IMDCAT\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int repeat = 3;
+
+    while (true) {
+        int opt = getopt(argc, argv, "n:");
+        if (opt == -1) break;
+
+        switch (opt) {
+        case 'n':
+            repeat = atoi(optarg);
+            if (repeat < 1) {
+                usage();
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind + 2 != argc) {
+        usage();
+    }
+    image_filename = argv[optind];
+    imdcat_filename = argv[optind + 1];
+
+    struct stat st;
+    if (stat(image_filename, &st) == -1) {
+        die_errno("cannot stat %s", image_filename);
+    }
+    const double mb = st.st_size / 1e6;
+    printf("%s: %.2f MB\n", image_filename, mb);
+
+    for (int i = 0; BENCHES[i].name != NULL; i++) {
+        // Report the best of several runs.
+        double best = -1.0;
+        long rss = 0;
+        for (int j = 0; j < repeat; j++) {
+            long max_rss;
+            const double time = run_bench(&BENCHES[i], &max_rss);
+            if (best < 0.0 || time < best) {
+                best = time;
+            }
+            if (max_rss > rss) {
+                rss = max_rss;
+            }
+        }
+
+        printf("%-8s %10.1f MB/s %10ld kB peak RSS\n",
+               BENCHES[i].name, (best > 0.0) ? mb / best : 0.0, rss);
+    }
+
+    return 0;
+}
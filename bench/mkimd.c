@@ -0,0 +1,254 @@
+/*
+    mkimd: generate synthetic .IMD images for benchmarking
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "disk.h"
+#include "imd.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+static struct args {
+    int cyls;
+    int heads;
+    int sector_size;
+    int sectors;
+    int interleave;
+    int first_id;
+    int id_step;
+    const data_mode_t *data_mode;
+    // Percentages of sectors of each kind; the rest are normal.
+    int compressed;
+    int bad;
+    int deleted;
+    int missing;
+    uint32_t seed;
+} args;
+
+// A simple, repeatable random number generator (xorshift32).
+static uint32_t rng_state;
+
+static uint32_t next_random(void) {
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x;
+}
+
+static bool chance(int percent) {
+    return (int) (next_random() % 100) < percent;
+}
+
+static void make_track(int cyl, int head, track_t *track) {
+    int size_code = 0;
+    while (sector_bytes(size_code) < args.sector_size) {
+        size_code++;
+    }
+
+    track->status = TRACK_PROBED;
+    track->data_mode = args.data_mode;
+    track->sector_size_code = size_code;
+    resize_track(track, args.sectors);
+
+    // Lay the logical sectors out with the requested interleave.
+    bool used[args.sectors];
+    for (int i = 0; i < args.sectors; i++) {
+        used[i] = false;
+    }
+    int pos = 0;
+    for (int i = 0; i < args.sectors; i++) {
+        while (used[pos]) {
+            pos = (pos + 1) % args.sectors;
+        }
+        used[pos] = true;
+
+        sector_t *sector = &track->sectors[pos];
+        sector->log_cyl = cyl;
+        sector->log_head = head;
+        sector->log_sector = args.first_id + (i * args.id_step);
+        sector->phys_sector = pos;
+
+        pos = (pos + args.interleave) % args.sectors;
+    }
+
+    const int size = sector_bytes(size_code);
+    for (int i = 0; i < args.sectors; i++) {
+        sector_t *sector = &track->sectors[i];
+
+        if (chance(args.missing)) {
+            sector->status = SECTOR_MISSING;
+            continue;
+        }
+        sector->status = chance(args.bad) ? SECTOR_BAD : SECTOR_GOOD;
+        sector->deleted = chance(args.deleted);
+
+        uint8_t *data = alloc_sector_data(track, sector);
+        if (chance(args.compressed)) {
+            // Like a freshly-formatted sector.
+            memset(data, 0xE5, size);
+        } else {
+            for (int j = 0; j < size; j++) {
+                data[j] = next_random() >> 24;
+            }
+        }
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: mkimd [OPTION]... IMAGE-FILE\n");
+    fprintf(stderr, "  -c NUM     cylinders (default 80)\n");
+    fprintf(stderr, "  -h NUM     heads (default 2)\n");
+    fprintf(stderr, "  -s BYTES   sector size (default 512)\n");
+    fprintf(stderr, "  -n NUM     sectors per track (default 9)\n");
+    fprintf(stderr, "  -i NUM     interleave (default 1)\n");
+    fprintf(stderr, "  -f ID      first logical sector ID (default 1)\n");
+    fprintf(stderr, "  -g NUM     gap between logical sector IDs (default 1)\n");
+    fprintf(stderr, "  -m MODE    data mode (default MFM-250k)\n");
+    fprintf(stderr, "  -C PCT     percentage of compressible sectors (default 0)\n");
+    fprintf(stderr, "  -B PCT     percentage of bad sectors (default 0)\n");
+    fprintf(stderr, "  -D PCT     percentage of deleted sectors (default 0)\n");
+    fprintf(stderr, "  -M PCT     percentage of missing sectors (default 0)\n");
+    fprintf(stderr, "  -r SEED    random seed (default 1)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    args.cyls = 80;
+    args.heads = 2;
+    args.sector_size = 512;
+    args.sectors = 9;
+    args.interleave = 1;
+    args.first_id = 1;
+    args.id_step = 1;
+    args.data_mode = &DATA_MODES[0];
+    args.compressed = 0;
+    args.bad = 0;
+    args.deleted = 0;
+    args.missing = 0;
+    args.seed = 1;
+
+    while (true) {
+        int opt = getopt(argc, argv, "c:h:s:n:i:f:g:m:C:B:D:M:r:");
+        if (opt == -1) break;
+
+        switch (opt) {
+        case 'c':
+            args.cyls = atoi(optarg);
+            break;
+        case 'h':
+            args.heads = atoi(optarg);
+            break;
+        case 's':
+            args.sector_size = atoi(optarg);
+            break;
+        case 'n':
+            args.sectors = atoi(optarg);
+            break;
+        case 'i':
+            args.interleave = atoi(optarg);
+            break;
+        case 'f':
+            args.first_id = atoi(optarg);
+            break;
+        case 'g':
+            args.id_step = atoi(optarg);
+            break;
+        case 'm':
+            args.data_mode = NULL;
+            for (int i = 0; DATA_MODES[i].name != NULL; i++) {
+                if (strcasecmp(optarg, DATA_MODES[i].name) == 0) {
+                    args.data_mode = &DATA_MODES[i];
+                }
+            }
+            if (args.data_mode == NULL) {
+                usage();
+            }
+            break;
+        case 'C':
+            args.compressed = atoi(optarg);
+            break;
+        case 'B':
+            args.bad = atoi(optarg);
+            break;
+        case 'D':
+            args.deleted = atoi(optarg);
+            break;
+        case 'M':
+            args.missing = atoi(optarg);
+            break;
+        case 'r':
+            args.seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage();
+    }
+    if (args.cyls < 1 || args.cyls > MAX_CYLS
+        || args.heads < 1 || args.heads > MAX_HEADS
+        || args.sectors < 1 || args.sectors > MAX_SECS
+        || args.sector_size < 128 || args.sector_size > 16384
+        || args.interleave < 1 || args.id_step < 1
+        || args.first_id + ((args.sectors - 1) * args.id_step) > 255) {
+        die("Impossible geometry");
+    }
+    rng_state = (args.seed != 0) ? args.seed : 1;
+
+    FILE *image = fopen(argv[optind], "wb");
+    if (image == NULL) {
+        die_errno("cannot open %s", argv[optind]);
+    }
+
+    disk_t disk;
+    init_disk(&disk);
+    disk.comment = alloc_sprintf("mkimd: synthetic image\r\n");
+    if (disk.comment == NULL) {
+        die("out of memory");
+    }
+    disk.comment_len = strlen(disk.comment);
+    write_imd_header(&disk, image);
+
+    for (int cyl = 0; cyl < args.cyls; cyl++) {
+        for (int head = 0; head < args.heads; head++) {
+            track_t *track = disk_track(&disk, cyl, head);
+            make_track(cyl, head, track);
+            write_imd_track(track, image);
+            free_track(track);
+        }
+    }
+
+    if (fclose(image) != 0) {
+        die_errno("cannot write %s", argv[optind]);
+    }
+    free_disk(&disk);
+
+    return 0;
+}
@@ -24,6 +24,8 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <time.h>
 
 int sector_bytes(int code) {
@@ -61,6 +63,7 @@ static const sector_t EMPTY_SECTOR = {
     .phys_sector = 0xFF,
     .deleted = false,
     .data = NULL,
+    .data_offset = -1,
 };
 
 void init_sector(sector_t *sector) {
@@ -69,8 +72,9 @@ void init_sector(sector_t *sector) {
 
 void free_sector(sector_t *sector) {
     sector->status = SECTOR_MISSING;
-    free(sector->data);
+    // The data belongs to the track, so there's nothing to free here.
     sector->data = NULL;
+    sector->data_offset = -1;
 }
 
 static const track_t EMPTY_TRACK = {
@@ -80,23 +84,90 @@ static const track_t EMPTY_TRACK = {
     .phys_head = -1,
     .num_sectors = -1,
     .sector_size_code = -1,
+    .sectors = NULL,
+    .sectors_size = 0,
+    .data = NULL,
 };
 
 void init_track(int phys_cyl, int phys_head, track_t *track) {
     *track = EMPTY_TRACK;
     track->phys_cyl = phys_cyl;
     track->phys_head = phys_head;
-    for (int i = 0; i < MAX_SECS; i++) {
-        init_sector(&(track->sectors[i]));
-    }
 }
 
 void free_track(track_t *track) {
     track->status = TRACK_UNKNOWN;
     track->num_sectors = 0;
-    for (int i = 0; i < MAX_SECS; i++) {
-        free_sector(&(track->sectors[i]));
+    free(track->sectors);
+    track->sectors = NULL;
+    track->sectors_size = 0;
+    free(track->data);
+    track->data = NULL;
+}
+
+void resize_track(track_t *track, int num_sectors) {
+    if (num_sectors > MAX_SECS) {
+        die("too many sectors in track: %d", num_sectors);
+    }
+
+    if (num_sectors > track->sectors_size) {
+        // Grow the array, doubling it so that appending one sector at a time
+        // (as probing does) doesn't realloc every time.
+        int new_size = track->sectors_size * 2;
+        if (new_size < num_sectors) {
+            new_size = num_sectors;
+        }
+        if (new_size > MAX_SECS) {
+            new_size = MAX_SECS;
+        }
+
+        track->sectors = realloc(track->sectors,
+                                 new_size * sizeof *track->sectors);
+        if (track->sectors == NULL) {
+            die("realloc failed");
+        }
+        for (int i = track->sectors_size; i < new_size; i++) {
+            init_sector(&(track->sectors[i]));
+        }
+
+        if (track->data != NULL) {
+            // Move the existing sector data into a bigger buffer.
+            const int size = sector_bytes(track->sector_size_code);
+            uint8_t *data = malloc(new_size * size);
+            if (data == NULL) {
+                die("malloc failed");
+            }
+            for (int i = 0; i < track->sectors_size; i++) {
+                sector_t *sector = &(track->sectors[i]);
+                if (sector->data == track->data + (i * size)) {
+                    memcpy(data + (i * size), sector->data, size);
+                    sector->data = data + (i * size);
+                }
+            }
+            free(track->data);
+            track->data = data;
+        }
+
+        track->sectors_size = new_size;
+    }
+
+    track->num_sectors = num_sectors;
+}
+
+uint8_t *alloc_sector_data(track_t *track, sector_t *sector) {
+    const int size = sector_bytes(track->sector_size_code);
+
+    if (track->data == NULL) {
+        // Allocate space for all the sectors in the track at once.
+        track->data = malloc(track->sectors_size * size);
+        if (track->data == NULL) {
+            die("malloc failed");
+        }
     }
+
+    const int i = sector - track->sectors;
+    sector->data = track->data + (i * size);
+    return sector->data;
 }
 
 static const disk_t EMPTY_DISK = {
@@ -104,15 +175,12 @@ static const disk_t EMPTY_DISK = {
     .comment_len = -1,
     .num_phys_cyls = 0,
     .num_phys_heads = 0,
+    .mapped = NULL,
+    .mapped_len = 0,
 };
 
 void init_disk(disk_t *disk) {
     *disk = EMPTY_DISK;
-    for (int cyl = 0; cyl < MAX_CYLS; cyl++) {
-        for (int head = 0; head < MAX_HEADS; head++) {
-            init_track(cyl, head, &(disk->tracks[cyl][head]));
-        }
-    }
 }
 
 void free_disk(disk_t *disk) {
@@ -120,20 +188,54 @@ void free_disk(disk_t *disk) {
     disk->comment = NULL;
     for (int cyl = 0; cyl < MAX_CYLS; cyl++) {
         for (int head = 0; head < MAX_HEADS; head++) {
-            free_track(&(disk->tracks[cyl][head]));
+            track_t *track = disk->tracks[cyl][head];
+            if (track == NULL) continue;
+
+            free_track(track);
+            free(track);
+            disk->tracks[cyl][head] = NULL;
         }
     }
+    if (disk->mapped != NULL) {
+        munmap(disk->mapped, disk->mapped_len);
+        disk->mapped = NULL;
+        disk->mapped_len = 0;
+    }
+}
+
+track_t *disk_track(disk_t *disk, int phys_cyl, int phys_head) {
+    track_t **slot = &(disk->tracks[phys_cyl][phys_head]);
+    if (*slot == NULL) {
+        *slot = malloc(sizeof **slot);
+        if (*slot == NULL) {
+            die("malloc failed");
+        }
+        init_track(phys_cyl, phys_head, *slot);
+    }
+    return *slot;
+}
+
+const track_t *disk_find_track(const disk_t *disk,
+                               int phys_cyl, int phys_head) {
+    const track_t *track = disk->tracks[phys_cyl][phys_head];
+    if (track == NULL) {
+        return &EMPTY_TRACK;
+    }
+    return track;
 }
 
 void make_disk_comment(const char *program, const char *version, disk_t *disk) {
+    // Several drives may be starting at once, so this mustn't use
+    // localtime's shared buffer.
     time_t now = time(NULL);
-    const struct tm *local = localtime(&now);
+    struct tm local;
+    localtime_r(&now, &local);
 
     disk->comment = alloc_sprintf(
         "%s %s: %02d/%02d/%04d %02d:%02d:%02d\r\n",
         program, version,
-        local->tm_mday, local->tm_mon + 1, local->tm_year + 1900,
-        local->tm_hour, local->tm_min, local->tm_sec);
+        local.tm_mday, local.tm_mon + 1, local.tm_year + 1900,
+        local.tm_hour, local.tm_min, local.tm_sec);
     if (disk->comment == NULL) {
         die("out of memory");
     }
@@ -147,7 +249,7 @@ void copy_track_layout(const disk_t *disk, const track_t *src, track_t *dest) {
 
     dest->status = TRACK_GUESSED;
     dest->data_mode = src->data_mode;
-    dest->num_sectors = src->num_sectors;
+    resize_track(dest, src->num_sectors);
     dest->sector_size_code = src->sector_size_code;
 
     int cyl_diff = dest->phys_cyl - src->phys_cyl;
@@ -40,6 +40,7 @@
 #define DISK_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 // Convert sector_size_code to size in bytes.
@@ -69,7 +70,8 @@ typedef struct {
     uint8_t log_sector;
     uint8_t phys_sector;
     bool deleted;
-    uint8_t *data; // NULL if not read yet; allocate with malloc
+    uint8_t *data; // NULL if not read yet; allocate with alloc_sector_data
+    long data_offset; // of Sector Data Record in image file; -1 if unknown
 } sector_t;
 
 void init_sector(sector_t *sector);
@@ -90,12 +92,23 @@ typedef struct {
     int phys_head;
     int num_sectors;
     int sector_size_code; // FDC code
-    sector_t sectors[MAX_SECS]; // indexed by physical sector
+    sector_t *sectors; // indexed by physical sector; see resize_track
+    int sectors_size; // number of sectors allocated
+    uint8_t *data; // storage for all the sectors' data; see alloc_sector_data
 } track_t;
 
 void init_track(int phys_cyl, int phys_head, track_t *track);
 void free_track(track_t *track);
 
+// Set the number of sectors in a track, allocating more if necessary.
+// (This may move the sectors array, so don't keep pointers into it.)
+void resize_track(track_t *track, int num_sectors);
+
+// Point a sector's data at its space in the track's data buffer, allocating
+// the buffer if necessary, and return it. The track's sector size must be set.
+// The data is freed along with the track.
+uint8_t *alloc_sector_data(track_t *track, sector_t *sector);
+
 #define MAX_CYLS 256
 #define MAX_HEADS 2
 typedef struct {
@@ -103,12 +116,25 @@ typedef struct {
     int comment_len; // in bytes, not including terminator
     int num_phys_cyls;
     int num_phys_heads;
-    track_t tracks[MAX_CYLS][MAX_HEADS]; // indexed by physical cyl/head
+    // Tracks are allocated on demand; use disk_track to get at them.
+    track_t *tracks[MAX_CYLS][MAX_HEADS]; // indexed by physical cyl/head
+    // Image file mapping (or decompressed image) that sector data may point
+    // into; freed with munmap.
+    void *mapped;
+    size_t mapped_len;
 } disk_t;
 
 void init_disk(disk_t *disk);
 void free_disk(disk_t *disk);
 
+// Return a track from the disk, allocating it if it doesn't exist yet.
+track_t *disk_track(disk_t *disk, int phys_cyl, int phys_head);
+
+// Return a track from the disk for reading. If the track hasn't been
+// allocated, return an empty track that's TRACK_UNKNOWN with no sectors.
+const track_t *disk_find_track(const disk_t *disk,
+                               int phys_cyl, int phys_head);
+
 // Create a ImageDisk-style timestamp comment.
 void make_disk_comment(const char *program, const char *version, disk_t *disk);
 
@@ -25,39 +25,307 @@
 */
 
 #include "disk.h"
+#include "events.h"
+#include "fdcsim.h"
 #include "imd.h"
+#include "imz.h"
+#include "profile.h"
+#include "trace.h"
+#include "trackhash.h"
 #include "util.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/fd.h>
 #include <linux/fdreg.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+typedef enum {
+    FLUSH_TRACK = 0,
+    FLUSH_CYL,
+    FLUSH_END
+} flush_policy_t;
+
+// The Linux floppy driver supports up to 8 drives (/dev/fd0-7).
+#define MAX_DRIVES 8
+
+// The most disks that can be given with -D.
+#define MAX_SIM_IMAGES 256
+
+// How often to check for a new disk in station mode, in seconds.
+#define STATION_POLL_INTERVAL 0.5
+
 static struct args {
     bool always_probe;
     bool no_reprobe;
+    int probe_revs;
+    bool resume;
     int max_tries;
     int recalibrate_tries;
-    int drive;
+    int retry_pass_tries;
+    int drives[MAX_DRIVES];
+    int num_drives;
     int tracks;
-    int cyl_scale;
     bool read_comment;
     int ignore_sector;
-    const char *image_filename;
+    flush_policy_t flush_policy;
+    const char *profile_filename;
+    const data_mode_t *mode_hint;
+    bool show_timing;
+    const char *trace_filename;
+    int events_fd;
+    bool write_hashes;
+    bool station;
+    const char *sim_images[MAX_SIM_IMAGES];
+    int num_sim_images;
+    const char *sim_errors;
+    const char *sim_replay;
+    const char *image_filenames[MAX_DRIVES];
+    int num_images;
 } args;
-static int dev_fd;
 
-static int drive_selector(int head) {
-    return (head << 2) | args.drive;
+// The comment read from stdin, to be added to every image.
+static char *extra_comment;
+static int extra_comment_len;
+
+// Held while reading or writing the profile file, which is shared between
+// drives.
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The state of one drive that we're reading from.
+typedef struct {
+    int drive;
+    int dev_fd;
+    int cyl_scale;
+    const data_mode_t *last_mode[MAX_HEADS]; // that probing found on each head
+    const char *image_filename;
+    buffer_t progress; // progress output not yet shown
+    double rotation; // seconds per revolution
+    phase_t phase; // what commands are being sent for
+    int try; // how many times we've tried to read this track before
+    timing_t timing; // since the last timing summary
+    timing_t disk_timing;
+    double last_flush; // when progress output was last flushed
+    fdc_sim_t *sim; // if not NULL, commands go to the simulator
+    // The format of the last disk read, to try first on the next one.
+    profile_t last_profile;
+    bool have_last_profile;
+} drive_t;
+
+static int drive_selector(const drive_t *drive, int head) {
+    return (head << 2) | drive->drive;
+}
+
+// Write progress output for a drive.
+//
+// With one drive, this goes straight to stdout. With several drives being read
+// at once, each drive's output is collected until it's got a complete line,
+// and then the line is shown prefixed with the drive's name -- so the lines
+// from different drives don't get mixed up.
+static void progress(drive_t *drive, const char *format, ...) {
+    va_list ap;
+
+    if (args.num_drives == 1) {
+        va_start(ap, format);
+        vprintf(format, ap);
+        va_end(ap);
+        return;
+    }
+
+    va_start(ap, format);
+    char dummy;
+    const int count = vsnprintf(&dummy, 0, format, ap);
+    va_end(ap);
+
+    buffer_t *buf = &drive->progress;
+    va_start(ap, format);
+    vsnprintf((char *) buffer_reserve(buf, count + 1), count + 1, format, ap);
+    va_end(ap);
+    buf->len += count;
+
+    // Show any complete lines.
+    uint8_t *start = buf->data;
+    uint8_t *end = buf->data + buf->len;
+    uint8_t *nl;
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        flockfile(stdout);
+        printf("fd%d: %.*s\n", drive->drive, (int) (nl - start), start);
+        fflush(stdout);
+        funlockfile(stdout);
+        start = nl + 1;
+    }
+    buf->len = end - start;
+    memmove(buf->data, start, buf->len);
+}
+
+// Make sure that progress output for a drive has been displayed recently.
+// This is called after each sector, so to avoid lots of tiny writes (which
+// are slow over a network), it only flushes every so often.
+static void progress_flush(drive_t *drive) {
+    const double min_interval = 0.1;
+
+    if (args.num_drives == 1) {
+        const double now = trace_now();
+        if (now - drive->last_flush >= min_interval) {
+            fflush(stdout);
+            drive->last_flush = now;
+        }
+    }
+    // With several drives, output only appears a line at a time.
+}
+
+static const char *SECTOR_STATUS_NAMES[] = {
+    "missing",
+    "bad",
+    "good",
+};
+
+// Report the result of reading a sector, both as an event and in the
+// progress output -- where it's shown as mark after the sector number.
+static void report_sector(drive_t *drive, const track_t *track,
+                          const sector_t *sector, char mark) {
+    progress(drive, "%c", mark);
+
+    write_event("sector", drive->drive,
+                "\"cyl\": %d, \"head\": %d, \"sector\": %d, "
+                "\"status\": \"%s\", \"deleted\": %s",
+                track->phys_cyl, track->phys_head, sector->log_sector,
+                SECTOR_STATUS_NAMES[sector->status],
+                sector->deleted ? "true" : "false");
+}
+
+// Count the sectors in a track that have been read.
+static int count_good_sectors(const track_t *track) {
+    int count = 0;
+    for (int i = 0; i < track->num_sectors; i++) {
+        if (track->sectors[i].status == SECTOR_GOOD) count++;
+    }
+    return count;
+}
+
+static void report_track_start(drive_t *drive, const track_t *track) {
+    write_event("track_start", drive->drive, "\"cyl\": %d, \"head\": %d",
+                track->phys_cyl, track->phys_head);
+}
+
+static void report_track_end(drive_t *drive, const track_t *track, bool ok) {
+    write_event("track_end", drive->drive,
+                "\"cyl\": %d, \"head\": %d, \"ok\": %s, "
+                "\"good\": %d, \"sectors\": %d",
+                track->phys_cyl, track->phys_head, ok ? "true" : "false",
+                count_good_sectors(track), track->num_sectors);
+}
+
+// Return the current time for timing commands -- which is simulated time
+// if the drive is simulated.
+static double drive_now(const drive_t *drive) {
+    if (drive->sim != NULL) return drive->sim->now;
+    return trace_now();
+}
+
+// Wait for a while -- which just advances the simulated time if the drive is
+// simulated.
+static void drive_sleep(drive_t *drive, double seconds) {
+    if (drive->sim != NULL) {
+        drive->sim->now += seconds;
+        return;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = (time_t) seconds;
+    ts.tv_nsec = (long) ((seconds - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        // Keep waiting.
+    }
+}
+
+// Account for a command that took from start until now.
+// id is the sector address from the reply, or NULL if there wasn't one.
+static void record_command(drive_t *drive, const char *name, phase_t phase,
+                           double start, int cyl, int head,
+                           const uint8_t *status, int num_status,
+                           const uint8_t *id, bool ok) {
+    const double now = drive_now(drive);
+
+    drive->timing.time[phase] += now - start;
+    drive->timing.commands++;
+
+    trace_event_t event;
+    event.start = start;
+    event.duration = now - start;
+    event.drive = drive->drive;
+    event.command = name;
+    event.phase = phase;
+    event.cyl = cyl;
+    event.head = head;
+    event.try = drive->try;
+    event.ok = ok;
+    event.num_status = num_status;
+    for (int i = 0; i < num_status; i++) {
+        event.status[i] = status[i];
+    }
+    event.have_id = (id != NULL);
+    if (id != NULL) {
+        memcpy(event.id, id, sizeof event.id);
+    }
+    write_trace(&event);
+}
+
+// Send a raw command to the drive, and account for it.
+static void fd_raw_command(drive_t *drive, const char *name, phase_t phase,
+                           struct floppy_raw_cmd *cmd) {
+    const double start = drive_now(drive);
+    if (drive->sim != NULL) {
+        fdc_sim_command(drive->sim, name, cmd);
+    } else if (ioctl(drive->dev_fd, FDRAWCMD, cmd) < 0) {
+        die_errno("%s failed", name);
+    }
+
+    const int num_status = (cmd->reply_count < 3) ? cmd->reply_count : 3;
+    // If ST0 interrupt code is 00, success.
+    const bool ok = num_status > 0 && ((cmd->reply[0] >> 6) & 3) == 0;
+    // READ ID and READ DATA replies end with C, H, R and N.
+    const uint8_t *id = (cmd->reply_count >= 7) ? &cmd->reply[3] : NULL;
+    record_command(drive, name, phase, start, cmd->track,
+                   (cmd->cmd[1] >> 2) & 1, cmd->reply, num_status, id, ok);
+}
+
+// Show a summary of the time spent on commands since the last summary, if
+// we've been asked to, and add it to the disk's total.
+static void show_timing(drive_t *drive, const char *label) {
+    timing_t *timing = &drive->timing;
+
+    if (args.show_timing && timing->commands > 0) {
+        progress(drive, "Time  %s: probe %.0fms, read %.0fms, "
+                        "recalibrate %.0fms, %d commands, %d retries",
+                 label,
+                 timing->time[PHASE_PROBE] * 1000.0,
+                 timing->time[PHASE_READ] * 1000.0,
+                 timing->time[PHASE_RECALIBRATE] * 1000.0,
+                 timing->commands, timing->retries);
+        if (timing->sectors > 0) {
+            progress(drive, ", %.2f revs/sector",
+                     timing->time[PHASE_READ]
+                     / drive->rotation / timing->sectors);
+        }
+        progress(drive, "\n");
+    }
+
+    add_timing(timing, &drive->disk_timing);
+    init_timing(timing);
 }
 
 // Apply a mode specification to a floppy_raw_cmd -- which must contain only
@@ -77,18 +345,48 @@ static void apply_data_mode(const data_mode_t *mode,
 // Give up if it's stepped 80 tracks and not found track 0 (so you probably
 // want to call this twice, in practice, in case someone's stepped to track
 // 80+).
-static void fd_recalibrate(struct floppy_raw_cmd *cmd) {
+static void fd_recalibrate(drive_t *drive, struct floppy_raw_cmd *cmd) {
     memset(cmd, 0, sizeof *cmd);
 
     // 0x07 is RECALIBRATE.
     cmd->cmd[0] = 0x07;
-    cmd->cmd[1] = drive_selector(0);
+    cmd->cmd[1] = drive_selector(drive, 0);
     cmd->cmd_count = 2;
     cmd->flags = FD_RAW_INTR;
 
-    if (ioctl(dev_fd, FDRAWCMD, cmd) < 0) {
-        die_errno("FD_RECALIBRATE failed");
+    fd_raw_command(drive, "FD_RECALIBRATE", PHASE_RECALIBRATE, cmd);
+}
+
+// Return whether the drive's disk change line is set -- which means that the
+// disk has been taken out since the head last stepped, or that there's no
+// disk in the drive. If step is true, step the head out and back first,
+// which resets the line if there's a disk in the drive now.
+// The head is left on track 0, and the motor isn't turned on.
+static bool poll_disk_change(drive_t *drive, bool step) {
+    drive->phase = PHASE_RECALIBRATE;
+    struct floppy_raw_cmd cmd;
+
+    if (step) {
+        memset(&cmd, 0, sizeof cmd);
+        // 0x0F is SEEK.
+        cmd.cmd[0] = 0x0F;
+        cmd.cmd[1] = drive_selector(drive, 0);
+        cmd.cmd[2] = 1;
+        cmd.cmd_count = 3;
+        cmd.flags = FD_RAW_INTR | FD_RAW_NO_MOTOR;
+        fd_raw_command(drive, "FD_SEEK", PHASE_RECALIBRATE, &cmd);
     }
+
+    // As fd_recalibrate, but without the motor.
+    memset(&cmd, 0, sizeof cmd);
+    cmd.cmd[0] = 0x07;
+    cmd.cmd[1] = drive_selector(drive, 0);
+    cmd.cmd_count = 2;
+    cmd.flags = FD_RAW_INTR | FD_RAW_NO_MOTOR;
+    fd_raw_command(drive, "FD_RECALIBRATE", PHASE_RECALIBRATE, &cmd);
+
+    // On output, this bit is FD_RAW_DISK_CHANGE.
+    return (cmd.flags & FD_RAW_DISK_CHANGE) != 0;
 }
 
 // Read ID field of whatever sector reaches the head next.
@@ -100,20 +398,19 @@ static void fd_recalibrate(struct floppy_raw_cmd *cmd) {
 // cmd->reply[4] is logical head
 // cmd->reply[5] is logical sector
 // (128 << cmd->reply[6]) is sector size
-static bool fd_readid(const track_t *track, struct floppy_raw_cmd *cmd) {
+static bool fd_readid(drive_t *drive, const track_t *track,
+                      struct floppy_raw_cmd *cmd) {
     memset(cmd, 0, sizeof *cmd);
 
     // 0x0A is READ ID.
     cmd->cmd[0] = 0x0A;
-    cmd->cmd[1] = drive_selector(track->phys_head);
+    cmd->cmd[1] = drive_selector(drive, track->phys_head);
     cmd->cmd_count = 2;
     cmd->flags = FD_RAW_INTR | FD_RAW_NEED_SEEK;
-    cmd->track = track->phys_cyl * args.cyl_scale;
+    cmd->track = track->phys_cyl * drive->cyl_scale;
     apply_data_mode(track->data_mode, cmd);
 
-    if (ioctl(dev_fd, FDRAWCMD, cmd) < 0) {
-        die_errno("FD_READID failed");
-    }
+    fd_raw_command(drive, "FD_READID", drive->phase, cmd);
     if (cmd->reply_count < 7) {
         die("FD_READID returned short reply");
     }
@@ -125,28 +422,36 @@ static bool fd_readid(const track_t *track, struct floppy_raw_cmd *cmd) {
 // Read data from sectors with consecutive logical sector IDs.
 // The sector_t given is for the first sector to be read.
 //
+// If multi_track is true, this reads to the end of the track (which must be
+// given as end_sector), then continues from sector 1 on the other head.
+//
 // Return true if all data was read. Upon return:
 // cmd->reply[0]--[2] are ST0-ST2
 // cmd->reply[3] is logical cyl
 // cmd->reply[4] is logical head
 // cmd->reply[5] is logical sector
 // (128 << cmd->reply[6]) is sector size
-static bool fd_read(const track_t *track, const sector_t *sector,
+static bool fd_read(drive_t *drive,
+                    const track_t *track, const sector_t *sector,
+                    bool multi_track, int end_sector,
                     unsigned char *buf, size_t buf_size,
                     struct floppy_raw_cmd *cmd) {
     memset(cmd, 0, sizeof *cmd);
 
     // 0x06 is READ DATA.
-    // (0x80 would be MT - span multiple tracks.)
+    // (0x80 is MT - span multiple tracks.)
     // (0x20 would be SK - skip deleted data.)
     cmd->cmd[0] = 0x06;
-    cmd->cmd[1] = drive_selector(track->phys_head);
+    if (multi_track) {
+        cmd->cmd[0] |= 0x80;
+    }
+    cmd->cmd[1] = drive_selector(drive, track->phys_head);
     cmd->cmd[2] = sector->log_cyl;
     cmd->cmd[3] = sector->log_head;
     cmd->cmd[4] = sector->log_sector;
     cmd->cmd[5] = track->sector_size_code;
     // End of track sector number.
-    cmd->cmd[6] = 0xFF;
+    cmd->cmd[6] = end_sector;
     // Intersector gap. There's a complex table of these for various formats in
     // the M1543C datasheet; the fdutils manual says it doesn't make any
     // difference for read. FIXME: hmm.
@@ -159,16 +464,14 @@ static bool fd_read(const track_t *track, const sector_t *sector,
     }
     cmd->cmd_count = 9;
     cmd->flags = FD_RAW_READ | FD_RAW_INTR | FD_RAW_NEED_SEEK;
-    cmd->track = track->phys_cyl * args.cyl_scale;
+    cmd->track = track->phys_cyl * drive->cyl_scale;
     cmd->data = buf;
     cmd->length = buf_size;
     apply_data_mode(track->data_mode, cmd);
 
-    if (ioctl(dev_fd, FDRAWCMD, cmd) < 0) {
-        die_errno("FD_READID failed");
-    }
+    fd_raw_command(drive, "FD_READ", drive->phase, cmd);
     if (cmd->reply_count < 7) {
-        die("FD_READID returned short reply");
+        die("FD_READ returned short reply");
     }
 
     // If we're reading multiple sectors but hit a deleted sector, then the
@@ -183,7 +486,7 @@ static bool fd_read(const track_t *track, const sector_t *sector,
 }
 
 // Read a sector ID and append it to the sectors in the track.
-static sector_t *track_readid(track_t *track) {
+static sector_t *track_readid(drive_t *drive, track_t *track) {
     struct floppy_raw_cmd cmd;
 
     if (track->num_sectors >= MAX_SECS) {
@@ -191,17 +494,18 @@ static sector_t *track_readid(track_t *track) {
     }
 
     do {
-        if (!fd_readid(track, &cmd)) {
+        if (!fd_readid(drive, track, &cmd)) {
             return NULL;
         }
     } while (args.ignore_sector == cmd.reply[5]);
 
-    sector_t *sector = &(track->sectors[track->num_sectors]);
+    resize_track(track, track->num_sectors + 1);
+    sector_t *sector = &(track->sectors[track->num_sectors - 1]);
     free_sector(sector);
     sector->log_cyl = cmd.reply[3];
     sector->log_head = cmd.reply[4];
     sector->log_sector = cmd.reply[5];
-    sector->phys_sector = track->num_sectors;
+    sector->phys_sector = track->num_sectors - 1;
 
     if (track->sector_size_code != -1
         && track->sector_size_code != cmd.reply[6]) {
@@ -211,16 +515,71 @@ static sector_t *track_readid(track_t *track) {
     }
     track->sector_size_code = cmd.reply[6];
 
-    track->num_sectors++;
     return sector;
 }
 
+// Work out which order to try the data modes in when probing a track.
+// Modes that have worked before are most likely to work again, so try the
+// user's hint first, then the last mode found on the same head, then on the
+// other head, then the rest in the order of DATA_MODES.
+// order must have room for 3 more modes than DATA_MODES has.
+// Return the number of modes in order.
+static int probe_mode_order(const drive_t *drive, const track_t *track,
+                            const data_mode_t **order) {
+    const data_mode_t *preferred[] = {
+        args.mode_hint,
+        drive->last_mode[track->phys_head],
+        drive->last_mode[!track->phys_head],
+    };
+    const int num_preferred = sizeof preferred / sizeof *preferred;
+
+    int count = 0;
+    for (int i = 0; i < num_preferred; i++) {
+        if (preferred[i] != NULL) {
+            order[count++] = preferred[i];
+        }
+    }
+    for (int i = 0; DATA_MODES[i].name != NULL; i++) {
+        order[count++] = &DATA_MODES[i];
+    }
+
+    // Remove duplicates, keeping the first occurrence.
+    int num_modes = 0;
+    for (int i = 0; i < count; i++) {
+        bool dup = false;
+        for (int j = 0; j < num_modes; j++) {
+            if (order[j] == order[i]) {
+                dup = true;
+            }
+        }
+        if (!dup) {
+            order[num_modes++] = order[i];
+        }
+    }
+    return num_modes;
+}
+
+// Report that probing a track failed, and why. Returns false.
+static bool probe_failed(drive_t *drive, const track_t *track,
+                         const char *reason) {
+    progress(drive, " %s\n", reason);
+
+    char *quoted = json_quote(reason);
+    write_event("probe", drive->drive,
+                "\"cyl\": %d, \"head\": %d, \"ok\": false, \"reason\": %s",
+                track->phys_cyl, track->phys_head, quoted);
+    free(quoted);
+
+    return false;
+}
+
 // Identify the data mode and sector layout of a track.
-static bool probe_track(track_t *track) {
+static bool probe_track(drive_t *drive, track_t *track) {
     free_track(track);
+    drive->phase = PHASE_PROBE;
 
-    printf("Probe %2d.%d:", track->phys_cyl, track->phys_head);
-    fflush(stdout);
+    progress(drive, "Probe %2d.%d:", track->phys_cyl, track->phys_head);
+    progress_flush(drive);
 
     // We want to make sure that we start reading sector IDs from the index
     // hole. However, there isn't really a good way of finding out where the
@@ -231,121 +590,205 @@ static bool probe_track(track_t *track) {
     // before we have a successful one -- that way, the successful one will
     // definitely be at the start of the track!
     //
-    // The first readid we'll do in the loop below will be with DATA_MODES[0],
+    // The first readid we'll do in the loop below will be with order[0],
     // so do a different one to ensure that at least one of them will fail.
-    track->data_mode = &DATA_MODES[1];
-    track_readid(track);
+    int max_modes = 3;
+    for (int i = 0; DATA_MODES[i].name != NULL; i++) {
+        max_modes++;
+    }
+    const data_mode_t *order[max_modes];
+    const int num_modes = probe_mode_order(drive, track, order);
+    track->data_mode = order[1];
+    track_readid(drive, track);
 
     // Try all the possible data modes until we can read a sector ID.
     track->num_sectors = 0;
     track->sector_size_code = -1;
     for (int i = 0; ; i++) {
-        if (DATA_MODES[i].name == NULL) {
-            printf(" unknown data mode\n");
-            return false;
+        if (i == num_modes) {
+            return probe_failed(drive, track, "unknown data mode");
         }
 
-        track->data_mode = &DATA_MODES[i];
-        if (track_readid(track) != NULL) {
+        track->data_mode = order[i];
+        if (track_readid(drive, track) != NULL) {
             // This succeeded -- so we're at the start of the track
             // (see above).
             break;
         }
     }
 
-    // Track how many times we've seen each logical sector.
-    int seen_secs[MAX_SECS];
-    for (int i = 0; i < MAX_SECS; i++) {
-        seen_secs[i] = 0;
-    }
-
     // FIXME: if the first sector wasn't the lowest-numbered one, this is
     // highly suspicious -- dump it and start again unless it does the same
     // thing a couple of times
 
-    // Read sector IDs until we've seen the complete sequence several times.
-    int count = 0;
-    while (true) {
-        sector_t *sector = track_readid(track);
-        if (sector == NULL) {
-            printf(" readid failed\n");
-            return false;
-        }
-
-        seen_secs[sector->log_sector]++;
-
-        // We can be reasonably confident that we've got them all once we've
-        // seen each sector at least min_seen times.
-        const int min_seen = 3;
-        bool seen_all = true;
-        for (int i = 0; i < MAX_SECS; i++) {
-            if (seen_secs[i] != 0 && seen_secs[i] < min_seen) {
-                seen_all = false;
-            }
-        }
-        if (seen_all) break;
-
+    // Read sector IDs until the first one comes round again, which marks the
+    // end of a revolution. Then read enough to check that the sequence
+    // repeats consistently for a few more revolutions, giving up as soon as
+    // it doesn't. If we're missing sectors, this has a reasonable chance of
+    // spotting it.
+    // FIXME: There should be an option to override this for *really* dodgy
+    // disks, and just assume the sectors are in order.
+    int end_pos = 0; // sectors per revolution, once we know
+    int want_sectors = 0; // sector IDs to read in total, once we know
+    for (int count = 0; ; count++) {
         // Make sure we don't get stuck in this loop forever (although this is
         // highly unlikely).
         const int max_count = 100;
-        if (count > max_count) {
-            printf(" spent too long looking for sector IDs\n");
-            return false;
+        if (end_pos == 0 && count > max_count) {
+            return probe_failed(drive, track, "couldn't find repeat of first sector");
         }
-    }
 
-    // Find where the first sector repeats, and cut the sequence off there.
-    int end_pos = 1;
-    while (!same_sector_addr(&(track->sectors[0]),
-                             &(track->sectors[end_pos]))) {
-        end_pos++;
-        if (end_pos == track->num_sectors) {
-            printf(" couldn't find repeat of first sector\n");
-            return false;
+        const sector_t *sector = track_readid(drive, track);
+        if (sector == NULL) {
+            return probe_failed(drive, track, "readid failed");
         }
-    }
-
-    // Check that the sequence repeated itself consistently after that.
-    // If we're missing sectors, this has a reasonable chance of spotting it.
-    // FIXME: There should be an option to override this for *really* dodgy
-    // disks, and just assume the sectors are in order.
-    for (int pos = end_pos; pos < track->num_sectors; pos++) {
-        if (!same_sector_addr(&(track->sectors[pos % end_pos]),
-                              &(track->sectors[pos]))) {
-            printf("  sector sequence did not repeat consistently\n");
-            return false;
+        const int pos = track->num_sectors - 1;
+
+        if (end_pos == 0) {
+            if (same_sector_addr(&(track->sectors[0]), sector)) {
+                end_pos = pos;
+                want_sectors = end_pos * (1 + args.probe_revs);
+                if (want_sectors > MAX_SECS) {
+                    want_sectors = MAX_SECS;
+                }
+            }
+        } else if (!same_sector_addr(&(track->sectors[pos % end_pos]),
+                                     sector)) {
+            return probe_failed(drive, track,
+                                "sector sequence did not repeat consistently");
         }
+
+        if (end_pos != 0 && track->num_sectors >= want_sectors) break;
     }
 
     // Cut the sequence to length.
     track->num_sectors = end_pos;
 
     // Show what we found.
-    printf(" %s %dx%d:",
-           track->data_mode->name,
-           track->num_sectors, sector_bytes(track->sector_size_code));
+    progress(drive, " %s %dx%d:",
+             track->data_mode->name,
+             track->num_sectors, sector_bytes(track->sector_size_code));
     for (int i = 0; i < track->num_sectors; i++) {
-        printf(" %d", track->sectors[i].log_sector);
+        progress(drive, " %d", track->sectors[i].log_sector);
     }
-    printf("\n");
+    progress(drive, "\n");
 
+    write_event("probe", drive->drive,
+                "\"cyl\": %d, \"head\": %d, \"ok\": true, "
+                "\"mode\": \"%s\", \"sectors\": %d, \"size\": %d",
+                track->phys_cyl, track->phys_head, track->data_mode->name,
+                track->num_sectors, sector_bytes(track->sector_size_code));
+
+    drive->last_mode[track->phys_head] = track->data_mode;
     track->status = TRACK_PROBED;
     return true;
 }
 
+// Find which sector of a track will reach the head next, by reading the ID of
+// the one that's passing now. Return its physical index, or 0 if the ID
+// couldn't be read or isn't in the track.
+static int next_phys_sector(drive_t *drive, const track_t *track) {
+    struct floppy_raw_cmd cmd;
+
+    if (!fd_readid(drive, track, &cmd)) {
+        return 0;
+    }
+
+    for (int i = 0; i < track->num_sectors; i++) {
+        const sector_t *sector = &(track->sectors[i]);
+        if (sector->log_cyl == cmd.reply[3]
+            && sector->log_head == cmd.reply[4]
+            && sector->log_sector == cmd.reply[5]) {
+            return (i + 1) % track->num_sectors;
+        }
+    }
+    return 0;
+}
+
+// Count how many sectors starting at physical index first are needed and have
+// consecutive logical IDs, so that they can be read with one command.
+static int count_sector_run(const track_t *track, const bool *need,
+                            int first) {
+    const sector_t *first_sector = &(track->sectors[first]);
+
+    int run = 1;
+    while (first + run < track->num_sectors && need[first + run]) {
+        const sector_t *sector = &(track->sectors[first + run]);
+        if (sector->log_cyl != first_sector->log_cyl
+            || sector->log_head != first_sector->log_head
+            || sector->log_sector != first_sector->log_sector + run) {
+            break;
+        }
+        run++;
+    }
+    return run;
+}
+
+// Return true if all of a track's sectors have been read.
+static bool track_complete(const track_t *track) {
+    if (track->status == TRACK_UNKNOWN) return false;
+
+    for (int i = 0; i < track->num_sectors; i++) {
+        if (track->sectors[i].status != SECTOR_GOOD) return false;
+    }
+    return true;
+}
+
+// Probe a track again, when some of its sectors have already been read using
+// a guessed layout. The probe goes into a scratch track, and the sectors that
+// were read are carried over to it, so they aren't lost if the guess was
+// partly right. If the probe fails, or doesn't find all of those sectors,
+// keep the guessed layout.
+static void reprobe_track(drive_t *drive, track_t *track) {
+    track_t probed;
+    init_track(track->phys_cyl, track->phys_head, &probed);
+
+    bool found_all = probe_track(drive, &probed)
+                     && probed.sector_size_code == track->sector_size_code;
+    for (int i = 0; i < track->num_sectors && found_all; i++) {
+        const sector_t *old = &(track->sectors[i]);
+        if (old->status != SECTOR_GOOD) continue;
+
+        found_all = false;
+        for (int j = 0; j < probed.num_sectors; j++) {
+            sector_t *sector = &(probed.sectors[j]);
+            if (!same_sector_addr(sector, old)) continue;
+
+            memcpy(alloc_sector_data(&probed, sector), old->data,
+                   sector_bytes(probed.sector_size_code));
+            sector->status = SECTOR_GOOD;
+            sector->deleted = old->deleted;
+            found_all = true;
+        }
+    }
+
+    if (found_all) {
+        free_track(track);
+        *track = probed;
+    } else {
+        progress(drive, "Keep  %2d.%d: guessed layout\n",
+                 track->phys_cyl, track->phys_head);
+        free_track(&probed);
+        track->status = TRACK_GUESSED;
+    }
+}
+
 // Try to read any sectors in a track that haven't already been read.
 // Returns true if everything has been read.
-static bool read_track(track_t *track) {
+static bool read_track_sectors(drive_t *drive, track_t *track) {
     struct floppy_raw_cmd cmd;
 
     if (track->status == TRACK_UNKNOWN) {
-        if (!probe_track(track)) {
+        if (count_good_sectors(track) > 0) {
+            reprobe_track(drive, track);
+        } else if (!probe_track(drive, track)) {
             return false;
         }
     }
+    drive->phase = PHASE_READ;
 
-    printf("Read  %2d.%d:", track->phys_cyl, track->phys_head);
-    fflush(stdout);
+    progress(drive, "Read  %2d.%d:", track->phys_cyl, track->phys_head);
+    progress_flush(drive);
 
     sector_t *lowest_sector, *highest_sector;
     bool contiguous;
@@ -354,6 +797,7 @@ static bool read_track(track_t *track) {
     const int sector_size = sector_bytes(track->sector_size_code);
     const int track_size = sector_size * track->num_sectors;
     unsigned char track_data[track_size];
+    uint8_t sector_data[sector_size];
     bool read_whole_track = false;
 
     // FIXME: Read with the flag set that means deleted sectors won't be
@@ -365,54 +809,105 @@ static bool read_track(track_t *track) {
         // Try reading the whole track to start with.
         // If this works, it's a lot faster than reading sector-by-sector.
         // The resulting data will be ordered by *logical* ID.
-        if (fd_read(track, lowest_sector, track_data, track_size, &cmd)) {
+        if (fd_read(drive, track, lowest_sector, false, 0xFF,
+                    track_data, track_size, &cmd)) {
             read_whole_track = true;
         }
     }
 
-    // Get sectors in physical order.
-    bool all_ok = true;
-    for (int i = 0; i < track->num_sectors; i++) {
-        sector_t *sector = &(track->sectors[i]);
+    if (read_whole_track) {
+        // Copy the data out in physical order.
+        for (int i = 0; i < track->num_sectors; i++) {
+            sector_t *sector = &(track->sectors[i]);
 
-        if (sector->status == SECTOR_GOOD) {
-            // Already got this one.
-            printf("    ");
-            continue;
+            if (sector->status == SECTOR_GOOD) {
+                // Already got this one.
+                progress(drive, "    ");
+                continue;
+            }
+
+            const int rel_sec = sector->log_sector - lowest_sector->log_sector;
+            memcpy(alloc_sector_data(track, sector),
+                   track_data + (sector_size * rel_sec), sector_size);
+
+            sector->status = SECTOR_GOOD;
+            sector->deleted = false;
+
+            progress(drive, "%3d", sector->log_sector);
+            report_sector(drive, track, sector, '*');
         }
 
-        uint8_t *data = malloc(sector_size);
-        if (data == NULL) {
-            die("malloc failed");
+        progress(drive, "\n");
+        return true;
+    }
+
+    // Work out which sectors we still need.
+    const int num_sectors = track->num_sectors;
+    bool need[num_sectors];
+    int num_needed = 0;
+    for (int i = 0; i < num_sectors; i++) {
+        need[i] = (track->sectors[i].status != SECTOR_GOOD);
+        if (need[i]) {
+            num_needed++;
         }
-        memset(data, 0, sector_size);
+    }
 
-        printf("%3d", sector->log_sector);
-        fflush(stdout);
+    // Read them in the order they'll reach the head, starting from wherever
+    // the head is now. (If there's only one, it doesn't matter.)
+    int pos = 0;
+    if (num_needed > 1) {
+        pos = next_phys_sector(drive, track);
+    }
 
-        if (read_whole_track) {
-            // We read this sector as part of the whole track. Success!
-            const int rel_sec = sector->log_sector - lowest_sector->log_sector;
-            memcpy(data, track_data + (sector_size * rel_sec), sector_size);
+    bool all_ok = true;
+    while (num_needed > 0) {
+        int i = pos;
+        while (!need[i]) {
+            i = (i + 1) % num_sectors;
+        }
+        sector_t *sector = &(track->sectors[i]);
 
-            sector->status = SECTOR_GOOD;
-            free(sector->data);
-            sector->data = data;
-            sector->deleted = false;
+        // If we need several sectors in a row with consecutive logical IDs,
+        // try reading them all in one go.
+        const int run = count_sector_run(track, need, i);
+        if (run > 1
+            && fd_read(drive, track, sector, false, 0xFF,
+                       track_data, sector_size * run, &cmd)) {
+            for (int j = i; j < i + run; j++) {
+                sector_t *run_sector = &(track->sectors[j]);
+
+                memcpy(alloc_sector_data(track, run_sector),
+                       track_data + (sector_size * (j - i)), sector_size);
+                run_sector->status = SECTOR_GOOD;
+                run_sector->deleted = false;
+                need[j] = false;
+
+                progress(drive, "%3d", run_sector->log_sector);
+                report_sector(drive, track, run_sector, '*');
+            }
+            progress_flush(drive);
 
-            printf("*");
+            num_needed -= run;
+            pos = (i + run) % num_sectors;
             continue;
         }
 
+        progress(drive, "%3d", sector->log_sector);
+        progress_flush(drive);
+
         // Read a single sector.
-        if (!fd_read(track, sector, data, sector_size, &cmd)) {
+        // This goes into a temporary buffer, so that we can keep any bad
+        // data we've already got if the read returns nothing this time.
+        uint8_t *data = sector_data;
+        memset(data, 0, sector_size);
+        if (!fd_read(drive, track, sector, false, 0xFF,
+                     data, sector_size, &cmd)) {
             // 0x20 is CRC Error in Data Field.
             if ((cmd.reply[2] & 0x20) != 0) {
                 // Bad data. Better than nothing, but we'll want to try again.
                 sector->status = SECTOR_BAD;
             } else {
                 // No data.
-                free(data);
                 data = NULL;
             }
             all_ok = false;
@@ -420,221 +915,1380 @@ static bool read_track(track_t *track) {
             // Success!
             sector->status = SECTOR_GOOD;
         }
+        need[i] = false;
+        num_needed--;
 
         if (data != NULL) {
             // 0x40 is Control Mark -- a deleted sector was read.
             sector->deleted = (cmd.reply[2] & 0x40) != 0;
 
-            free(sector->data);
-            sector->data = data;
+            memcpy(alloc_sector_data(track, sector), data, sector_size);
 
             if (sector->status == SECTOR_BAD) {
-                printf("?");
+                report_sector(drive, track, sector, '?');
             } else if (sector->deleted) {
-                printf("x");
+                report_sector(drive, track, sector, 'x');
             } else {
-                printf("+");
+                report_sector(drive, track, sector, '+');
             }
+
+            // The head's now just past this sector.
+            pos = (i + 1) % num_sectors;
         } else {
-            printf("-");
+            report_sector(drive, track, sector, '-');
+
+            // 0x04 in ST1 is No Data: the controller will have carried on
+            // until it saw the index hole twice, so we're back at the start
+            // of the track. Otherwise the ID was found but the data wasn't,
+            // so the head's just past this sector.
+            if ((cmd.reply[1] & 0x04) != 0) {
+                pos = 0;
+            } else {
+                pos = (i + 1) % num_sectors;
+            }
         }
-        fflush(stdout);
+        progress_flush(drive);
     }
 
-    printf("\n");
+    progress(drive, "\n");
     return all_ok;
 }
 
-static void probe_disk(disk_t *disk) {
-    // Probe both sides of cylinder 2 to figure out the disk geometry.
-    // (Cylinder 2 because we need a physical cylinder greater than 0 to figure
-    // out the logical-to-physical mapping, and because cylinder 0 may
-    // reasonably be unformatted on disks where it's a bootblock.)
-
-    const int cyl = 2;
-    for (int head = 0; head < disk->num_phys_heads; head++) {
-        probe_track(&(disk->tracks[cyl][head]));
+// Read whatever we still need from a track.
+// Returns true if everything has been read.
+static bool read_track(drive_t *drive, track_t *track) {
+    if (track_complete(track)) {
+        // Nothing left to read (e.g. it came from an existing image).
+        return true;
     }
 
-    track_t *side0 = &(disk->tracks[cyl][0]);
-    sector_t *sec0 = &(side0->sectors[0]);
-    track_t *side1 = &(disk->tracks[cyl][1]);
-    sector_t *sec1 = &(side1->sectors[0]);
+    report_track_start(drive, track);
+    const bool ok = read_track_sectors(drive, track);
+    report_track_end(drive, track, ok);
 
-    if (side0->status == TRACK_UNKNOWN && side1->status == TRACK_UNKNOWN) {
-        die("Cylinder 2 unreadable on either side");
-    } else if (side1->status == TRACK_UNKNOWN) {
-        printf("Single-sided disk\n");
-        disk->num_phys_heads = 1;
-    } else if (sec0->log_head == 0 && sec1->log_head == 0) {
-        printf("Double-sided disk with separate sides\n");
-    } else {
-        printf("Double-sided disk\n");
+    return ok;
+}
+
+// One revolution of sector IDs read from each side of a cylinder in each data
+// mode, for matching against profiles. Each side and mode is only read when a
+// profile needs it, and then only once, so checking many profiles costs no
+// more than checking one in each data mode they use.
+typedef struct {
+    int cyl;
+    int num_modes;
+    // These are indexed by head * num_modes + the mode's index in DATA_MODES.
+    bool *tried;
+    track_t *tracks; // with no sectors if nothing could be read
+    // Whether the last READ ID failed, leaving us at the index hole.
+    bool at_index;
+} fingerprint_t;
+
+static void init_fingerprint(int cyl, fingerprint_t *fp) {
+    fp->cyl = cyl;
+    fp->num_modes = 0;
+    while (DATA_MODES[fp->num_modes].name != NULL) {
+        fp->num_modes++;
     }
 
-    if (sec0->log_cyl * 2 == side0->phys_cyl) {
-        printf("Doublestepping required (40T disk in 80T drive)\n");
-        args.cyl_scale = 2;
-    } else if (sec0->log_cyl == side0->phys_cyl * 2) {
-        die("Can't read this disk (80T disk in 40T drive)");
-    } else if (sec0->log_cyl != side0->phys_cyl) {
-        printf("Mismatch between physical and logical cylinders\n");
+    const int num_tracks = MAX_HEADS * fp->num_modes;
+    fp->tried = calloc(num_tracks, sizeof *fp->tried);
+    fp->tracks = malloc(num_tracks * sizeof *fp->tracks);
+    if (fp->tried == NULL || fp->tracks == NULL) {
+        die("malloc failed");
+    }
+    for (int i = 0; i < num_tracks; i++) {
+        init_track(cyl, i / fp->num_modes, &fp->tracks[i]);
     }
+    fp->at_index = false;
 }
 
-static void process_floppy(void) {
-    char dev_filename[] = "/dev/fdX";
-    dev_filename[7] = '0' + args.drive;
-
-    dev_fd = open(dev_filename, O_ACCMODE | O_NONBLOCK);
-    if (dev_fd == -1) {
-        die_errno("cannot open %s", dev_filename);
+static void free_fingerprint(fingerprint_t *fp) {
+    for (int i = 0; i < MAX_HEADS * fp->num_modes; i++) {
+        free_track(&fp->tracks[i]);
     }
+    free(fp->tracks);
+    free(fp->tried);
+}
 
-    // Get BIOS parameters for drive.
-    // These aren't necessarily accurate (e.g. there's no BIOS type for an
-    // 80-track 5.25" DD drive)...
-    struct floppy_drive_params drive_params;
-    if (ioctl(dev_fd, FDGETDRVPRM, &drive_params) < 0) {
-        die_errno("cannot get drive parameters");
+// Return whether a side of the fingerprint's cylinder has been read in some
+// data mode.
+static bool fingerprint_found(const fingerprint_t *fp, int head) {
+    for (int i = 0; i < fp->num_modes; i++) {
+        const int index = head * fp->num_modes + i;
+        if (fp->tried[index] && fp->tracks[index].num_sectors > 0) {
+            return true;
+        }
     }
+    return false;
+}
 
-    // Reset the controller
-    if (ioctl(dev_fd, FDRESET, (void *) FD_RESET_ALWAYS) < 0) {
-        die_errno("cannot reset controller");
+// Return whether a side of the fingerprint's cylinder has been tried in every
+// data mode without finding anything.
+static bool fingerprint_all_failed(const fingerprint_t *fp, int head) {
+    for (int i = 0; i < fp->num_modes; i++) {
+        if (!fp->tried[head * fp->num_modes + i]) return false;
     }
-    // FIXME: comment in fdrawcmd.1 says reset may block -- not O_NONBLOCK?
+    return !fingerprint_found(fp, head);
+}
 
-    // Return to track 0
-    for (int i = 0; i < 2; i++) {
-        struct floppy_raw_cmd cmd;
-        fd_recalibrate(&cmd);
+// Return the sector IDs on one side of the fingerprint's cylinder in a data
+// mode, reading them if that hasn't been done yet.
+static track_t *fingerprint_track(drive_t *drive, fingerprint_t *fp,
+                                  int head, const data_mode_t *data_mode) {
+    const int index = head * fp->num_modes + (data_mode - DATA_MODES);
+    track_t *track = &fp->tracks[index];
+    if (fp->tried[index]) {
+        return track;
+    }
+    // A track is only in one data mode (as probe_track assumes), so if this
+    // side has been read in another, there's nothing to find in this one.
+    const bool found = fingerprint_found(fp, head);
+    fp->tried[index] = true;
+    free_track(track);
+    if (found) {
+        return track;
     }
 
-    disk_t disk;
-    init_disk(&disk);
-    make_disk_comment("dumpfloppy", "1", &disk);
-
-    if (args.read_comment) {
-        if (isatty(0)) {
-            fprintf(stderr, "Enter comment, terminated by EOF\n");
+    drive->phase = PHASE_PROBE;
+    progress(drive, "Match %2d.%d: %s", fp->cyl, head, data_mode->name);
+    progress_flush(drive);
+
+    // As in probe_track, do a readid in a different mode first, which
+    // should fail, so that we start reading from the index hole -- unless
+    // we're there already. A mode that's already failed on this side is the
+    // best bet.
+    if (!fp->at_index) {
+        track->data_mode = &DATA_MODES[0];
+        if (track->data_mode == data_mode) {
+            track->data_mode = &DATA_MODES[1];
         }
-
-        while (true) {
-            char buf[4096];
-            ssize_t count = read(0, buf, sizeof buf);
-            if (count == 0) break;
-            if (count < 0) {
-                die("read from stdin failed");
+        for (int i = 0; i < fp->num_modes; i++) {
+            const int other = head * fp->num_modes + i;
+            if (fp->tried[other] && fp->tracks[other].num_sectors == 0
+                && &DATA_MODES[i] != data_mode) {
+                track->data_mode = &DATA_MODES[i];
+                break;
             }
+        }
+        track->sector_size_code = -1;
+        track_readid(drive, track);
+        free_track(track);
+    }
 
-            alloc_append(buf, count, &disk.comment, &disk.comment_len);
+    // Read IDs until the first one comes round again.
+    track->data_mode = data_mode;
+    track->sector_size_code = -1;
+    fp->at_index = false;
+    while (track->num_sectors < MAX_SECS) {
+        const sector_t *sector = track_readid(drive, track);
+        if (sector == NULL) {
+            // Nothing there, or we lost it part way round.
+            fp->at_index = true;
+            free_track(track);
+            break;
+        }
+        if (track->num_sectors > 1
+            && same_sector_addr(&track->sectors[0], sector)) {
+            resize_track(track, track->num_sectors - 1);
+            break;
         }
     }
 
-    if (args.tracks == -1) {
-        disk.num_phys_cyls = drive_params.tracks;
+    if (track->num_sectors == 0) {
+        progress(drive, " nothing\n");
     } else {
-        disk.num_phys_cyls = args.tracks;
+        progress(drive, " %dx%d\n", track->num_sectors,
+                 sector_bytes(track->sector_size_code));
     }
-    disk.num_phys_heads = 2;
-
-    probe_disk(&disk);
-    disk.num_phys_cyls /= args.cyl_scale;
-
-    FILE *image = NULL;
-    if (args.image_filename != NULL) {
-        // FIXME: if the image exists already, load it
-        // (so the comment is preserved)
+    return track;
+}
 
-        image = fopen(args.image_filename, "wb");
-        if (image == NULL) {
-            die_errno("cannot open %s", args.image_filename);
+// Return whether anything on one side of the fingerprint's cylinder can be
+// read in any data mode. This is used to tell a single-sided disk from one
+// where side 1 just happens to be in a different format.
+static bool fingerprint_readable(drive_t *drive, fingerprint_t *fp,
+                                 int head) {
+    for (int i = 0; i < fp->num_modes; i++) {
+        if (fingerprint_track(drive, fp, head, &DATA_MODES[i])->num_sectors
+            > 0) {
+            return true;
         }
-
-        write_imd_header(&disk, image);
     }
+    return false;
+}
 
-    // FIXME: retry disk if not complete -- option for number of retries
-    // FIXME: if retrying, turn the motor off and on (delay? close?)
-    // FIXME: pull this out to a read_disk function
-    for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
-        for (int head = 0; head < disk.num_phys_heads; head++) {
-            track_t *track = &(disk.tracks[cyl][head]);
-
-            if (args.always_probe) {
-                // Don't assume a layout.
-            } else if (cyl > 0) {
-                // Try the layout of the previous cyl on the same head.
-                copy_track_layout(&disk, &(disk.tracks[cyl - 1][head]), track);
+// If no profile matched, the fingerprint still shows which data mode each side
+// can be read in (if it's been tried), so probe that mode first.
+static void hint_fingerprint_modes(drive_t *drive, const fingerprint_t *fp) {
+    for (int head = 0; head < MAX_HEADS; head++) {
+        for (int i = 0; i < fp->num_modes; i++) {
+            const int index = head * fp->num_modes + i;
+            if (fp->tried[index] && fp->tracks[index].num_sectors > 0) {
+                drive->last_mode[head] = &DATA_MODES[i];
+                break;
             }
+        }
+    }
+}
 
-            for (int try = 0; ; try++) {
-                if (try == args.max_tries) {
-                    // Tried too many times; give up.
-                    break;
-                }
-
-                if (read_track(track)) {
-                    // Success!
-                    break;
-                }
-
-                if (track->status == TRACK_GUESSED && !args.no_reprobe) {
-                    // Maybe we guessed wrong. Probe and try again.
-                    track->status = TRACK_UNKNOWN;
-                }
+// Return whether a track's sector IDs are in the format described by one side
+// of a profile. The disk may not be in the same rotational position relative
+// to the index as when the profile was made, so the sequence can start
+// anywhere in the profile's list.
+static bool side_matches_profile(const profile_t *profile, int head,
+                                 const track_t *track) {
+    const profile_side_t *side = &profile->sides[head];
+    const int log_cyl = (track->phys_cyl / profile->cyl_scale)
+                        + side->cyl_offset;
+    const int n = side->num_sectors;
+
+    if (track->num_sectors != n
+        || track->sector_size_code != side->sector_size_code) {
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        const sector_t *sector = &track->sectors[i];
+        if (sector->log_cyl != log_cyl || sector->log_head != side->log_head) {
+            return false;
+        }
+    }
 
-                if (((try + 1) % args.recalibrate_tries) == 0) {
-                    // Seek back to track 0, in case the calibration has
-                    // drifted.
-                    struct floppy_raw_cmd cmd;
-                    fd_recalibrate(&cmd);
-                }
-            }
+    for (int start = 0; start < n; start++) {
+        bool same = true;
+        for (int i = 0; i < n && same; i++) {
+            same = (track->sectors[i].log_sector
+                    == side->log_sectors[(start + i) % n]);
+        }
+        if (same) return true;
+    }
+    return false;
+}
 
-            if (image != NULL) {
-                write_imd_track(track, image);
-                fflush(image);
+// See whether the fingerprint's cylinder matches a known profile. If so, use
+// it to set up the disk geometry, leave the cylinder probed, guess the layout
+// of cylinder 0, and return the profile's index; otherwise, return -1.
+static int probe_disk_profiles(drive_t *drive, disk_t *disk,
+                               fingerprint_t *fp,
+                               const profile_t *profiles, int num_profiles) {
+    for (int i = 0; i < num_profiles; i++) {
+        const profile_t *profile = &profiles[i];
+
+        bool match = true;
+        for (int head = 0; head < profile->num_heads && match; head++) {
+            const track_t *track
+                = fingerprint_track(drive, fp, head,
+                                    profile->sides[head].data_mode);
+            match = side_matches_profile(profile, head, track);
+        }
+        // A single-sided profile only matches if side 1 is really blank;
+        // otherwise this is a double-sided disk with the same format on
+        // side 0.
+        if (match && profile->num_heads < disk->num_phys_heads) {
+            match = !fingerprint_readable(drive, fp, 1);
+        }
+        if (!match) continue;
+
+        disk->num_phys_heads = profile->num_heads;
+        drive->cyl_scale = profile->cyl_scale;
+
+        for (int head = 0; head < profile->num_heads; head++) {
+            // Take the IDs we read as the probed layout.
+            const data_mode_t *data_mode = profile->sides[head].data_mode;
+            const int index = head * fp->num_modes + (data_mode - DATA_MODES);
+            track_t *track = disk_track(disk, fp->cyl, head);
+            free_track(track);
+            *track = fp->tracks[index];
+            init_track(fp->cyl, head, &fp->tracks[index]);
+            track->status = TRACK_PROBED;
+            drive->last_mode[head] = data_mode;
+
+            if (!args.always_probe) {
+                apply_profile(profile, disk_track(disk, 0, head));
             }
         }
+        return i;
     }
 
-    if (image != NULL) {
-        fclose(image);
-    }
-    free_disk(&disk);
-    close(dev_fd);
+    return -1;
 }
 
-static void usage(void) {
-    fprintf(stderr, "usage: dumpfloppy [OPTION]... [IMAGE-FILE]\n");
-    fprintf(stderr, "  -a         probe each track before reading\n");
+// Return whether both sides of a cylinder can be read with one multi-track
+// command. When the controller gets to the end of the first side, it carries
+// on from sector 1 with head 1 -- so both sides must have the same layout,
+// with contiguous sector IDs starting from 1, and logical heads 0 and 1.
+static bool can_read_cylinder(track_t *side0, track_t *side1) {
+    if (side0->status == TRACK_UNKNOWN || side1->status == TRACK_UNKNOWN) {
+        return false;
+    }
+    if (side0->data_mode != side1->data_mode
+        || side0->sector_size_code != side1->sector_size_code
+        || side0->num_sectors != side1->num_sectors
+        || side0->num_sectors < 1) {
+        return false;
+    }
+
+    track_t *sides[] = {side0, side1};
+    for (int head = 0; head < 2; head++) {
+        track_t *track = sides[head];
+
+        sector_t *lowest, *highest;
+        bool contiguous;
+        track_scan_sectors(track, &lowest, &highest, &contiguous);
+        if (!contiguous || lowest->log_sector != 1
+            || highest->log_sector != track->num_sectors) {
+            return false;
+        }
+
+        for (int i = 0; i < track->num_sectors; i++) {
+            const sector_t *sector = &(track->sectors[i]);
+            if (sector->log_cyl != side0->sectors[0].log_cyl
+                || sector->log_head != head) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Try to read both sides of a cylinder with a single multi-track command.
+// Returns true if everything has been read.
+static bool read_cylinder(drive_t *drive, track_t *side0, track_t *side1) {
+    struct floppy_raw_cmd cmd;
+    drive->phase = PHASE_READ;
+
+    const int sector_size = sector_bytes(side0->sector_size_code);
+    const int track_size = sector_size * side0->num_sectors;
+    unsigned char cyl_data[2 * track_size];
+
+    sector_t *lowest, *highest;
+    bool contiguous;
+    track_scan_sectors(side0, &lowest, &highest, &contiguous);
+
+    report_track_start(drive, side0);
+    report_track_start(drive, side1);
+    if (!fd_read(drive, side0, lowest, true, highest->log_sector,
+                 cyl_data, 2 * track_size, &cmd)) {
+        report_track_end(drive, side0, false);
+        report_track_end(drive, side1, false);
+        return false;
+    }
+
+    // The data is ordered by side, then by logical ID.
+    track_t *sides[] = {side0, side1};
+    for (int head = 0; head < 2; head++) {
+        track_t *track = sides[head];
+
+        progress(drive, "Read  %2d.%d:", track->phys_cyl, track->phys_head);
+        for (int i = 0; i < track->num_sectors; i++) {
+            sector_t *sector = &(track->sectors[i]);
+
+            if (sector->status == SECTOR_GOOD) {
+                // Already got this one.
+                progress(drive, "    ");
+                continue;
+            }
+
+            const int rel_sec = sector->log_sector - 1;
+            memcpy(alloc_sector_data(track, sector),
+                   cyl_data + (track_size * head) + (sector_size * rel_sec),
+                   sector_size);
+
+            sector->status = SECTOR_GOOD;
+            sector->deleted = false;
+
+            progress(drive, "%3d", sector->log_sector);
+            report_sector(drive, track, sector, '*');
+        }
+        progress(drive, "\n");
+        report_track_end(drive, track, true);
+    }
+
+    return true;
+}
+
+// Add a profile to the profile file, if it's not already there. Another
+// drive may have saved the same format since we loaded the file, so check
+// again with the lock held.
+static void save_new_profile(drive_t *drive, const profile_t *profile) {
+    pthread_mutex_lock(&profiles_lock);
+
+    profile_t *profiles;
+    const int num_profiles = load_profiles(args.profile_filename, &profiles);
+    bool known = false;
+    for (int i = 0; i < num_profiles; i++) {
+        if (same_profile(profile, &profiles[i])) {
+            known = true;
+        }
+    }
+    free(profiles);
+
+    if (!known) {
+        save_profile(args.profile_filename, profile);
+        progress(drive, "Saved new profile\n");
+    }
+
+    pthread_mutex_unlock(&profiles_lock);
+}
+
+// Returns NULL if it worked, or a description of the problem if the disk
+// can't be read.
+static const char *probe_disk(drive_t *drive, disk_t *disk) {
+    // Probe both sides of cylinder 2 to figure out the disk geometry.
+    // (Cylinder 2 because we need a physical cylinder greater than 0 to figure
+    // out the logical-to-physical mapping, and because cylinder 0 may
+    // reasonably be unformatted on disks where it's a bootblock.)
+
+    const int cyl = 2;
+    fingerprint_t fp;
+    init_fingerprint(cyl, &fp);
+
+    // In station mode, the next disk is most likely in the same format as
+    // the last one. (If the last disk was single-sided, this checks the
+    // new one's second side really is blank.)
+    if (drive->have_last_profile
+        && probe_disk_profiles(drive, disk, &fp,
+                               &drive->last_profile, 1) != -1) {
+        progress(drive, "Same format as the last disk\n");
+        free_fingerprint(&fp);
+        return NULL;
+    }
+
+    // If we've seen this format before, we don't need to probe it again.
+    profile_t *profiles = NULL;
+    int num_profiles = 0;
+    if (args.profile_filename != NULL) {
+        pthread_mutex_lock(&profiles_lock);
+        num_profiles = load_profiles(args.profile_filename, &profiles);
+        pthread_mutex_unlock(&profiles_lock);
+        const int i = probe_disk_profiles(drive, disk, &fp,
+                                          profiles, num_profiles);
+        if (i != -1) {
+            progress(drive, "Using saved profile %d\n", i + 1);
+            drive->last_profile = profiles[i];
+            drive->have_last_profile = true;
+            free(profiles);
+            free_fingerprint(&fp);
+            return NULL;
+        }
+    }
+    hint_fingerprint_modes(drive, &fp);
+
+    for (int head = 0; head < disk->num_phys_heads; head++) {
+        track_t *track = disk_track(disk, cyl, head);
+        if (fingerprint_all_failed(&fp, head)) {
+            // Matching has already tried every mode on this side.
+            free_track(track);
+            progress(drive, "Probe %2d.%d:", cyl, head);
+            probe_failed(drive, track, "unknown data mode");
+        } else {
+            probe_track(drive, track);
+        }
+    }
+    free_fingerprint(&fp);
+
+    track_t *side0 = disk_track(disk, cyl, 0);
+    track_t *side1 = disk_track(disk, cyl, 1);
+    // If a probe failed, look at an empty sector rather than its first one.
+    sector_t empty;
+    init_sector(&empty);
+    const sector_t *sec0 = &empty;
+    if (side0->num_sectors > 0) sec0 = &(side0->sectors[0]);
+    const sector_t *sec1 = &empty;
+    if (side1->num_sectors > 0) sec1 = &(side1->sectors[0]);
+
+    if (side0->status == TRACK_UNKNOWN && side1->status == TRACK_UNKNOWN) {
+        free(profiles);
+        return "Cylinder 2 unreadable on either side";
+    } else if (side1->status == TRACK_UNKNOWN) {
+        progress(drive, "Single-sided disk\n");
+        disk->num_phys_heads = 1;
+    } else if (sec0->log_head == 0 && sec1->log_head == 0) {
+        progress(drive, "Double-sided disk with separate sides\n");
+    } else {
+        progress(drive, "Double-sided disk\n");
+    }
+
+    if (sec0->log_cyl * 2 == side0->phys_cyl) {
+        progress(drive, "Doublestepping required (40T disk in 80T drive)\n");
+        drive->cyl_scale = 2;
+    } else if (sec0->log_cyl == side0->phys_cyl * 2) {
+        free(profiles);
+        return "Can't read this disk (80T disk in 40T drive)";
+    } else if (sec0->log_cyl != side0->phys_cyl) {
+        progress(drive, "Mismatch between physical and logical cylinders\n");
+    }
+
+    profile_t profile;
+    const bool have_profile = make_profile(disk, cyl, drive->cyl_scale,
+                                           &profile);
+    drive->last_profile = profile;
+    drive->have_last_profile = have_profile;
+
+    free(profiles);
+    if (args.profile_filename != NULL && have_profile) {
+        save_new_profile(drive, &profile);
+    }
+    return NULL;
+}
+
+// Try to read a track, up to tries times.
+// Returns true if everything has been read.
+static bool read_track_retrying(drive_t *drive, track_t *track, int tries) {
+    for (int try = 0; try < tries; try++) {
+        drive->try = try;
+        if (try > 0) {
+            drive->timing.retries++;
+        }
+
+        if (read_track(drive, track)) {
+            // Success!
+            return true;
+        }
+
+        if (track->status == TRACK_GUESSED && !args.no_reprobe) {
+            // Maybe we guessed wrong. Probe and try again.
+            track->status = TRACK_UNKNOWN;
+        }
+
+        if (((try + 1) % args.recalibrate_tries) == 0) {
+            // Seek back to track 0, in case the calibration has drifted.
+            struct floppy_raw_cmd cmd;
+            fd_recalibrate(drive, &cmd);
+        }
+    }
+
+    // Tried too many times; give up.
+    return false;
+}
+
+// The number of encoded tracks that can be waiting to be written.
+#define WRITE_QUEUE_LEN 8
+
+// Writes encoded tracks to an image in a separate thread, so that slow
+// output doesn't hold up reading from the drive.
+typedef struct {
+    FILE *image;
+    // If not NULL, the image is an .IMZ container, and each record is
+    // compressed (in the writer thread) before it's written.
+    imz_writer_t *imz;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    // A ring of queued records, starting from first.
+    buffer_t queue[WRITE_QUEUE_LEN];
+    bool flush[WRITE_QUEUE_LEN];
+    int first, count;
+    bool done;
+    // If not NULL, the hash of each track queued is recorded here.
+    disk_hashes_t *hashes;
+} image_writer_t;
+
+static void *image_writer_worker(void *writer_v) {
+    image_writer_t *writer = writer_v;
+
+    pthread_mutex_lock(&writer->lock);
+    while (true) {
+        if (writer->count == 0) {
+            if (writer->done) break;
+            pthread_cond_wait(&writer->changed, &writer->lock);
+            continue;
+        }
+
+        // The reader won't touch this slot until we've removed it from the
+        // queue, so we don't need to hold the lock while writing it.
+        buffer_t *buf = &writer->queue[writer->first];
+        const bool flush = writer->flush[writer->first];
+        pthread_mutex_unlock(&writer->lock);
+
+        if (writer->imz != NULL) {
+            write_imz_track(buf->data, buf->len, writer->imz);
+        } else if (fwrite(buf->data, 1, buf->len, writer->image)
+                   != buf->len) {
+            die_errno("cannot write image");
+        }
+        if (flush) {
+            fflush(writer->image);
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        writer->first = (writer->first + 1) % WRITE_QUEUE_LEN;
+        writer->count--;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+// Start writing an image, beginning with the disk's comment.
+static void start_image_writer(image_writer_t *writer, const disk_t *disk,
+                               FILE *image) {
+    writer->image = image;
+    if (writer->imz != NULL) {
+        start_imz(image, writer->imz);
+        write_imz_header(disk, writer->imz);
+    } else {
+        write_imd_header(disk, image);
+    }
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    for (int i = 0; i < WRITE_QUEUE_LEN; i++) {
+        init_buffer(&writer->queue[i]);
+    }
+    writer->first = 0;
+    writer->count = 0;
+    writer->done = false;
+
+    if (pthread_create(&writer->thread, NULL,
+                       image_writer_worker, writer) != 0) {
+        die("pthread_create failed");
+    }
+}
+
+// Wait for everything queued to be written, and stop the thread.
+static void stop_image_writer(image_writer_t *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->done = true;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+    if (writer->imz != NULL) {
+        finish_imz(writer->imz);
+    }
+
+    for (int i = 0; i < WRITE_QUEUE_LEN; i++) {
+        free_buffer(&writer->queue[i]);
+    }
+    pthread_cond_destroy(&writer->changed);
+    pthread_mutex_destroy(&writer->lock);
+}
+
+// Queue the contents of buf to be written, waiting if the queue is full.
+// buf is swapped with an empty buffer from the queue, so there's no copying.
+static void queue_image_write(image_writer_t *writer, buffer_t *buf,
+                              bool flush) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->count == WRITE_QUEUE_LEN) {
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+
+    const int slot = (writer->first + writer->count) % WRITE_QUEUE_LEN;
+    buffer_t tmp = writer->queue[slot];
+    writer->queue[slot] = *buf;
+    *buf = tmp;
+    buf->len = 0;
+    writer->flush[slot] = flush;
+    writer->count++;
+
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// Queue a track to be written to the image (if there is one), flushing if
+// the policy says we should.
+static void write_image_track(const track_t *track, bool end_of_cyl,
+                              image_writer_t *writer, buffer_t *track_buf) {
+    if (writer == NULL) return;
+
+    if (writer->hashes != NULL) {
+        set_track_hash(track, writer->hashes);
+    }
+    encode_imd_track(track, track_buf);
+    const bool flush = (args.flush_policy == FLUSH_TRACK)
+                       || (args.flush_policy == FLUSH_CYL && end_of_cyl);
+    queue_image_write(writer, track_buf, flush);
+}
+
+// Read each track of the disk in turn, writing it to the image as we go.
+// Record which tracks couldn't be read completely in failed.
+// Returns true if everything has been read.
+static bool read_disk(drive_t *drive, disk_t *disk,
+                      bool failed[MAX_CYLS][MAX_HEADS],
+                      image_writer_t *writer, buffer_t *track_buf) {
+    // If there's going to be a separate retry pass, just try each track once
+    // here, so we get a complete image as quickly as possible.
+    const int tries = (args.retry_pass_tries > 0) ? 1 : args.max_tries;
+
+    const double start = drive_now(drive);
+    long bytes_read = 0;
+
+    bool all_ok = true;
+    for (int cyl = 0; cyl < disk->num_phys_cyls; cyl++) {
+        for (int head = 0; head < disk->num_phys_heads; head++) {
+            track_t *track = disk_track(disk, cyl, head);
+
+            if (track->status != TRACK_UNKNOWN) {
+                // We already know the layout from the existing image.
+            } else if (args.always_probe) {
+                // Don't assume a layout.
+            } else if (cyl > 0) {
+                // Try the layout of the previous cyl on the same head.
+                copy_track_layout(disk, disk_track(disk, cyl - 1, head),
+                                  track);
+            }
+        }
+
+        // If both sides look the same, try reading them in one go.
+        // If that doesn't work, we'll read them separately below.
+        bool read_both = false;
+        if (disk->num_phys_heads == 2
+            && !(track_complete(disk_track(disk, cyl, 0))
+                 && track_complete(disk_track(disk, cyl, 1)))
+            && can_read_cylinder(disk_track(disk, cyl, 0),
+                                 disk_track(disk, cyl, 1))) {
+            const int before = count_good_sectors(disk_track(disk, cyl, 0))
+                               + count_good_sectors(disk_track(disk, cyl, 1));
+            drive->try = 0;
+            read_both = read_cylinder(drive, disk_track(disk, cyl, 0),
+                                      disk_track(disk, cyl, 1));
+            if (read_both) {
+                drive->timing.sectors
+                    = count_good_sectors(disk_track(disk, cyl, 0))
+                      + count_good_sectors(disk_track(disk, cyl, 1)) - before;
+                bytes_read += (long) drive->timing.sectors
+                    * sector_bytes(disk_track(disk, cyl, 0)->sector_size_code);
+                char label[32];
+                snprintf(label, sizeof label, "%2d.*", cyl);
+                show_timing(drive, label);
+            }
+        }
+
+        for (int head = 0; head < disk->num_phys_heads; head++) {
+            track_t *track = disk_track(disk, cyl, head);
+
+            failed[cyl][head] = false;
+            if (!read_both) {
+                const int before = count_good_sectors(track);
+                if (!read_track_retrying(drive, track, tries)) {
+                    failed[cyl][head] = true;
+                    all_ok = false;
+                }
+                const int sectors = count_good_sectors(track) - before;
+                drive->timing.sectors += sectors;
+                if (sectors > 0) {
+                    bytes_read += (long) sectors
+                                  * sector_bytes(track->sector_size_code);
+                }
+                char label[32];
+                snprintf(label, sizeof label, "%2d.%d", cyl, head);
+                show_timing(drive, label);
+            }
+
+            write_image_track(track, head == disk->num_phys_heads - 1,
+                              writer, track_buf);
+        }
+
+        // Estimate how long the rest will take, from how long it's taken
+        // so far.
+        const double elapsed = drive_now(drive) - start;
+        const int done = cyl + 1;
+        write_event("progress", drive->drive,
+                    "\"cyl\": %d, \"cyls\": %d, \"bytes\": %ld, "
+                    "\"rate\": %.0f, \"eta\": %.1f",
+                    cyl, disk->num_phys_cyls, bytes_read,
+                    (elapsed > 0.0) ? bytes_read / elapsed : 0.0,
+                    elapsed / done * (disk->num_phys_cyls - done));
+    }
+
+    return all_ok;
+}
+
+// Go back over the tracks that failed, sweeping across the disk in
+// alternate directions so the head doesn't have to move far between them.
+// Each sweep tries each failed track once.
+static void retry_disk(drive_t *drive, disk_t *disk,
+                       bool failed[MAX_CYLS][MAX_HEADS]) {
+    for (int pass = 0; pass < args.retry_pass_tries; pass++) {
+        progress(drive, "Retry pass %d\n", pass + 1);
+
+        if (pass > 0 && (pass % args.recalibrate_tries) == 0) {
+            // Seek back to track 0, in case the calibration has drifted.
+            struct floppy_raw_cmd cmd;
+            fd_recalibrate(drive, &cmd);
+        }
+
+        bool any_failed = false;
+        for (int i = 0; i < disk->num_phys_cyls; i++) {
+            const int cyl = (pass % 2 == 0) ? (disk->num_phys_cyls - 1 - i)
+                                            : i;
+
+            for (int head = 0; head < disk->num_phys_heads; head++) {
+                if (!failed[cyl][head]) continue;
+
+                track_t *track = disk_track(disk, cyl, head);
+                const int before = count_good_sectors(track);
+                drive->try = pass + 1;
+                drive->timing.retries++;
+                const bool ok = read_track(drive, track);
+                drive->timing.sectors += count_good_sectors(track) - before;
+                char label[32];
+                snprintf(label, sizeof label, "%2d.%d", cyl, head);
+                show_timing(drive, label);
+
+                if (ok) {
+                    failed[cyl][head] = false;
+                } else {
+                    if (track->status == TRACK_GUESSED && !args.no_reprobe) {
+                        // Maybe we guessed wrong. Probe next time.
+                        track->status = TRACK_UNKNOWN;
+                    }
+                    any_failed = true;
+                }
+            }
+        }
+
+        if (!any_failed) break;
+    }
+}
+
+// Set up a simulated drive, rather than opening a real one.
+static void open_sim_drive(drive_t *drive, fdc_sim_t *sim,
+                           struct floppy_drive_params *drive_params) {
+    init_fdc_sim(sim);
+    if (args.num_sim_images > 0) {
+        load_fdc_sim_image(sim, args.sim_images[0]);
+    }
+    for (int i = 1; i < args.num_sim_images; i++) {
+        queue_fdc_sim_image(sim, args.sim_images[i]);
+    }
+    if (args.sim_errors != NULL) {
+        load_fdc_sim_errors(sim, args.sim_errors);
+    }
+    if (args.sim_replay != NULL) {
+        load_fdc_sim_replay(sim, args.sim_replay, drive->drive);
+    }
+    drive->sim = sim;
+
+    memset(drive_params, 0, sizeof *drive_params);
+    drive_params->tracks = fdc_sim_cyls(sim);
+    drive_params->rps = (int) (1.0 / sim->rotation + 0.5);
+}
+
+// Image the disk in the drive. first is false for the disks after the first
+// in station mode, when the head's already been recalibrated.
+// Returns false if the disk couldn't be read at all (only in station mode).
+static bool dump_disk(drive_t *drive,
+                      const struct floppy_drive_params *drive_params,
+                      bool first) {
+    // Forget anything from the last disk.
+    drive->cyl_scale = 1;
+    init_timing(&drive->timing);
+    init_timing(&drive->disk_timing);
+
+    if (first) {
+        // Return to track 0. (For later disks in station mode, polling for
+        // the disk has already done this.)
+        for (int i = 0; i < 2; i++) {
+            struct floppy_raw_cmd cmd;
+            fd_recalibrate(drive, &cmd);
+        }
+    }
+
+    disk_t disk;
+    init_disk(&disk);
+
+    if (args.tracks == -1) {
+        disk.num_phys_cyls = drive_params->tracks;
+    } else {
+        disk.num_phys_cyls = args.tracks;
+    }
+    disk.num_phys_heads = 2;
+
+    FILE *old_image = NULL;
+    if (args.resume && drive->image_filename != NULL) {
+        old_image = fopen(drive->image_filename, "rb");
+        if (old_image == NULL && errno != ENOENT) {
+            die_errno("cannot open %s", drive->image_filename);
+        }
+        if (old_image != NULL) {
+            old_image = open_imz_stream(old_image);
+        }
+    }
+    const bool resuming = (old_image != NULL);
+
+    if (!resuming) {
+        make_disk_comment("dumpfloppy", "1", &disk);
+        alloc_append(extra_comment, extra_comment_len,
+                     &disk.comment, &disk.comment_len);
+
+        const char *error = probe_disk(drive, &disk);
+        if (error != NULL) {
+            if (!args.station) {
+                die("%s", error);
+            }
+            progress(drive, "%s; skipping this disk\n", error);
+            if (events_enabled()) {
+                char *reason = json_quote(error);
+                write_event("disk_skip", drive->drive, "\"reason\": %s",
+                            reason);
+                free(reason);
+            }
+            free_disk(&disk);
+            return false;
+        }
+        disk.num_phys_cyls /= drive->cyl_scale;
+    } else {
+        // Probe into a separate disk, so we don't throw away anything
+        // we've already read from cylinder 2.
+        disk_t probed;
+        init_disk(&probed);
+        probed.num_phys_cyls = disk.num_phys_cyls;
+        probed.num_phys_heads = disk.num_phys_heads;
+        const char *error = probe_disk(drive, &probed);
+        if (error != NULL) {
+            die("%s", error);
+        }
+
+        // Keep the old comment, and the tracks we've got already. If the
+        // last dump was interrupted while writing a track, that track will
+        // be incomplete; read it again.
+        if (!read_truncated_imd(old_image, &disk)) {
+            progress(drive, "Ignoring incomplete last track\n");
+        }
+        fclose(old_image);
+        // Only add the comment if it's not there from last time.
+        if (disk.comment_len < extra_comment_len
+            || memcmp(disk.comment + disk.comment_len - extra_comment_len,
+                      extra_comment, extra_comment_len) != 0) {
+            alloc_append(extra_comment, extra_comment_len,
+                         &disk.comment, &disk.comment_len);
+        }
+
+        int old_good = 0, old_total = 0;
+        for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+            for (int head = 0; head < disk.num_phys_heads; head++) {
+                track_t *track = disk_track(&disk, cyl, head);
+
+                if (track->num_sectors == 0) {
+                    // Nothing was found here last time; probe it again.
+                    track->status = TRACK_UNKNOWN;
+                }
+                for (int i = 0; i < track->num_sectors; i++) {
+                    if (track->sectors[i].status == SECTOR_GOOD) old_good++;
+                    old_total++;
+                }
+            }
+        }
+        progress(drive, "Resuming: %d of %d sectors already read\n",
+                 old_good, old_total);
+
+        const int probed_cyls = probed.num_phys_cyls / drive->cyl_scale;
+        if (probed_cyls > disk.num_phys_cyls) {
+            disk.num_phys_cyls = probed_cyls;
+        }
+        if (probed.num_phys_heads > disk.num_phys_heads) {
+            disk.num_phys_heads = probed.num_phys_heads;
+        }
+        free_disk(&probed);
+    }
+
+    show_timing(drive, "setup");
+
+    if (events_enabled()) {
+        char *image_name = json_quote((drive->image_filename != NULL)
+                                      ? drive->image_filename : "");
+        write_event("disk_start", drive->drive,
+                    "\"cyls\": %d, \"heads\": %d, \"cyl_scale\": %d, "
+                    "\"image\": %s",
+                    disk.num_phys_cyls, disk.num_phys_heads, drive->cyl_scale,
+                    image_name);
+        free(image_name);
+    }
+
+    FILE *image = NULL;
+    // When the image is being rewritten, it's written to a temporary file
+    // and renamed over the old image at the end, so that the old image isn't
+    // lost if this is interrupted.
+    char *temp_filename = NULL;
+    image_writer_t image_writer;
+    image_writer_t *writer = NULL;
+    if (drive->image_filename != NULL) {
+        if (resuming) {
+            image = create_temp_file(drive->image_filename, &temp_filename);
+        } else {
+            image = fopen(drive->image_filename, "wb");
+            if (image == NULL) {
+                die_errno("cannot open %s", drive->image_filename);
+            }
+        }
+
+        writer = &image_writer;
+        writer->imz = NULL;
+        if (is_imz_filename(drive->image_filename)) {
+            writer->imz = malloc(sizeof *writer->imz);
+            if (writer->imz == NULL) {
+                die("malloc failed");
+            }
+        }
+        writer->hashes = NULL;
+        if (args.write_hashes) {
+            writer->hashes = malloc(sizeof *writer->hashes);
+            if (writer->hashes == NULL) {
+                die("malloc failed");
+            }
+            init_disk_hashes(writer->hashes);
+        }
+        start_image_writer(writer, &disk, image);
+    }
+
+    // The IMD record for each track is encoded into this.
+    buffer_t track_buf;
+    init_buffer(&track_buf);
+
+    bool failed[MAX_CYLS][MAX_HEADS];
+    const bool all_ok = read_disk(drive, &disk, failed, writer, &track_buf);
+
+    if (!all_ok && args.retry_pass_tries > 0) {
+        retry_disk(drive, &disk, failed);
+
+        if (writer != NULL) {
+            // Write the whole image again with what we've got now.
+            stop_image_writer(writer);
+            if (temp_filename == NULL) {
+                if (fclose(image) != 0) {
+                    die_errno("cannot write %s", drive->image_filename);
+                }
+                image = create_temp_file(drive->image_filename,
+                                         &temp_filename);
+            } else {
+                image = freopen(temp_filename, "wb", image);
+                if (image == NULL) {
+                    die_errno("cannot open %s", temp_filename);
+                }
+            }
+
+            start_image_writer(writer, &disk, image);
+            for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+                for (int head = 0; head < disk.num_phys_heads; head++) {
+                    write_image_track(disk_track(&disk, cyl, head),
+                                      head == disk.num_phys_heads - 1,
+                                      writer, &track_buf);
+                }
+            }
+        }
+    }
+
+    free_buffer(&track_buf);
+    if (writer != NULL) {
+        stop_image_writer(writer);
+        if (temp_filename != NULL) {
+            replace_with_temp_file(image, temp_filename,
+                                   drive->image_filename);
+        } else if (fclose(image) != 0) {
+            die_errno("cannot write %s", drive->image_filename);
+        }
+        free(writer->imz);
+    }
+    if (writer != NULL && writer->hashes != NULL) {
+        finish_disk_hashes(writer->hashes);
+
+        char *filename = hashes_filename(drive->image_filename);
+        FILE *f = fopen(filename, "w");
+        if (f == NULL) {
+            die_errno("cannot open %s", filename);
+        }
+        write_disk_hashes(writer->hashes, f);
+        if (fclose(f) != 0) {
+            die_errno("cannot write %s", filename);
+        }
+        free(filename);
+        free(writer->hashes);
+    }
+
+    if (events_enabled()) {
+        int good = 0, total = 0;
+        for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+            for (int head = 0; head < disk.num_phys_heads; head++) {
+                const track_t *track = disk_find_track(&disk, cyl, head);
+                good += count_good_sectors(track);
+                total += track->num_sectors;
+            }
+        }
+        write_event("disk_end", drive->drive,
+                    "\"ok\": %s, \"good\": %d, \"sectors\": %d",
+                    (good == total) ? "true" : "false", good, total);
+    }
+
+    if (args.show_timing) {
+        const timing_t *total = &drive->disk_timing;
+        double total_time = 0.0;
+        for (int i = 0; i < NUM_PHASES; i++) {
+            total_time += total->time[i];
+        }
+        progress(drive, "Total: %.1fs in %d commands (probe %.1fs, "
+                        "read %.1fs, recalibrate %.1fs), %d retries\n",
+                 total_time, total->commands,
+                 total->time[PHASE_PROBE], total->time[PHASE_READ],
+                 total->time[PHASE_RECALIBRATE], total->retries);
+        if (total->sectors > 0) {
+            progress(drive, "Average %.2f revs/sector read\n",
+                     total->time[PHASE_READ]
+                     / drive->rotation / total->sectors);
+        }
+    }
+    free_disk(&disk);
+    return true;
+}
+
+// Wait for a new disk to be put in the drive -- after the current one has
+// been taken out, if removal is true.
+// Returns false if there won't be another disk (which only happens when
+// the drive's simulated).
+static bool wait_for_disk(drive_t *drive, bool removal) {
+    progress(drive, removal ? "Waiting for the disk to be changed\n"
+                            : "Waiting for a disk\n");
+    progress_flush(drive);
+    if (events_enabled()) {
+        write_event("disk_wait", drive->drive, "");
+    }
+
+    if (removal) {
+        while (!poll_disk_change(drive, false)) {
+            drive_sleep(drive, STATION_POLL_INTERVAL);
+        }
+    }
+
+    while (poll_disk_change(drive, true)) {
+        if (drive->sim != NULL && fdc_sim_out_of_disks(drive->sim)) {
+            return false;
+        }
+        drive_sleep(drive, STATION_POLL_INTERVAL);
+    }
+    return true;
+}
+
+// Image disk after disk, naming the images by formatting a number into
+// the image filename pattern, until there are no more.
+static void run_station(drive_t *drive,
+                        const struct floppy_drive_params *drive_params) {
+    const char *pattern = drive->image_filename;
+    const double start = drive_now(drive);
+    int number = 1;
+    int num_disks = 0;
+
+    bool have_disk = !poll_disk_change(drive, true)
+                     || wait_for_disk(drive, false);
+    bool first = true;
+    while (have_disk) {
+        // Don't overwrite images from an earlier run.
+        char *filename;
+        while (true) {
+            filename = alloc_sprintf(pattern, number);
+            if (filename == NULL) {
+                die("out of memory");
+            }
+            if (access(filename, F_OK) != 0) break;
+            free(filename);
+            number++;
+        }
+
+        progress(drive, "Reading disk into %s\n", filename);
+        drive->image_filename = filename;
+        if (dump_disk(drive, drive_params, first)) {
+            num_disks++;
+            number++;
+        }
+        first = false;
+        drive->image_filename = pattern;
+        free(filename);
+
+        have_disk = wait_for_disk(drive, true);
+    }
+
+    const double elapsed = drive_now(drive) - start;
+    progress(drive, "Read %d disks in %.1fs", num_disks, elapsed);
+    if (num_disks > 0 && elapsed > 0.0) {
+        progress(drive, " (%.0f disks/hour)", num_disks * 3600.0 / elapsed);
+    }
+    progress(drive, "\n");
+}
+
+static void process_floppy(drive_t *drive) {
+    struct floppy_drive_params drive_params;
+    fdc_sim_t sim;
+
+    if (args.num_sim_images > 0 || args.sim_replay != NULL) {
+        open_sim_drive(drive, &sim, &drive_params);
+    } else {
+        char dev_filename[] = "/dev/fdX";
+        dev_filename[7] = '0' + drive->drive;
+
+        drive->dev_fd = open(dev_filename, O_ACCMODE | O_NONBLOCK);
+        if (drive->dev_fd == -1) {
+            die_errno("cannot open %s", dev_filename);
+        }
+
+        // Get BIOS parameters for drive.
+        // These aren't necessarily accurate (e.g. there's no BIOS type for
+        // an 80-track 5.25" DD drive)...
+        if (ioctl(drive->dev_fd, FDGETDRVPRM, &drive_params) < 0) {
+            die_errno("cannot get drive parameters");
+        }
+    }
+
+    drive->rotation = 1.0 / ((drive_params.rps > 0) ? drive_params.rps : 5);
+
+    if (drive->sim == NULL) {
+        // Reset the controller
+        const double reset_start = trace_now();
+        if (ioctl(drive->dev_fd, FDRESET, (void *) FD_RESET_ALWAYS) < 0) {
+            die_errno("cannot reset controller");
+        }
+        record_command(drive, "FDRESET", PHASE_RECALIBRATE, reset_start,
+                       0, 0, NULL, 0, NULL, true);
+        // FIXME: comment in fdrawcmd.1 says reset may block -- not
+        // O_NONBLOCK?
+    }
+
+    if (args.station) {
+        run_station(drive, &drive_params);
+    } else {
+        dump_disk(drive, &drive_params, true);
+    }
+
+    if (drive->sim != NULL) {
+        progress(drive, "Simulated time: %.1fs\n", drive->sim->now);
+        free_fdc_sim(drive->sim);
+        drive->sim = NULL;
+    } else {
+        close(drive->dev_fd);
+    }
+}
+
+static void *drive_worker(void *drive_v) {
+    process_floppy((drive_t *) drive_v);
+    return NULL;
+}
+
+// Read from all the drives at once, with a thread for each.
+static void process_floppies(void) {
+    drive_t drives[args.num_drives];
+    pthread_t threads[args.num_drives];
+
+    for (int i = 0; i < args.num_drives; i++) {
+        drive_t *drive = &drives[i];
+        drive->drive = args.drives[i];
+        drive->dev_fd = -1;
+        drive->cyl_scale = 1;
+        for (int head = 0; head < MAX_HEADS; head++) {
+            drive->last_mode[head] = NULL;
+        }
+        drive->image_filename = NULL;
+        if (i < args.num_images) {
+            drive->image_filename = args.image_filenames[i];
+        }
+        init_buffer(&drive->progress);
+        drive->phase = PHASE_PROBE;
+        drive->try = 0;
+        init_timing(&drive->timing);
+        init_timing(&drive->disk_timing);
+        drive->last_flush = -1.0;
+        drive->sim = NULL;
+        drive->have_last_profile = false;
+    }
+
+    if (args.num_drives == 1) {
+        process_floppy(&drives[0]);
+    } else {
+        for (int i = 0; i < args.num_drives; i++) {
+            if (pthread_create(&threads[i], NULL,
+                               drive_worker, &drives[i]) != 0) {
+                die("pthread_create failed");
+            }
+        }
+        for (int i = 0; i < args.num_drives; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for (int i = 0; i < args.num_drives; i++) {
+        free_buffer(&drives[i].progress);
+    }
+}
+
+// Return whether a filename pattern contains exactly one printf-style %d
+// (with optional flags and width), and no other conversions apart from %%.
+static bool is_number_pattern(const char *pattern) {
+    int count = 0;
+    for (const char *p = pattern; *p != '\0'; p++) {
+        if (*p != '%') continue;
+        p++;
+        if (*p == '%') continue;
+
+        p += strspn(p, "0-");
+        p += strspn(p, "0123456789");
+        if (*p != 'd') return false;
+        count++;
+    }
+    return count == 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: dumpfloppy [OPTION]... [IMAGE-FILE]...\n");
+    fprintf(stderr, "  -a         probe each track before reading\n");
     fprintf(stderr, "  -A         don't re-probe on error\n");
+    fprintf(stderr, "  -p NUM     when probing, check the sector sequence repeats for NUM\n");
+    fprintf(stderr, "             more revolutions (default 1; use 3 for dodgy disks)\n");
+    fprintf(stderr, "  -u         if IMAGE-FILE exists, only read what's missing from it\n");
     fprintf(stderr, "  -r NUM     on failure, reread up to NUM times (default 16)\n");
     fprintf(stderr, "  -R NUM     on failure, recalibrate every NUM tries (default 4)\n");
+    fprintf(stderr, "  -L NUM     read each track once, then retry failed tracks in\n");
+    fprintf(stderr, "             up to NUM later passes over the disk\n");
     fprintf(stderr, "  -d NUM     drive number to read from (default 0)\n");
+    fprintf(stderr, "             (repeat to read several drives at once, giving an\n");
+    fprintf(stderr, "             IMAGE-FILE for each drive in the same order)\n");
     fprintf(stderr, "  -t TRACKS  drive has TRACKS tracks (default autodetect)\n");
     fprintf(stderr, "  -C         read comment from stdin\n");
     fprintf(stderr, "  -S SEC     ignore sectors with logical ID SEC\n");
+    fprintf(stderr, "  -F WHEN    flush image after each track (default), cyl, or at end\n");
+    fprintf(stderr, "  -P FILE    recognise known formats using profiles in FILE\n");
+    fprintf(stderr, "  -m MODE    try data mode MODE (e.g. MFM-500k) first when probing\n");
+    fprintf(stderr, "  -s         show how long commands took for each track\n");
+    fprintf(stderr, "  -T FILE    write a trace of every command to FILE\n");
+    fprintf(stderr, "             (as JSON if FILE ends in .json, else CSV)\n");
+    fprintf(stderr, "  -E FD      write progress events to file descriptor FD\n");
+    fprintf(stderr, "             (as JSON, one object per line)\n");
+    fprintf(stderr, "  -H         write a hash of each track to IMAGE-FILE.hashes\n");
+    fprintf(stderr, "  -w         station mode: keep the drive open and read each disk that's\n");
+    fprintf(stderr, "             put in, naming the images by replacing %%d in IMAGE-FILE\n");
+    fprintf(stderr, "             with the next unused number\n");
+    fprintf(stderr, "  -D IMAGE   simulate the drive, with IMAGE (.IMD or .IMZ) as the disk\n");
+    fprintf(stderr, "             (repeat with -w to put in more disks, one after another)\n");
+    fprintf(stderr, "  -e FILE    with -D, make reads fail at random as given in FILE\n");
+    fprintf(stderr, "  -X FILE    simulate the drive by replaying a CSV trace from -T\n");
+    fprintf(stderr, "If IMAGE-FILE ends in .imz, it's written as a compressed .IMZ container.\n");
     // FIXME: -h HEAD     read single-sided image from head HEAD
 }
 
 int main(int argc, char **argv) {
-    dev_fd = -1;
     args.always_probe = false;
     args.no_reprobe = false;
+    args.probe_revs = 1;
+    args.resume = false;
     args.max_tries = 16;
     args.recalibrate_tries = 4;
-    args.drive = 0;
+    args.retry_pass_tries = 0;
+    args.num_drives = 0;
     args.tracks = -1;
-    args.cyl_scale = 1;
     args.read_comment = false;
     args.ignore_sector = -1;
-    args.image_filename = NULL;
+    args.flush_policy = FLUSH_TRACK;
+    args.profile_filename = NULL;
+    args.mode_hint = NULL;
+    args.show_timing = false;
+    args.trace_filename = NULL;
+    args.events_fd = -1;
+    args.write_hashes = false;
+    args.station = false;
+    args.num_sim_images = 0;
+    args.sim_errors = NULL;
+    args.sim_replay = NULL;
+    args.num_images = 0;
 
     while (true) {
-        int opt = getopt(argc, argv, "aAr:R:d:t:CS:");
+        int opt = getopt(argc, argv, "aAp:ur:R:L:d:t:CS:F:P:m:sT:E:HwD:e:X:");
         if (opt == -1) break;
 
         switch (opt) {
@@ -644,14 +2298,31 @@ int main(int argc, char **argv) {
         case 'A':
             args.no_reprobe = true;
             break;
+        case 'p':
+            args.probe_revs = atoi(optarg);
+            if (args.probe_revs < 0) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'u':
+            args.resume = true;
+            break;
         case 'r':
             args.max_tries = atoi(optarg);
             break;
         case 'R':
             args.recalibrate_tries = atoi(optarg);
             break;
+        case 'L':
+            args.retry_pass_tries = atoi(optarg);
+            break;
         case 'd':
-            args.drive = atoi(optarg);
+            if (args.num_drives == MAX_DRIVES) {
+                usage();
+                return 1;
+            }
+            args.drives[args.num_drives++] = atoi(optarg);
             break;
         case 't':
             args.tracks = atoi(optarg);
@@ -662,22 +2333,140 @@ int main(int argc, char **argv) {
         case 'S':
             args.ignore_sector = atoi(optarg);
             break;
+        case 'F':
+            if (strcmp(optarg, "track") == 0) {
+                args.flush_policy = FLUSH_TRACK;
+            } else if (strcmp(optarg, "cyl") == 0) {
+                args.flush_policy = FLUSH_CYL;
+            } else if (strcmp(optarg, "end") == 0) {
+                args.flush_policy = FLUSH_END;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'P':
+            args.profile_filename = optarg;
+            break;
+        case 'm':
+            for (int i = 0; DATA_MODES[i].name != NULL; i++) {
+                if (strcasecmp(optarg, DATA_MODES[i].name) == 0) {
+                    args.mode_hint = &DATA_MODES[i];
+                }
+            }
+            if (args.mode_hint == NULL) {
+                usage();
+                return 1;
+            }
+            break;
+        case 's':
+            args.show_timing = true;
+            break;
+        case 'T':
+            args.trace_filename = optarg;
+            break;
+        case 'E':
+            args.events_fd = atoi(optarg);
+            if (args.events_fd < 0 || fcntl(args.events_fd, F_GETFD) == -1) {
+                die("-E: %s is not an open file descriptor", optarg);
+            }
+            break;
+        case 'H':
+            args.write_hashes = true;
+            break;
+        case 'w':
+            args.station = true;
+            break;
+        case 'D':
+            if (args.num_sim_images == MAX_SIM_IMAGES) {
+                usage();
+                return 1;
+            }
+            args.sim_images[args.num_sim_images++] = optarg;
+            break;
+        case 'e':
+            args.sim_errors = optarg;
+            break;
+        case 'X':
+            args.sim_replay = optarg;
+            break;
         default:
             usage();
             return 1;
         }
     }
 
-    if (optind == argc) {
+    if (args.num_drives == 0) {
+        args.drives[args.num_drives++] = 0;
+    }
+    if (args.sim_errors != NULL && args.num_sim_images == 0) {
+        die("-e only works with -D");
+    }
+    if (args.num_sim_images > 0 && args.sim_replay != NULL) {
+        die("-D and -X can't be used together");
+    }
+    if (args.num_sim_images > 1 && !args.station) {
+        die("-D can only be given more than once with -w");
+    }
+    if (args.station && args.sim_replay != NULL) {
+        die("-w and -X can't be used together");
+    }
+    if (args.station && args.resume) {
+        die("-w and -u can't be used together");
+    }
+
+    args.num_images = argc - optind;
+    if (args.num_images == 0) {
         // No image file.
-    } else if (optind + 1 == argc) {
-        args.image_filename = argv[optind];
+    } else if (args.num_images == args.num_drives) {
+        for (int i = 0; i < args.num_images; i++) {
+            args.image_filenames[i] = argv[optind + i];
+        }
     } else {
         usage();
         return 0;
     }
+    if (args.station) {
+        if (args.num_images == 0) {
+            die("-w needs an IMAGE-FILE for each drive");
+        }
+        for (int i = 0; i < args.num_images; i++) {
+            if (!is_number_pattern(args.image_filenames[i])) {
+                die("With -w, IMAGE-FILE must contain one %%d (e.g. "
+                    "disk%%04d.imd)");
+            }
+        }
+    }
+
+    extra_comment = NULL;
+    extra_comment_len = 0;
+    if (args.read_comment) {
+        if (isatty(0)) {
+            fprintf(stderr, "Enter comment, terminated by EOF\n");
+        }
+
+        while (true) {
+            char buf[4096];
+            ssize_t count = read(0, buf, sizeof buf);
+            if (count == 0) break;
+            if (count < 0) {
+                die("read from stdin failed");
+            }
+
+            alloc_append(buf, count, &extra_comment, &extra_comment_len);
+        }
+    }
+
+    if (args.trace_filename != NULL) {
+        open_trace(args.trace_filename);
+    }
+    if (args.events_fd != -1) {
+        open_events(args.events_fd);
+    }
+
+    process_floppies();
 
-    process_floppy();
+    close_trace();
 
     return 0;
 }
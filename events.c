@@ -0,0 +1,118 @@
+/*
+    events.c: structured progress events
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "events.h"
+#include "trace.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int events_fd = -1;
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void open_events(int fd) {
+    events_fd = fd;
+}
+
+bool events_enabled(void) {
+    return events_fd != -1;
+}
+
+void write_event(const char *type, int drive, const char *format, ...) {
+    if (events_fd == -1) return;
+
+    buffer_t line;
+    init_buffer(&line);
+
+    const char *prefix_format = "{\"event\": \"%s\", \"time\": %.6f, "
+                                "\"drive\": %d%s";
+    const double now = trace_now();
+    const char *sep = (format[0] != '\0') ? ", " : "";
+    char dummy;
+    int count = snprintf(&dummy, 0, prefix_format, type, now, drive, sep);
+    snprintf((char *) buffer_reserve(&line, count + 1), count + 1,
+             prefix_format, type, now, drive, sep);
+    line.len += count;
+
+    va_list ap;
+    va_start(ap, format);
+    count = vsnprintf(&dummy, 0, format, ap);
+    va_end(ap);
+    va_start(ap, format);
+    vsnprintf((char *) buffer_reserve(&line, count + 1), count + 1,
+              format, ap);
+    va_end(ap);
+    line.len += count;
+
+    memcpy(buffer_reserve(&line, 2), "}\n", 2);
+    line.len += 2;
+
+    // Write the whole line at once, so lines from different drives don't
+    // get mixed up.
+    pthread_mutex_lock(&events_lock);
+    const uint8_t *pos = line.data;
+    size_t left = line.len;
+    while (left > 0) {
+        ssize_t n = write(events_fd, pos, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die_errno("cannot write event");
+        }
+        pos += n;
+        left -= n;
+    }
+    pthread_mutex_unlock(&events_lock);
+
+    free_buffer(&line);
+}
+
+char *json_quote(const char *s) {
+    buffer_t buf;
+    init_buffer(&buf);
+
+    *buffer_reserve(&buf, 1) = '"';
+    buf.len++;
+    for (; *s != '\0'; s++) {
+        const unsigned char c = *s;
+        char escaped[8];
+        if (c == '"' || c == '\\') {
+            snprintf(escaped, sizeof escaped, "\\%c", c);
+        } else if (c < 0x20) {
+            snprintf(escaped, sizeof escaped, "\\u%04x", c);
+        } else {
+            escaped[0] = c;
+            escaped[1] = '\0';
+        }
+        const size_t len = strlen(escaped);
+        memcpy(buffer_reserve(&buf, len), escaped, len);
+        buf.len += len;
+    }
+    memcpy(buffer_reserve(&buf, 2), "\"", 2);
+
+    return (char *) buf.data;
+}
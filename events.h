@@ -0,0 +1,47 @@
+/*
+    events.h: structured progress events
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    Events describe what dumpfloppy is doing in a form that other programs
+    can follow. Each event is written as a single line containing a JSON
+    object, with (at least) "event" giving its type, "time" in seconds since
+    the first event or command, and "drive".
+*/
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdbool.h>
+
+// Start writing events to a file descriptor.
+void open_events(int fd);
+
+bool events_enabled(void);
+
+// Write an event of the given type. format and the following arguments
+// describe any other fields, as printf-style "\"name\": value" pairs
+// separated by commas (or an empty string for none).
+// Safe to call from several threads.
+void write_event(const char *type, int drive, const char *format, ...);
+
+// Return a malloc-d JSON string literal containing s.
+char *json_quote(const char *s);
+
+#endif
@@ -0,0 +1,515 @@
+/*
+    fdcsim.c: simulated floppy controller
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "fdcsim.h"
+#include "disk.h"
+#include "imd.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ST0 interrupt code for abnormal termination.
+#define ST0_ABNORMAL 0x40
+// ST1 bits.
+#define ST1_MA 0x01 // missing address mark
+#define ST1_ND 0x04 // no data (sector not found)
+#define ST1_DE 0x20 // data error (CRC)
+#define ST1_EN 0x80 // end of cylinder
+// ST2 bits.
+#define ST2_MD 0x01 // missing data address mark
+#define ST2_DD 0x20 // data error in data field
+#define ST2_CM 0x40 // control mark (deleted data)
+
+void init_fdc_sim(fdc_sim_t *sim) {
+    sim->now = 0.0;
+    sim->rotation = 0.2;
+    sim->step_time = 0.003;
+    sim->settle_time = 0.015;
+    sim->cyl = 0;
+    // A fixed seed, so that runs are repeatable.
+    sim->rng_state = 0x12345678;
+
+    init_disk(&sim->disk);
+    sim->have_disk = false;
+    sim->disk_changed = false;
+    sim->disk_used = false;
+
+    sim->queue = NULL;
+    sim->queue_len = 0;
+    sim->queue_size = 0;
+    sim->next_queued = 0;
+    sim->swap_time = 10.0;
+    sim->swap_start = -1.0;
+    sim->error_prob = NULL;
+
+    sim->replay = NULL;
+    sim->num_replay = 0;
+    sim->next_replay = 0;
+}
+
+void free_fdc_sim(fdc_sim_t *sim) {
+    free_disk(&sim->disk);
+    free(sim->error_prob);
+    free(sim->replay);
+    free(sim->queue);
+}
+
+void load_fdc_sim_image(fdc_sim_t *sim, const char *filename) {
+    load_imd(filename, IMD_LOAD_DATA, &sim->disk);
+    sim->have_disk = true;
+}
+
+void queue_fdc_sim_image(fdc_sim_t *sim, const char *filename) {
+    if (sim->queue_len == sim->queue_size) {
+        sim->queue_size = (sim->queue_size == 0) ? 16 : (sim->queue_size * 2);
+        sim->queue = realloc(sim->queue, sim->queue_size * sizeof *sim->queue);
+        if (sim->queue == NULL) {
+            die("realloc failed");
+        }
+    }
+    sim->queue[sim->queue_len++] = filename;
+}
+
+bool fdc_sim_out_of_disks(const fdc_sim_t *sim) {
+    return !sim->have_disk && sim->next_queued == sim->queue_len;
+}
+
+void load_fdc_sim_errors(fdc_sim_t *sim, const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        die_errno("cannot open %s", filename);
+    }
+
+    if (sim->error_prob == NULL) {
+        sim->error_prob = calloc(MAX_CYLS, sizeof *sim->error_prob);
+        if (sim->error_prob == NULL) {
+            die("calloc failed");
+        }
+    }
+
+    char line[256];
+    int line_num = 0;
+    while (fgets(line, sizeof line, f) != NULL) {
+        line_num++;
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) {
+            continue;
+        }
+
+        int cyl, head;
+        char sector[16];
+        float prob;
+        if (sscanf(line, "%d %d %15s %f", &cyl, &head, sector, &prob) != 4
+            || cyl < 0 || cyl >= MAX_CYLS || head < 0 || head >= MAX_HEADS
+            || prob < 0.0 || prob > 1.0) {
+            die("%s:%d: bad error map line", filename, line_num);
+        }
+
+        if (strcmp(sector, "*") == 0) {
+            for (int i = 0; i < MAX_SECS; i++) {
+                sim->error_prob[cyl][head][i] = prob;
+            }
+        } else {
+            char *end;
+            const long sec = strtol(sector, &end, 0);
+            if (*end != '\0' || sec < 0 || sec >= MAX_SECS) {
+                die("%s:%d: bad sector number", filename, line_num);
+            }
+            sim->error_prob[cyl][head][sec] = prob;
+        }
+    }
+
+    fclose(f);
+}
+
+// Split a CSV line in place into at most max_fields fields, returning the
+// number found.
+static int split_csv(char *line, char **fields, int max_fields) {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    int count = 0;
+    while (count < max_fields) {
+        fields[count++] = line;
+        char *comma = strchr(line, ',');
+        if (comma == NULL) break;
+        *comma = '\0';
+        line = comma + 1;
+    }
+    return count;
+}
+
+void load_fdc_sim_replay(fdc_sim_t *sim, const char *filename, int drive) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        die_errno("cannot open %s", filename);
+    }
+
+    char line[256];
+    if (fgets(line, sizeof line, f) == NULL
+        || strncmp(line, "time,drive,command,", 19) != 0) {
+        die("%s is not a CSV trace", filename);
+    }
+
+    int size = 0;
+    int line_num = 1;
+    while (fgets(line, sizeof line, f) != NULL) {
+        line_num++;
+
+        // time,drive,command,phase,cyl,head,try,duration,ok,st0,st1,st2,
+        // id_c,id_h,id_r,id_n
+        char *fields[16];
+        const int num_fields = split_csv(line, fields, 16);
+        if (num_fields < 12) {
+            die("%s:%d: too few fields", filename, line_num);
+        }
+        if (atoi(fields[1]) != drive) continue;
+        // The simulator isn't asked to reset the controller.
+        if (strcmp(fields[2], "FDRESET") == 0) continue;
+
+        if (sim->num_replay == size) {
+            size = (size == 0) ? 1024 : size * 2;
+            sim->replay = realloc(sim->replay, size * sizeof *sim->replay);
+            if (sim->replay == NULL) {
+                die("realloc failed");
+            }
+        }
+        fdc_sim_replay_t *row = &sim->replay[sim->num_replay++];
+
+        snprintf(row->command, sizeof row->command, "%s", fields[2]);
+        row->cyl = atoi(fields[4]);
+        row->head = atoi(fields[5]);
+        row->duration = atof(fields[7]);
+        row->num_reply = 0;
+        for (int i = 9; i < num_fields && fields[i][0] != '\0'; i++) {
+            row->reply[row->num_reply++] = atoi(fields[i]);
+        }
+    }
+
+    fclose(f);
+}
+
+int fdc_sim_cyls(const fdc_sim_t *sim) {
+    if (!sim->have_disk) {
+        // When replaying, the trace says where the drive went.
+        int cyls = 0;
+        for (int i = 0; i < sim->num_replay; i++) {
+            if (sim->replay[i].cyl >= cyls) cyls = sim->replay[i].cyl + 1;
+        }
+        return cyls;
+    }
+    return sim->disk.num_phys_cyls;
+}
+
+static uint32_t next_random(fdc_sim_t *sim) {
+    uint32_t x = sim->rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim->rng_state = x;
+    return x;
+}
+
+// How far apart two angles can be and still count as the same, allowing
+// for rounding errors in sim->now.
+#define ANGLE_EPSILON 1e-9
+
+// Return how far the disk is through the current revolution, from 0 at the
+// index hole to just under 1.
+static double current_angle(const fdc_sim_t *sim) {
+    const double pos = fmod(sim->now, sim->rotation) / sim->rotation;
+    return (pos > 1.0 - ANGLE_EPSILON) ? 0.0 : pos;
+}
+
+// Wait until the given fraction of a revolution after the index hole.
+static void wait_for_angle(fdc_sim_t *sim, double angle) {
+    double wait = angle - current_angle(sim);
+    if (wait < -ANGLE_EPSILON) {
+        wait += 1.0;
+    } else if (wait < 0.0) {
+        wait = 0.0;
+    }
+    sim->now += wait * sim->rotation;
+}
+
+// Give up on a command the way the FDC does, after seeing the index hole
+// twice; this leaves the head at the index hole.
+static void wait_for_second_index(fdc_sim_t *sim) {
+    wait_for_angle(sim, 0.0);
+    sim->now += sim->rotation;
+}
+
+// Step the head to a cylinder.
+static void sim_step_to(fdc_sim_t *sim, int cyl) {
+    if (cyl == sim->cyl) return;
+
+    sim->now += abs(cyl - sim->cyl) * sim->step_time + sim->settle_time;
+    sim->cyl = cyl;
+    if (sim->have_disk) {
+        sim->disk_changed = false;
+    }
+}
+
+// Step the head to the cylinder the command wants, if it needs seeking.
+static void sim_seek(fdc_sim_t *sim, const struct floppy_raw_cmd *cmd) {
+    if ((cmd->flags & FD_RAW_NEED_SEEK) != 0) {
+        sim_step_to(sim, cmd->track);
+    }
+}
+
+// Let the operator get on with swapping disks.
+static void run_operator(fdc_sim_t *sim, const struct floppy_raw_cmd *cmd) {
+    if (sim->swap_start < 0.0) {
+        // Wait for the drive's light to come on, and then go out again.
+        if ((cmd->flags & FD_RAW_NO_MOTOR) == 0) {
+            sim->disk_used = sim->have_disk;
+        } else if (sim->disk_used) {
+            sim->swap_start = sim->now;
+            sim->disk_used = false;
+        }
+        return;
+    }
+
+    if (sim->have_disk && sim->now >= sim->swap_start + sim->swap_time / 2) {
+        free_disk(&sim->disk);
+        sim->have_disk = false;
+        sim->disk_changed = true;
+    }
+    if (!sim->have_disk && sim->now >= sim->swap_start + sim->swap_time
+        && sim->next_queued < sim->queue_len) {
+        load_fdc_sim_image(sim, sim->queue[sim->next_queued++]);
+        sim->swap_start = -1.0;
+    }
+}
+
+// Return the track under the head, if the command's data mode can read it.
+static const track_t *sim_track(const fdc_sim_t *sim,
+                                const struct floppy_raw_cmd *cmd, int head) {
+    if (sim->cyl >= MAX_CYLS) return NULL;
+
+    const track_t *track = disk_find_track(&sim->disk, sim->cyl, head);
+    if (track->num_sectors == 0 || track->data_mode == NULL) return NULL;
+
+    const bool is_fm = (cmd->cmd[0] & 0x40) == 0;
+    if (track->data_mode->rate != cmd->rate
+        || track->data_mode->is_fm != is_fm) {
+        return NULL;
+    }
+    return track;
+}
+
+// Fill in a reply with ST0-ST2 and a sector address.
+static void sim_reply(struct floppy_raw_cmd *cmd, int head,
+                      uint8_t st0, uint8_t st1, uint8_t st2,
+                      int c, int h, int r, int n) {
+    cmd->reply[0] = st0 | (head << 2) | (cmd->cmd[1] & 3);
+    cmd->reply[1] = st1;
+    cmd->reply[2] = st2;
+    cmd->reply[3] = c;
+    cmd->reply[4] = h;
+    cmd->reply[5] = r;
+    cmd->reply[6] = n;
+    cmd->reply_count = 7;
+}
+
+static void sim_readid(fdc_sim_t *sim, struct floppy_raw_cmd *cmd, int head) {
+    const track_t *track = sim_track(sim, cmd, head);
+    if (track == NULL) {
+        wait_for_second_index(sim);
+        sim_reply(cmd, head, ST0_ABNORMAL, ST1_MA, 0, 0, 0, 0, 0);
+        return;
+    }
+
+    // Find the next ID field to pass under the head.
+    const int n = track->num_sectors;
+    int next = (int) ceil(current_angle(sim) * n - ANGLE_EPSILON);
+    if (next >= n) next = 0;
+    wait_for_angle(sim, (double) next / n);
+    // The ID field is about a tenth of the sector.
+    sim->now += sim->rotation / n / 10;
+
+    const sector_t *sector = &track->sectors[next];
+    sim_reply(cmd, head, 0, 0, 0, sector->log_cyl, sector->log_head,
+              sector->log_sector, track->sector_size_code);
+}
+
+static void sim_read(fdc_sim_t *sim, struct floppy_raw_cmd *cmd, int head) {
+    const bool multi_track = (cmd->cmd[0] & 0x80) != 0;
+    const int c = cmd->cmd[2];
+    int h = cmd->cmd[3];
+    int r = cmd->cmd[4];
+    const int n = cmd->cmd[5];
+    const int eot = cmd->cmd[6];
+    uint8_t *data = cmd->data;
+    size_t left = cmd->length;
+
+    while (true) {
+        const track_t *track = sim_track(sim, cmd, head);
+        const sector_t *sector = NULL;
+        int phys = -1;
+        if (track != NULL && track->sector_size_code == n) {
+            for (int i = 0; i < track->num_sectors; i++) {
+                const sector_t *s = &track->sectors[i];
+                if (s->log_cyl == c && s->log_head == h
+                    && s->log_sector == r) {
+                    sector = s;
+                    phys = i;
+                    break;
+                }
+            }
+        }
+        if (sector == NULL) {
+            wait_for_second_index(sim);
+            sim_reply(cmd, head, ST0_ABNORMAL, ST1_ND, 0, c, h, r, n);
+            return;
+        }
+
+        // Read the whole sector as it passes under the head.
+        wait_for_angle(sim, (double) phys / track->num_sectors);
+        sim->now += sim->rotation / track->num_sectors;
+
+        if (sector->status == SECTOR_MISSING) {
+            sim_reply(cmd, head, ST0_ABNORMAL, ST1_MA, ST2_MD, c, h, r, n);
+            return;
+        }
+
+        const size_t size = sector_bytes(n);
+        const size_t count = (left < size) ? left : size;
+        memcpy(data, sector->data, count);
+        data += count;
+        left -= count;
+
+        bool error = sector->status == SECTOR_BAD;
+        if (sim->error_prob != NULL) {
+            const float prob = sim->error_prob[sim->cyl][head][r];
+            if (prob > 0.0 && next_random(sim) < prob * (float) UINT32_MAX) {
+                error = true;
+            }
+        }
+        const uint8_t st2 = sector->deleted ? ST2_CM : 0;
+        if (error) {
+            sim_reply(cmd, head, ST0_ABNORMAL, ST1_DE, st2 | ST2_DD,
+                      c, h, r, n);
+            return;
+        }
+
+        // A deleted sector ends the read, since SK isn't set.
+        if (sector->deleted) {
+            sim_reply(cmd, head, 0, 0, ST2_CM, c, h, r, n);
+            return;
+        }
+
+        if (left == 0) {
+            // The DMA transfer is complete.
+            sim_reply(cmd, head, 0, 0, 0, c, h, r, n);
+            return;
+        }
+
+        if (r == eot) {
+            if (!multi_track || head == 1) {
+                sim_reply(cmd, head, ST0_ABNORMAL, ST1_EN, 0, c, h, r, n);
+                return;
+            }
+            // Carry on from sector 1 on the other side.
+            head = 1;
+            h ^= 1;
+            r = 1;
+        } else {
+            r++;
+        }
+    }
+}
+
+static void sim_replay(fdc_sim_t *sim, const char *name,
+                       struct floppy_raw_cmd *cmd) {
+    if (sim->next_replay >= sim->num_replay) {
+        die("Replay ran out of commands at %s", name);
+    }
+    const int index = sim->next_replay++;
+    const fdc_sim_replay_t *row = &sim->replay[index];
+    if (strcmp(row->command, name) != 0) {
+        die("Replay diverged at command %d: trace has %s, but sent %s",
+            index + 1, row->command, name);
+    }
+
+    sim->now += row->duration;
+    sim->cyl = row->cyl;
+
+    memcpy(cmd->reply, row->reply, row->num_reply);
+    cmd->reply_count = row->num_reply;
+    if ((cmd->flags & FD_RAW_READ) != 0) {
+        // The trace doesn't record the data.
+        memset(cmd->data, 0, cmd->length);
+    }
+}
+
+void fdc_sim_command(fdc_sim_t *sim, const char *name,
+                     struct floppy_raw_cmd *cmd) {
+    if (sim->replay != NULL) {
+        sim_replay(sim, name, cmd);
+        return;
+    }
+
+    run_operator(sim, cmd);
+
+    const int head = (cmd->cmd[1] >> 2) & 1;
+    switch (cmd->cmd[0] & 0x1F) {
+    case 0x07: // RECALIBRATE
+        if (sim->cyl == 0) {
+            sim->now += sim->settle_time;
+        }
+        sim_step_to(sim, 0);
+        // Seek end, and the present cylinder (from SENSE INTERRUPT).
+        cmd->reply[0] = 0x20 | (cmd->cmd[1] & 3);
+        cmd->reply[1] = 0;
+        cmd->reply_count = 2;
+        break;
+    case 0x0F: // SEEK
+        if (sim->cyl == cmd->cmd[2]) {
+            sim->now += sim->settle_time;
+        }
+        sim_step_to(sim, cmd->cmd[2]);
+        cmd->reply[0] = 0x20 | (cmd->cmd[1] & 3);
+        cmd->reply[1] = sim->cyl;
+        cmd->reply_count = 2;
+        break;
+    case 0x0A: // READ ID
+        sim_seek(sim, cmd);
+        sim_readid(sim, cmd, head);
+        break;
+    case 0x06: // READ DATA
+        sim_seek(sim, cmd);
+        sim_read(sim, cmd, head);
+        break;
+    default:
+        die("Simulator doesn't support command 0x%02x", cmd->cmd[0]);
+    }
+
+    // As the kernel does, report whether the disk change line is set.
+    // (On input, the same bit means FD_RAW_NO_MOTOR.)
+    if (sim->disk_changed) {
+        cmd->flags |= FD_RAW_DISK_CHANGE;
+    } else {
+        cmd->flags &= ~FD_RAW_DISK_CHANGE;
+    }
+}
@@ -0,0 +1,117 @@
+/*
+    fdcsim.h: simulated floppy controller
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    The simulator answers the raw commands that dumpfloppy sends (READ ID,
+    READ DATA and RECALIBRATE) as if a drive contained a disk, without any
+    real hardware, and keeps track of how long they'd have taken.
+
+    The disk comes from an .IMD image. Sectors are evenly spaced around each
+    track in the image's physical order, so the interleave is as recorded.
+    Sectors that are bad in the image always give CRC errors, and missing
+    ones have no data. An error map file can give other sectors a chance of
+    failing each time they're read, with lines of the form:
+      CYL HEAD SECTOR PROBABILITY
+    where CYL and HEAD are physical, SECTOR is a logical ID or "*" for the
+    whole track, and PROBABILITY is between 0 and 1. Lines starting with #
+    are ignored.
+
+    More disks can be queued for a simulated operator, who swaps the disk
+    in the drive for the next one when the drive's motor has been on and
+    is then turned off (that is, when dumpfloppy has read the disk and
+    starts polling for a new one). The swap takes swap_time seconds, with
+    the disk out of the drive for the second half of it. The drive's disk
+    change line is set when the disk comes out, and reset by a step pulse
+    when there's a disk in the drive, as on a real drive. Once the queue is
+    empty, the operator takes the last disk out and leaves the drive empty.
+
+    Alternatively, the simulator can replay a CSV trace written by
+    dumpfloppy -T, giving back the results recorded for each command in turn
+    (with sector data filled with zeros). This only works if the sequence of
+    commands is the same as when the trace was recorded.
+*/
+
+#ifndef FDCSIM_H
+#define FDCSIM_H
+
+#include "disk.h"
+
+#include <linux/fd.h>
+#include <stdint.h>
+
+typedef struct {
+    char command[32];
+    int cyl;
+    int head;
+    double duration;
+    int num_reply;
+    uint8_t reply[7];
+} fdc_sim_replay_t;
+
+typedef struct {
+    double now; // simulated time, in seconds
+    double rotation; // seconds per revolution
+    double step_time; // seconds to step the head by one cylinder
+    double settle_time; // seconds for the head to settle after seeking
+    int cyl; // where the head is
+    uint32_t rng_state;
+
+    disk_t disk;
+    bool have_disk;
+    bool disk_changed; // the disk change line
+    bool disk_used; // whether the motor's been on since the disk went in
+
+    const char **queue; // images for the operator to put in next
+    int queue_len;
+    int queue_size;
+    int next_queued;
+    double swap_time; // seconds for the operator to swap disks
+    double swap_start; // when the operator started swapping, or -1
+    // Chance of a read error for each physical cyl/head and logical sector,
+    // or NULL if there's no error map.
+    float (*error_prob)[MAX_HEADS][MAX_SECS];
+
+    fdc_sim_replay_t *replay;
+    int num_replay;
+    int next_replay;
+} fdc_sim_t;
+
+void init_fdc_sim(fdc_sim_t *sim);
+void free_fdc_sim(fdc_sim_t *sim);
+
+// Set the disk that's in the simulated drive.
+void load_fdc_sim_image(fdc_sim_t *sim, const char *filename);
+void load_fdc_sim_errors(fdc_sim_t *sim, const char *filename);
+// Add a disk for the operator to put in the drive after the current one.
+// The filename must stay valid while the simulator's in use.
+void queue_fdc_sim_image(fdc_sim_t *sim, const char *filename);
+// Return whether the drive's empty, and the operator has no more disks.
+bool fdc_sim_out_of_disks(const fdc_sim_t *sim);
+// Replay commands for drive from a trace, rather than simulating them.
+void load_fdc_sim_replay(fdc_sim_t *sim, const char *filename, int drive);
+
+// Return the number of cylinders on the simulated disk.
+int fdc_sim_cyls(const fdc_sim_t *sim);
+
+// Perform a raw command, filling in its reply.
+void fdc_sim_command(fdc_sim_t *sim, const char *name,
+                     struct floppy_raw_cmd *cmd);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+    identify.c: recognise common disk formats from their layout
+
+    Copyright (C) 2013, 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "identify.h"
+#include "disk.h"
+
+#include <stdio.h>
+
+// Known formats, in the order they're tried -- so formats with extra tests
+// go before formats with the same geometry that don't have them.
+static const disk_format_t FORMATS[] = {
+    {"MS-DOS 180k", 0, 40, 1, 9, 2, true, "", "both", NULL},
+    {"MS-DOS 360k", 0, 40, 2, 9, 2, true, "", "both", NULL},
+    {"MS-DOS 720k", 0, 80, 2, 9, 2, true, "", "both", NULL},
+    {"MS-DOS 1.2M", 0, 80, 2, 15, 2, true, "", "both", NULL},
+    {"MS-DOS 1.44M", 0, 80, 2, 18, 2, true, "", "both", NULL},
+    {"RM SS 40T 16x128", 2, 40, 1, 16, 0, false, "-c2: -C0:", "0", "rm-sd"},
+    {"RM DS 40T 16x128", 2, 40, 2, 16, 0, false, "-c2: -C0:", "0 1", "rm-sd"},
+    {"RM SS 40T 9x512", 2, 40, 1, 9, 2, false, "-c2: -C0:", "0", "rm-dd"},
+    {"RM DS 40T 9x512", 2, 40, 2, 9, 2, false, "-c2: -C0:", "0 1", "rm-dd"},
+    // FIXME: RM SS 80T 9x512? Need an example of one!
+    {"RM DS 80T 9x512", 2, 80, 2, 9, 2, false, "-c2: -C0:", "0 1", "rm-qd"},
+    // FIXME: This doesn't do the right thing for the ZCPR disks I have...
+    {"Alphatronic PC 40T 16x256", 0, 40, 2, 16, 1, false, "", "both",
+     "alpha"},
+    // FIXME: RM disks formatted differently on each side
+    {NULL, 0, 0, 0, 0, 0, false, NULL, NULL, NULL},
+};
+
+void find_disk_geometry(const disk_t *disk, int first_cyl,
+                        disk_geometry_t *geometry) {
+    int max_cyl = -1;
+    int min_head = MAX_HEADS, max_head = -1;
+    int min_sec = MAX_SECS, max_sec = -1;
+    int size_code = -1;
+
+    for (int cyl = first_cyl; cyl < disk->num_phys_cyls; cyl++) {
+        for (int head = 0; head < disk->num_phys_heads; head++) {
+            const track_t *track = disk_find_track(disk, cyl, head);
+            if (track->num_sectors == 0) continue;
+
+            if (size_code == -1) {
+                size_code = track->sector_size_code;
+            } else if (track->sector_size_code != size_code) {
+                size_code = -2;
+            }
+
+            if (cyl > max_cyl) max_cyl = cyl;
+            if (head < min_head) min_head = head;
+            if (head > max_head) max_head = head;
+            for (int i = 0; i < track->num_sectors; i++) {
+                const int sec = track->sectors[i].log_sector;
+                if (sec < min_sec) min_sec = sec;
+                if (sec > max_sec) max_sec = sec;
+            }
+        }
+    }
+
+    geometry->cyls = max_cyl + 1;
+    geometry->heads = (max_head >= 0) ? max_head - min_head + 1 : 0;
+    geometry->sectors = (max_sec >= 0) ? max_sec - min_sec + 1 : 0;
+    geometry->sector_size_code = size_code;
+}
+
+// Return whether the first sector of the disk looks like an MS-DOS boot
+// sector: it should start with a jump, and have a BIOS Parameter Block
+// with a plausible media descriptor.
+static bool has_dos_boot_sector(const disk_t *disk) {
+    const track_t *track = disk_find_track(disk, 0, 0);
+    for (int i = 0; i < track->num_sectors; i++) {
+        const sector_t *sector = &track->sectors[i];
+        if (sector->log_sector != 1) continue;
+
+        if (sector->status != SECTOR_GOOD || sector->data == NULL
+            || track->sector_size_code != 2) {
+            return false;
+        }
+        const uint8_t *data = sector->data;
+        const bool jump = data[0] == 0xE9 || (data[0] == 0xEB
+                                              && data[2] == 0x90);
+        return jump && data[0x15] >= 0xF0;
+    }
+    return false;
+}
+
+const disk_format_t *identify_disk(const disk_t *disk) {
+    disk_geometry_t geometries[2];
+    find_disk_geometry(disk, 0, &geometries[0]);
+    find_disk_geometry(disk, 2, &geometries[1]);
+    const bool dos_boot = has_dos_boot_sector(disk);
+
+    for (const disk_format_t *format = FORMATS; format->name != NULL;
+         format++) {
+        const disk_geometry_t *geometry
+            = &geometries[(format->first_cyl == 0) ? 0 : 1];
+
+        if (geometry->cyls == format->cyls
+            && geometry->heads == format->heads
+            && geometry->sectors == format->sectors
+            && geometry->sector_size_code == format->sector_size_code
+            && (dos_boot || !format->dos_boot)) {
+            return format;
+        }
+    }
+    return NULL;
+}
+
+// Write a string in single quotes for the shell.
+static void write_shell_quoted(const char *s, int len, FILE *out) {
+    fputc('\'', out);
+    for (int i = 0; i < len; i++) {
+        if (s[i] == '\'') {
+            fputs("'\\''", out);
+        } else {
+            fputc(s[i], out);
+        }
+    }
+    fputc('\'', out);
+}
+
+void show_identity(const disk_t *disk, bool with_comment, FILE *out) {
+    const disk_format_t *format = identify_disk(disk);
+
+    if (with_comment) {
+        fprintf(out, "comment=");
+        write_shell_quoted(disk->comment, disk->comment_len, out);
+        fprintf(out, "\n");
+    }
+
+    disk_geometry_t geometry;
+    find_disk_geometry(disk, (format != NULL) ? format->first_cyl : 2,
+                       &geometry);
+    fprintf(out, "cyls=%d heads=%d sectors=%d size=%d",
+            geometry.cyls, geometry.heads, geometry.sectors,
+            (geometry.sector_size_code >= 0)
+            ? sector_bytes(geometry.sector_size_code) : 0);
+
+    if (format == NULL) {
+        fprintf(out, " format=''\n");
+        return;
+    }
+    fprintf(out, " format='%s' flags='%s' sides='%s' cpmtype='%s'\n",
+            format->name, format->flags, format->sides,
+            (format->cpmtype != NULL) ? format->cpmtype : "");
+}
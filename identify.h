@@ -0,0 +1,69 @@
+/*
+    identify.h: recognise common disk formats from their layout
+
+    Copyright (C) 2013, 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    Identifying a disk's format means working out its geometry from the
+    tracks of the image, ignoring the first two cylinders for formats (like
+    RM's) that don't keep files there, and matching it against a table of
+    known formats. Each format says how to extract it with imdcat, and which
+    cpmtools format to use for it (if any).
+*/
+
+#ifndef IDENTIFY_H
+#define IDENTIFY_H
+
+#include "disk.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef struct {
+    const char *name;
+    int first_cyl; // ignore cylinders before this
+    int cyls; // including any that are ignored
+    int heads;
+    int sectors;
+    int sector_size_code;
+    bool dos_boot; // cyl 0 head 0 sector 1 must be an MS-DOS boot sector
+    const char *flags; // imdcat options to extract each side
+    const char *sides; // "0", "0 1", or "both" to extract as one image
+    const char *cpmtype; // cpmtools format name, or NULL
+} disk_format_t;
+
+typedef struct {
+    int cyls; // counting from cylinder 0
+    int heads;
+    int sectors; // the span of logical sector IDs
+    int sector_size_code; // -1 if there are no sectors; -2 if mixed
+} disk_geometry_t;
+
+// Work out the geometry of a disk from first_cyl onwards.
+void find_disk_geometry(const disk_t *disk, int first_cyl,
+                        disk_geometry_t *geometry);
+
+// Return the format that matches a disk, or NULL if there isn't one.
+// The disk's sector data must be loaded.
+const disk_format_t *identify_disk(const disk_t *disk);
+
+// Describe a disk's format as shell variable assignments. If with_comment is
+// true, the disk's comment is included too, as comment='...'.
+void show_identity(const disk_t *disk, bool with_comment, FILE *out);
+
+#endif
@@ -22,37 +22,21 @@
 
 #include "disk.h"
 #include "imd.h"
+#include "imz.h"
+#include "sectorstore.h"
 #include "util.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
-#define IMD_END_OF_COMMENT 0x1A
-
-#define IMD_HEAD_MASK 0x03
-#define IMD_NEED_CYL_MAP 0x80
-#define IMD_NEED_HEAD_MAP 0x40
-#define IMD_ALL_FLAGS (IMD_HEAD_MASK | IMD_NEED_CYL_MAP | IMD_NEED_HEAD_MAP)
-
-// These Sector Data Record flags are combined by +, not |.
-#define IMD_SDR_DATA 0x01
-#define IMD_SDR_IS_COMPRESSED 0x01
-#define IMD_SDR_IS_DELETED 0x02
-#define IMD_SDR_IS_ERROR 0x04
-
-// Read a track and add it to the disk. Return false on EOF.
-static bool read_imd_track(FILE *image, disk_t *disk) {
-    uint8_t header[5];
-    int count = fread(header, 1, 5, image);
-    if (count == 0 && feof(image)) {
-        return false;
-    }
-    if (count != 5) {
-        die("Couldn't read IMD track header");
-    }
-
+// Set up the track described by an IMD track header, and return it.
+static track_t *start_imd_track(const uint8_t *header, disk_t *disk) {
     int phys_cyl = header[1];
     if (phys_cyl >= MAX_CYLS) {
         die("IMD track cylinder value too large: %d", phys_cyl);
@@ -73,7 +57,8 @@ static bool read_imd_track(FILE *image, disk_t *disk) {
         disk->num_phys_heads = phys_head + 1;
     }
 
-    track_t *track = &disk->tracks[phys_cyl][phys_head];
+    track_t *track = disk_track(disk, phys_cyl, phys_head);
+    free_track(track);
     track->status = TRACK_PROBED;
     for (int i = 0; ; i++) {
         if (DATA_MODES[i].name == NULL) {
@@ -86,115 +71,370 @@ static bool read_imd_track(FILE *image, disk_t *disk) {
     }
     track->phys_cyl = phys_cyl;
     track->phys_head = phys_head;
-    int num_sectors = header[3];
-    track->num_sectors = num_sectors;
+    resize_track(track, header[3]);
     track->sector_size_code = header[4];
     if (track->sector_size_code == 0xFF) {
         // FIXME: implement this (by having arbitrary sector sizes)
         die("IMD variable sector size extension not supported");
     }
-    int sector_size = sector_bytes(track->sector_size_code);
+
+    return track;
+}
+
+// Fill in the sector addresses in a track from the IMD sector maps.
+// cyl_map and head_map may be NULL if they weren't present.
+static void apply_imd_maps(const uint8_t *sec_map, const uint8_t *cyl_map,
+                           const uint8_t *head_map, track_t *track) {
+    for (int phys_sec = 0; phys_sec < track->num_sectors; phys_sec++) {
+        sector_t *sector = &track->sectors[phys_sec];
+
+        sector->status = SECTOR_MISSING;
+        sector->log_cyl = cyl_map ? cyl_map[phys_sec] : track->phys_cyl;
+        sector->log_head = head_map ? head_map[phys_sec] : track->phys_head;
+        sector->log_sector = sec_map[phys_sec];
+        sector->phys_sector = phys_sec;
+        sector->deleted = false;
+        sector->data = NULL;
+        sector->data_offset = -1;
+    }
+}
+
+// Apply an IMD Sector Data Record type to a sector.
+// Return true if the record contains data, and set *compressed to say
+// whether it's a single fill byte.
+static bool apply_imd_sdr_type(uint8_t type, sector_t *sector,
+                               bool *compressed) {
+    const uint8_t orig_type = type;
+
+    if (type == 0) {
+        return false;
+    }
+    type -= IMD_SDR_DATA;
+
+    if (type >= IMD_SDR_IS_ERROR) {
+        type -= IMD_SDR_IS_ERROR;
+        sector->status = SECTOR_BAD;
+    } else {
+        sector->status = SECTOR_GOOD;
+    }
+
+    if (type >= IMD_SDR_IS_DELETED) {
+        type -= IMD_SDR_IS_DELETED;
+        sector->deleted = true;
+    }
+
+    *compressed = false;
+    if (type >= IMD_SDR_IS_COMPRESSED) {
+        type -= IMD_SDR_IS_COMPRESSED;
+        *compressed = true;
+    }
+
+    if (type != 0) {
+        die("IMD sector has unsupported flags: %08x", orig_type);
+    }
+    return true;
+}
+
+// Read part of a track record. If the image ends first, die -- or, if
+// partial is true, return false.
+static bool read_record_bytes(FILE *image, void *buf, size_t len,
+                              const char *what, bool partial) {
+    if (fread(buf, 1, len, image) == len) {
+        return true;
+    }
+    if (!partial || !feof(image)) {
+        die("Couldn't read IMD %s", what);
+    }
+    return false;
+}
+
+// Read the next track record. If partial is true and the image ends part-way
+// through the record, free the track and set *truncated.
+static track_t *read_imd_track(FILE *image, disk_t *disk, bool partial,
+                               bool *truncated) {
+    uint8_t header[5];
+    int count = fread(header, 1, 5, image);
+    if (count == 0 && feof(image)) {
+        return NULL;
+    }
+    if (count != 5) {
+        if (partial && feof(image)) {
+            *truncated = true;
+            return NULL;
+        }
+        die("Couldn't read IMD track header");
+    }
+
+    track_t *track = start_imd_track(header, disk);
+    const int num_sectors = track->num_sectors;
+    const int sector_size = sector_bytes(track->sector_size_code);
 
     uint8_t sec_map[num_sectors];
     uint8_t cyl_map[num_sectors];
     uint8_t head_map[num_sectors];
 
-    if (fread(sec_map, 1, num_sectors, image) != num_sectors) {
-        die("Couldn't read IMD sector map");
+    bool ok = read_record_bytes(image, sec_map, num_sectors,
+                                "sector map", partial);
+    if (ok && (header[2] & IMD_NEED_CYL_MAP)) {
+        ok = read_record_bytes(image, cyl_map, num_sectors,
+                               "cylinder map", partial);
     }
-    if (header[2] & IMD_NEED_CYL_MAP) {
-        if (fread(cyl_map, 1, num_sectors, image) != num_sectors) {
-            die("Couldn't read IMD cylinder map");
+    if (ok && (header[2] & IMD_NEED_HEAD_MAP)) {
+        ok = read_record_bytes(image, head_map, num_sectors,
+                               "head map", partial);
+    }
+    if (!ok) {
+        free_track(track);
+        *truncated = true;
+        return NULL;
+    }
+    apply_imd_maps(sec_map,
+                   (header[2] & IMD_NEED_CYL_MAP) ? cyl_map : NULL,
+                   (header[2] & IMD_NEED_HEAD_MAP) ? head_map : NULL,
+                   track);
+
+    for (int phys_sec = 0; phys_sec < num_sectors && ok; phys_sec++) {
+        sector_t *sector = &track->sectors[phys_sec];
+
+        uint8_t type;
+        ok = read_record_bytes(image, &type, 1, "sector header", partial);
+        bool compressed;
+        if (!ok || !apply_imd_sdr_type(type, sector, &compressed)) {
+            continue;
         }
-    } else {
-        memset(cyl_map, phys_cyl, num_sectors);
+
+        uint8_t *data = alloc_sector_data(track, sector);
+        if (compressed) {
+            uint8_t fill;
+            ok = read_record_bytes(image, &fill, 1,
+                                   "compressed sector data", partial);
+            memset(data, fill, sector_size);
+        } else {
+            ok = read_record_bytes(image, data, sector_size,
+                                   "sector data", partial);
+        }
+    }
+    if (!ok) {
+        free_track(track);
+        *truncated = true;
+        return NULL;
     }
+
+    return track;
+}
+
+track_t *read_next_imd_track(FILE *image, disk_t *disk) {
+    return read_imd_track(image, disk, false, NULL);
+}
+
+// Read the comment from the start of an image.
+static void read_imd_comment(FILE *image, disk_t *disk) {
+    disk->comment = NULL;
+    size_t dummy = 0;
+    ssize_t count = getdelim(&disk->comment, &dummy, IMD_END_OF_COMMENT, image);
+    disk->comment_len = count - 1;
+    if (count < 0 || disk->comment[disk->comment_len] != IMD_END_OF_COMMENT) {
+        die("Couldn't find IMD comment delimiter");
+    }
+    disk->comment[disk->comment_len] = '\0';
+}
+
+void start_read_imd(FILE *image, disk_t *disk) {
+    free_disk(disk);
+
+    read_imd_comment(image, disk);
+
+    disk->num_phys_cyls = 0;
+    disk->num_phys_heads = 0;
+}
+
+void read_imd(FILE *image, disk_t *disk) {
+    start_read_imd(image, disk);
+
+    while (read_next_imd_track(image, disk) != NULL) {
+        // Nothing.
+    }
+}
+
+bool read_truncated_imd(FILE *image, disk_t *disk) {
+    start_read_imd(image, disk);
+
+    bool truncated = false;
+    while (read_imd_track(image, disk, true, &truncated) != NULL) {
+        // Nothing.
+    }
+    return !truncated;
+}
+
+// A position within an IMD image in memory.
+typedef struct {
+    const uint8_t *pos;
+    const uint8_t *end;
+} imd_buf_t;
+
+// Return a pointer to the next len bytes of the image, and skip over them.
+static const uint8_t *take_imd_bytes(imd_buf_t *buf, size_t len,
+                                     const char *what) {
+    if (buf->end - buf->pos < len) {
+        die("Couldn't read IMD %s", what);
+    }
+    const uint8_t *p = buf->pos;
+    buf->pos += len;
+    return p;
+}
+
+// Index a track in an image in memory, and add it to the disk.
+// Uncompressed sectors' data points into the image.
+static void map_imd_track(imd_buf_t *buf, const uint8_t *start,
+                          imd_load_t what, disk_t *disk) {
+    const uint8_t *header = take_imd_bytes(buf, 5, "track header");
+    track_t *track = start_imd_track(header, disk);
+    const int num_sectors = track->num_sectors;
+    const int sector_size = sector_bytes(track->sector_size_code);
+
+    const uint8_t *sec_map = take_imd_bytes(buf, num_sectors, "sector map");
+    const uint8_t *cyl_map = NULL;
+    if (header[2] & IMD_NEED_CYL_MAP) {
+        cyl_map = take_imd_bytes(buf, num_sectors, "cylinder map");
+    }
+    const uint8_t *head_map = NULL;
     if (header[2] & IMD_NEED_HEAD_MAP) {
-        if (fread(head_map, 1, num_sectors, image) != num_sectors) {
-            die("Couldn't read IMD head map");
-        }
-    } else {
-        memset(head_map, phys_head, num_sectors);
+        head_map = take_imd_bytes(buf, num_sectors, "head map");
     }
+    apply_imd_maps(sec_map, cyl_map, head_map, track);
 
     for (int phys_sec = 0; phys_sec < num_sectors; phys_sec++) {
         sector_t *sector = &track->sectors[phys_sec];
 
-        sector->status = SECTOR_MISSING;
-        sector->log_cyl = cyl_map[phys_sec];
-        sector->log_head = head_map[phys_sec];
-        sector->log_sector = sec_map[phys_sec];
-        sector->phys_sector = phys_sec;
-        sector->deleted = false;
-        sector->data = NULL;
+        sector->data_offset = buf->pos - start;
+        const uint8_t type = *take_imd_bytes(buf, 1, "sector header");
 
-        uint8_t type, orig_type;
-        if (fread(&type, 1, 1, image) != 1) {
-            die("Couldn't read IMD sector header");
+        bool compressed;
+        if (!apply_imd_sdr_type(type, sector, &compressed)) {
+            continue;
         }
-        orig_type = type;
 
-        if (type > 0) {
-            type -= IMD_SDR_DATA;
-
-            sector->data = malloc(sector_size);
-            if (sector->data == NULL) {
-                die("malloc failed");
+        if (compressed) {
+            const uint8_t fill = *take_imd_bytes(buf, 1,
+                                                 "compressed sector data");
+            if (what == IMD_LOAD_DATA) {
+                memset(alloc_sector_data(track, sector), fill, sector_size);
             }
-
-            if (type >= IMD_SDR_IS_ERROR) {
-                type -= IMD_SDR_IS_ERROR;
-                sector->status = SECTOR_BAD;
-            } else {
-                sector->status = SECTOR_GOOD;
+        } else {
+            const uint8_t *data = take_imd_bytes(buf, sector_size,
+                                                 "sector data");
+            if (what == IMD_LOAD_DATA) {
+                // The mapping is private, so it's safe to point at it
+                // directly.
+                sector->data = (uint8_t *) data;
             }
+        }
+    }
+}
 
-            if (type >= IMD_SDR_IS_DELETED) {
-                type -= IMD_SDR_IS_DELETED;
-                sector->deleted = true;
-            }
+static sector_store_t *ref_store = NULL;
 
-            if (type >= IMD_SDR_IS_COMPRESSED) {
-                type -= IMD_SDR_IS_COMPRESSED;
+void set_imd_ref_store(sector_store_t *store) {
+    ref_store = store;
+}
 
-                uint8_t fill;
-                if (fread(&fill, 1, 1, image) != 1) {
-                    die("Couldn't read IMD compressed sector data");
-                }
-                memset(sector->data, fill, sector_size);
-            } else {
-                if (fread(sector->data, 1, sector_size, image) != sector_size) {
-                    die("Couldn't read IMD sector data");
-                }
-            }
+void load_imd(const char *filename, imd_load_t what, disk_t *disk) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        die_errno("cannot open %s", filename);
+    }
 
-            if (type != 0) {
-                die("IMD sector has unsupported flags: %08x", orig_type);
-            }
+    if (what == IMD_LOAD_COMMENT) {
+        // The comment is at the start, so there's no need to look further.
+        FILE *f = fdopen(fd, "rb");
+        if (f == NULL) {
+            die_errno("cannot open %s", filename);
+        }
+        f = open_imz_stream(f);
+        free_disk(disk);
+        read_imd_comment(f, disk);
+        fclose(f);
+
+        // A reference file has the same comment after its magic, so it can
+        // be read without the store.
+        const int magic_len = strlen(IMD_REF_MAGIC);
+        if (is_imd_ref(disk->comment, disk->comment_len)) {
+            disk->comment_len -= magic_len;
+            memmove(disk->comment, disk->comment + magic_len,
+                    disk->comment_len + 1);
         }
+        return;
     }
 
-    return true;
-}
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0);
+    }
+
+    if (map == MAP_FAILED) {
+        // Not something we can map -- fall back to reading it.
+        FILE *f = fdopen(fd, "rb");
+        if (f == NULL) {
+            die_errno("cannot open %s", filename);
+        }
+        f = open_imz_stream(f);
+        read_imd(f, disk);
+        fclose(f);
+        return;
+    }
+    close(fd);
+
+    size_t map_len = st.st_size;
+    if (is_imz(map, map_len)) {
+        // Decompress it into memory, and use that instead.
+        size_t raw_len;
+        void *raw = inflate_imz(map, map_len, &raw_len);
+        munmap(map, map_len);
+        map = raw;
+        map_len = raw_len;
+    } else if (is_imd_ref(map, map_len)) {
+        if (ref_store == NULL) {
+            die("%s is a reference file; a sector store is needed to read it",
+                filename);
+        }
+        size_t raw_len;
+        void *raw = export_imd_mapping(map, map_len, ref_store, &raw_len);
+        munmap(map, map_len);
+        map = raw;
+        map_len = raw_len;
+    }
 
-void read_imd(FILE *image, disk_t *disk) {
     free_disk(disk);
+    disk->mapped = map;
+    disk->mapped_len = map_len;
+
+    imd_buf_t buf = {
+        .pos = map,
+        .end = (const uint8_t *) map + map_len,
+    };
 
     // Read the comment.
-    disk->comment = NULL;
-    size_t dummy = 0;
-    ssize_t count = getdelim(&disk->comment, &dummy, IMD_END_OF_COMMENT, image);
-    disk->comment_len = count - 1;
-    if (count < 0 || disk->comment[disk->comment_len] != IMD_END_OF_COMMENT) {
+    const uint8_t *comment_end = memchr(buf.pos, IMD_END_OF_COMMENT,
+                                        buf.end - buf.pos);
+    if (comment_end == NULL) {
         die("Couldn't find IMD comment delimiter");
     }
+    disk->comment_len = comment_end - buf.pos;
+    disk->comment = malloc(disk->comment_len + 1);
+    if (disk->comment == NULL) {
+        die("malloc failed");
+    }
+    memcpy(disk->comment, buf.pos, disk->comment_len);
     disk->comment[disk->comment_len] = '\0';
+    buf.pos = comment_end + 1;
 
     disk->num_phys_cyls = 0;
     disk->num_phys_heads = 0;
 
-    while (read_imd_track(image, disk)) {
-        // Nothing.
+    while (buf.pos != buf.end) {
+        map_imd_track(&buf, map, what, disk);
     }
 }
 
@@ -205,46 +445,112 @@ void write_imd_header(const disk_t *disk, FILE *image) {
     fputc(IMD_END_OF_COMMENT, image);
 }
 
-void write_imd_track(const track_t *track, FILE *image) {
-    uint8_t flags = 0;
+// Append len bytes from the image to a record being read.
+static void take_record_bytes(FILE *image, buffer_t *record, size_t len,
+                              const char *what) {
+    if (fread(buffer_reserve(record, len), 1, len, image) != len) {
+        die("Couldn't read IMD %s", what);
+    }
+    record->len += len;
+}
 
-    uint8_t sec_map[track->num_sectors];
-    uint8_t cyl_map[track->num_sectors];
-    uint8_t head_map[track->num_sectors];
-    for (int i = 0; i < track->num_sectors; i++) {
-        const sector_t *sector = &(track->sectors[i]);
+bool read_imd_record(FILE *image, size_t data_len, buffer_t *record,
+                     imd_record_layout_t *layout) {
+    record->len = 0;
+
+    uint8_t *header = buffer_reserve(record, 5);
+    const size_t count = fread(header, 1, 5, image);
+    if (count == 0 && feof(image)) {
+        return false;
+    }
+    if (count != 5) {
+        die("Couldn't read IMD track header");
+    }
+    if ((header[2] & ~IMD_ALL_FLAGS) != 0) {
+        die("IMD track has unsupported flags: %02x", header[2]);
+    }
+    if (header[4] > IMD_MAX_SIZE_CODE) {
+        die("IMD sector size code too large: %d", header[4]);
+    }
+    record->len = 5;
+
+    layout->num_sectors = header[3];
+    layout->sector_size = sector_bytes(header[4]);
+    if (data_len == 0) {
+        data_len = layout->sector_size;
+    }
+
+    // Sector, cylinder and head maps.
+    int num_maps = 1;
+    if (header[2] & IMD_NEED_CYL_MAP) num_maps++;
+    if (header[2] & IMD_NEED_HEAD_MAP) num_maps++;
+    take_record_bytes(image, record, layout->num_sectors * num_maps,
+                      "sector map");
+
+    for (int i = 0; i < layout->num_sectors; i++) {
+        layout->sdr_offset[i] = record->len;
+        take_record_bytes(image, record, 1, "sector header");
+        const uint8_t type = record->data[record->len - 1];
+        if (type > IMD_MAX_SDR_TYPE) {
+            die("IMD sector data record type unknown: %d", type);
+        }
 
-        sec_map[i] = sector->log_sector;
-        cyl_map[i] = sector->log_cyl;
-        head_map[i] = sector->log_head;
+        if (type == 0) {
+            // Data unavailable.
+        } else if ((type & 1) == 0) {
+            // Compressed, so the data is a single byte.
+            take_record_bytes(image, record, 1, "compressed sector data");
+        } else {
+            take_record_bytes(image, record, data_len, "sector data");
+        }
+    }
+
+    return true;
+}
+
+void encode_imd_track(const track_t *track, buffer_t *buf) {
+    const int num_sectors = track->num_sectors;
+    const int sector_size = sector_bytes(track->sector_size_code);
+
+    // Make sure there's room for the largest possible record.
+    buf->len = 0;
+    uint8_t *p = buffer_reserve(buf,
+                                5 + (3 * num_sectors)
+                                + (num_sectors * (1 + sector_size)));
+
+    uint8_t flags = 0;
+    for (int i = 0; i < num_sectors; i++) {
+        const sector_t *sector = &(track->sectors[i]);
 
-        if (cyl_map[i] != track->phys_cyl) {
+        if (sector->log_cyl != track->phys_cyl) {
             flags |= IMD_NEED_CYL_MAP;
         }
-        if (head_map[i] != track->phys_head) {
+        if (sector->log_head != track->phys_head) {
             flags |= IMD_NEED_HEAD_MAP;
         }
     }
 
-    const uint8_t header[] = {
-        track->data_mode->imd_mode,
-        track->phys_cyl,
-        flags | track->phys_head,
-        track->num_sectors,
-        track->sector_size_code,
-    };
-    fwrite(header, 1, 5, image);
+    *p++ = track->data_mode->imd_mode;
+    *p++ = track->phys_cyl;
+    *p++ = flags | track->phys_head;
+    *p++ = num_sectors;
+    *p++ = track->sector_size_code;
 
-    fwrite(sec_map, 1, track->num_sectors, image);
+    for (int i = 0; i < num_sectors; i++) {
+        *p++ = track->sectors[i].log_sector;
+    }
     if (flags & IMD_NEED_CYL_MAP) {
-        fwrite(cyl_map, 1, track->num_sectors, image);
+        for (int i = 0; i < num_sectors; i++) {
+            *p++ = track->sectors[i].log_cyl;
+        }
     }
     if (flags & IMD_NEED_HEAD_MAP) {
-        fwrite(head_map, 1, track->num_sectors, image);
+        for (int i = 0; i < num_sectors; i++) {
+            *p++ = track->sectors[i].log_head;
+        }
     }
 
-    const int sector_size = sector_bytes(track->sector_size_code);
-    for (int i = 0; i < track->num_sectors; i++) {
+    for (int i = 0; i < num_sectors; i++) {
         const sector_t *sector = &(track->sectors[i]);
 
         uint8_t type = 0;
@@ -263,23 +569,26 @@ void write_imd_track(const track_t *track, FILE *image) {
         }
 
         if (sector->data != NULL) {
-            const uint8_t first = sector->data[0];
-            bool can_compress = true;
-            for (int i = 0; i < sector_size; i++) {
-                if (sector->data[i] != first) {
-                    can_compress = false;
-                }
-            }
-
-            if (can_compress) {
-                fputc(type + IMD_SDR_IS_COMPRESSED, image);
-                fputc(first, image);
+            if (is_uniform(sector->data, sector_size)) {
+                *p++ = type + IMD_SDR_IS_COMPRESSED;
+                *p++ = sector->data[0];
             } else {
-                fputc(type, image);
-                fwrite(sector->data, 1, sector_size, image);
+                *p++ = type;
+                memcpy(p, sector->data, sector_size);
+                p += sector_size;
             }
         } else {
-            fputc(type, image);
+            *p++ = type;
         }
     }
+
+    buf->len = p - buf->data;
+}
+
+void write_imd_track(const track_t *track, FILE *image) {
+    buffer_t buf;
+    init_buffer(&buf);
+    encode_imd_track(track, &buf);
+    fwrite(buf.data, 1, buf.len, image);
+    free_buffer(&buf);
 }
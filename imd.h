@@ -21,10 +21,84 @@
 #ifndef IMD_H
 #define IMD_H
 
+#include "disk.h"
+#include "sectorstore.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
+#define IMD_END_OF_COMMENT 0x1A
+
+// Flags in the head byte of a track header.
+#define IMD_HEAD_MASK 0x03
+#define IMD_NEED_CYL_MAP 0x80
+#define IMD_NEED_HEAD_MAP 0x40
+#define IMD_ALL_FLAGS (IMD_HEAD_MASK | IMD_NEED_CYL_MAP | IMD_NEED_HEAD_MAP)
+
+// These Sector Data Record flags are combined by +, not |.
+#define IMD_SDR_DATA 0x01
+#define IMD_SDR_IS_COMPRESSED 0x01
+#define IMD_SDR_IS_DELETED 0x02
+#define IMD_SDR_IS_ERROR 0x04
+#define IMD_MAX_SDR_TYPE 8
+
+#define IMD_MAX_SIZE_CODE 6
+
 void read_imd(FILE *image, disk_t *disk);
+
+// Like read_imd, but if the image ends part-way through a track record (as it
+// will if dumpfloppy was interrupted while writing it), stop after the last
+// complete track rather than dying. Returns false if there was a partial
+// track.
+bool read_truncated_imd(FILE *image, disk_t *disk);
+
+// Read an image a track at a time. start_read_imd reads the comment; then
+// each call to read_next_imd_track reads the next track into the disk, and
+// returns it (or NULL at the end of the image). Tracks can be freed with
+// free_track once they're no longer needed.
+void start_read_imd(FILE *image, disk_t *disk);
+track_t *read_next_imd_track(FILE *image, disk_t *disk);
+
+typedef enum {
+    IMD_LOAD_DATA = 0, // everything
+    IMD_LOAD_LAYOUT, // tracks and sectors, but sector data may be left NULL
+    IMD_LOAD_COMMENT // only the comment
+} imd_load_t;
+
+// Load an image from a file. If possible, the file is mapped into memory and
+// the sectors' data points into it, rather than being copied. The file can
+// also be an .IMZ container (see imz.h), which is decompressed into memory,
+// or a reference file (see sectorstore.h), which is rebuilt in memory using
+// the store given to set_imd_ref_store.
+void load_imd(const char *filename, imd_load_t what, disk_t *disk);
+
+// Set the store that load_imd uses for reference files. Without one, it
+// can't load them.
+void set_imd_ref_store(sector_store_t *store);
 void write_imd_header(const disk_t *disk, FILE *image);
+
+// Where the Sector Data Records are in a track record.
+typedef struct {
+    int num_sectors;
+    size_t sector_size;
+    size_t sdr_offset[MAX_SECS]; // from the start of the record
+} imd_record_layout_t;
+
+// Read the next track record from an image into record, as it is, checking
+// its structure but not decoding it. A Sector Data Record that isn't
+// compressed is taken to have data_len bytes of data, or the sector size if
+// data_len is 0. (Reference files, in sectorstore.h, have hashes instead.)
+// Returns false at the end of the image.
+bool read_imd_record(FILE *image, size_t data_len, buffer_t *record,
+                     imd_record_layout_t *layout);
+
+// Encode a track as an IMD track record, replacing the contents of buf.
+// (Reusing the same buffer for each track avoids reallocating it.)
+void encode_imd_track(const track_t *track, buffer_t *buf);
+
+// Write a track record with a single fwrite.
 void write_imd_track(const track_t *track, FILE *image);
 
 #endif
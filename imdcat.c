@@ -19,12 +19,17 @@
 */
 
 #include "disk.h"
+#include "identify.h"
 #include "imd.h"
+#include "imz.h"
 #include "show.h"
+#include "trackhash.h"
 #include "util.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 typedef struct {
@@ -33,12 +38,21 @@ typedef struct {
 } range;
 
 static struct args {
-    const char *image_filename;
+    const char **image_filenames;
+    int num_images;
+    int num_jobs;
     bool show_comment;
     const char *flat_filename;
+    const char *imz_filename;
+    const char *imd_filename;
     bool verbose;
     bool show_data;
+    bool identify;
+    bool verify;
+    bool write_hashes;
     bool permissive;
+    const char *merge_filename;
+    const char *store_dir;
     range in_cyls, in_heads, in_sectors;
     range out_cyls, out_heads, out_sectors;
 } args;
@@ -64,78 +78,43 @@ static void apply_range_option(const range *in, range *out) {
     }
 }
 
-typedef struct {
-    int cyl; // either log or phys, depending on options
-    int head;
-    int sector;
-    const uint8_t *data; // NULL if this is a dummy
-} lump_t;
+// Extend r to include all of other.
+static void union_range(const range *other, range *r) {
+    if (other->start >= other->end) return;
 
-static void add_lump(int cyl, int head, int sector, const uint8_t *data,
-                     lump_t **list, int *num, int *size) {
-    if (*num == *size) {
-        // Expand the list.
-        *size = (*size * 2) + 1;
-        *list = realloc(*list, (*size) * (sizeof **list));
-        if (*list == NULL) {
-            die("realloc failed");
-        }
+    if (r->start >= r->end) {
+        *r = *other;
+        return;
+    }
+    if (other->start < r->start) {
+        r->start = other->start;
+    }
+    if (other->end > r->end) {
+        r->end = other->end;
     }
-
-    lump_t *lump = &(*list)[*num];
-    lump->cyl = cyl;
-    lump->head = head;
-    lump->sector = sector;
-    lump->data = data;
-    (*num)++;
-}
-
-static int cmp_lump_addr(const lump_t *left, const lump_t *right) {
-    int d;
-
-    d = left->cyl - right->cyl;
-    if (d != 0) return d;
-
-    d = left->head - right->head;
-    if (d != 0) return d;
-
-    d = left->sector - right->sector;
-    if (d != 0) return d;
-
-    return 0;
 }
 
-static int cmp_lump(const void *left_v, const void *right_v) {
-    const lump_t *left = (const lump_t *) left_v;
-    const lump_t *right = (const lump_t *) right_v;
-
-    int d = cmp_lump_addr(left, right);
-    if (d != 0) return d;
-
-    // A lump with data should sort before a lump without data.
-    if (left->data != NULL && right->data == NULL) return -1;
-    if (left->data == NULL && right->data != NULL) return 1;
-
-    return 0;
+static bool in_range(int value, const range *r) {
+    return value >= r->start && value < r->end;
 }
 
 static void write_flat(const disk_t *disk, FILE *flat) {
-    // The list of lumps to write.
-    lump_t *lumps = NULL;
-    int num_lumps = 0;
-    int size_lumps = 0;
-
     // The range of C/H/S to use in the output image (based on what we load).
     range out_cyls = {MAX_CYLS, 0};
     range out_heads = {MAX_HEADS, 0};
     range out_sectors = {MAX_SECS, 0};
     int size_code = -1;
 
+    // The range of C/H/S that we have data for.
+    range data_cyls = {MAX_CYLS, 0};
+    range data_heads = {MAX_HEADS, 0};
+    range data_sectors = {MAX_SECS, 0};
+
     // Find the range of cylinders, heads and sectors to write.
-    // For each real sector, add a lump.
     for_range (phys_cyl, &args.in_cyls) {
         for_range (phys_head, &args.in_heads) {
-            const track_t *track = &disk->tracks[phys_cyl][phys_head];
+            const track_t *track = disk_find_track(disk, phys_cyl,
+                                                   phys_head);
 
             for (int phys_sec = 0; phys_sec < track->num_sectors; phys_sec++) {
                 const sector_t *sector = &track->sectors[phys_sec];
@@ -157,8 +136,9 @@ static void write_flat(const disk_t *disk, FILE *flat) {
                 // FIXME: Option to include/exclude bad/deleted sectors
                 if (sector->status == SECTOR_MISSING) continue;
 
-                add_lump(cyl, head, sec, sector->data,
-                         &lumps, &num_lumps, &size_lumps);
+                update_range(cyl, &data_cyls);
+                update_range(head, &data_heads);
+                update_range(sec, &data_sectors);
 
                 if (size_code != -1 && track->sector_size_code != size_code) {
                     die("Tracks have inconsistent sector sizes");
@@ -173,57 +153,574 @@ static void write_flat(const disk_t *disk, FILE *flat) {
     apply_range_option(&args.out_heads, &out_heads);
     apply_range_option(&args.out_sectors, &out_sectors);
 
-    // For each sector that *should* exist, add a dummy lump.
-    for_range (cyl, &out_cyls) {
-        for_range (head, &out_heads) {
-            for_range (sec, &out_sectors) {
-                add_lump(cyl, head, sec, NULL,
-                         &lumps, &num_lumps, &size_lumps);
+    // We write every sector in the output ranges, and any real sectors
+    // outside them too, in C/H/S order.
+    range all_cyls = out_cyls, all_heads = out_heads, all_sectors = out_sectors;
+    union_range(&data_cyls, &all_cyls);
+    union_range(&data_heads, &all_heads);
+    union_range(&data_sectors, &all_sectors);
+    if (all_cyls.start >= all_cyls.end || all_heads.start >= all_heads.end
+        || all_sectors.start >= all_sectors.end) {
+        // Nothing to write.
+        return;
+    }
+
+    const int num_heads = all_heads.end - all_heads.start;
+    const int num_sectors = all_sectors.end - all_sectors.start;
+    const size_t num_cells = (size_t) (all_cyls.end - all_cyls.start)
+                             * num_heads * num_sectors;
+#define CELL(cyl, head, sec) \
+    ((((size_t) ((cyl) - all_cyls.start) * num_heads) \
+      + ((head) - all_heads.start)) * num_sectors + ((sec) - all_sectors.start))
+
+    // The data for each C/H/S (NULL if we don't have any).
+    const uint8_t **cells = calloc(num_cells, sizeof *cells);
+    if (cells == NULL) {
+        die("calloc failed");
+    }
+
+    for_range (phys_cyl, &args.in_cyls) {
+        for_range (phys_head, &args.in_heads) {
+            const track_t *track = disk_find_track(disk, phys_cyl,
+                                                   phys_head);
+
+            for (int phys_sec = 0; phys_sec < track->num_sectors; phys_sec++) {
+                const sector_t *sector = &track->sectors[phys_sec];
+                int sec = sector->log_sector;
+
+                if (sec < args.in_sectors.start || sec >= args.in_sectors.end) {
+                    continue;
+                }
+                if (sector->status == SECTOR_MISSING) continue;
+
+                const uint8_t **cell = &cells[CELL(phys_cyl, phys_head, sec)];
+                if (*cell != NULL) {
+                    // Duplicate address -- which isn't OK if, say, we're
+                    // extracting a disk that uses the same head number on
+                    // both sides.
+                    if (!args.permissive) {
+                        die("Two sectors found for cylinder %d head %d "
+                            "sector %d", phys_cyl, phys_head, sec);
+                    }
+                    continue;
+                }
+                *cell = sector->data;
             }
         }
     }
 
-    // Sort the whole lot.
-    qsort(lumps, num_lumps, sizeof *lumps, cmp_lump);
-
-    // Data to write where we don't have a real sector.
+    // Work out how big the output will be.
     const int sector_size = sector_bytes(size_code);
-    uint8_t dummy_data[sector_size];
-    memset(dummy_data, 0xFF, sector_size);
-
-    // Go through the list, and write the first lump that comes up with each
-    // address.
-    for (int i = 0; i < num_lumps; i++) {
-        const lump_t *lump = &lumps[i];
-
-        if (i > 0 && cmp_lump_addr(&lumps[i - 1], lump) == 0) {
-            // Duplicate address -- which is OK if this is a dummy one.
-            // But not if, say, we're extracting a disk that uses the same head
-            // number on both sides.
-            if (lump->data != NULL && !args.permissive) {
-                die("Two sectors found for cylinder %d head %d sector %d",
-                    lump->cyl, lump->head, lump->sector);
+    size_t num_out = 0;
+    for_range (cyl, &all_cyls) {
+        for_range (head, &all_heads) {
+            for_range (sec, &all_sectors) {
+                if (cells[CELL(cyl, head, sec)] != NULL
+                    || (in_range(cyl, &out_cyls) && in_range(head, &out_heads)
+                        && in_range(sec, &out_sectors))) {
+                    num_out++;
+                }
+            }
+        }
+    }
+
+    // Build the output, filling in 0xFF where we don't have a real sector,
+    // and write it in one go.
+    uint8_t *out = malloc(num_out * sector_size);
+    if (out == NULL && num_out > 0) {
+        die("malloc failed");
+    }
+    uint8_t *pos = out;
+    for_range (cyl, &all_cyls) {
+        for_range (head, &all_heads) {
+            for_range (sec, &all_sectors) {
+                const uint8_t *data = cells[CELL(cyl, head, sec)];
+                if (data != NULL) {
+                    memcpy(pos, data, sector_size);
+                } else if (in_range(cyl, &out_cyls)
+                           && in_range(head, &out_heads)
+                           && in_range(sec, &out_sectors)) {
+                    memset(pos, 0xFF, sector_size);
+                } else {
+                    continue;
+                }
+                pos += sector_size;
+            }
+        }
+    }
+#undef CELL
+
+    if (fwrite(out, 1, num_out * sector_size, flat) != num_out * sector_size) {
+        die_errno("cannot write flat file");
+    }
+
+    free(out);
+    free(cells);
+}
+
+// Write 0xFF for count sectors of the given size.
+static void write_fill(size_t count, int sector_size, FILE *flat) {
+    uint8_t fill[sector_size];
+    memset(fill, 0xFF, sector_size);
+    for (size_t i = 0; i < count; i++) {
+        if (fwrite(fill, 1, sector_size, flat) != sector_size) {
+            die_errno("cannot write flat file");
+        }
+    }
+}
+
+// Return whether the output ranges have all been given as options, so that
+// the layout of the flat file is known before reading the image.
+static bool have_output_ranges(void) {
+    return args.out_cyls.start != -1 && args.out_cyls.end != -1
+           && args.out_heads.start != -1 && args.out_heads.end != -1
+           && args.out_sectors.start != -1 && args.out_sectors.end != -1;
+}
+
+// Convert an image to a flat file a track at a time, as write_flat does,
+// but without loading the whole image. This needs have_output_ranges, and
+// the image's tracks must be in C/H order with all their sectors inside the
+// output ranges. If they aren't, return false, setting *problem to a
+// description (malloc-d).
+static bool stream_flat(FILE *image, FILE *flat, char **problem) {
+    const range *out_cyls = &args.out_cyls;
+    const range *out_heads = &args.out_heads;
+    const range *out_sectors = &args.out_sectors;
+    if (out_cyls->start >= out_cyls->end || out_heads->start >= out_heads->end
+        || out_sectors->start >= out_sectors->end) {
+        // Nothing to write.
+        return true;
+    }
+    const int num_heads = out_heads->end - out_heads->start;
+    const int num_sectors = out_sectors->end - out_sectors->start;
+    const size_t num_cells = (size_t) (out_cyls->end - out_cyls->start)
+                             * num_heads * num_sectors;
+
+    disk_t disk;
+    init_disk(&disk);
+    start_read_imd(image, &disk);
+
+    int size_code = -1;
+    int sector_size = 0;
+    // The output for the current track, and which sectors we've got.
+    uint8_t *track_out = NULL;
+    bool have[num_sectors];
+    // How many sectors have been written so far.
+    size_t next_cell = 0;
+    int last_track = -1;
+    bool fits = true;
+
+    track_t *track;
+    while (fits && (track = read_next_imd_track(image, &disk)) != NULL) {
+        const int cyl = track->phys_cyl;
+        const int head = track->phys_head;
+        if (!in_range(cyl, &args.in_cyls) || !in_range(head, &args.in_heads)) {
+            free_track(track);
+            continue;
+        }
+
+        memset(have, 0, sizeof have);
+        bool any = false;
+        for (int phys_sec = 0; phys_sec < track->num_sectors; phys_sec++) {
+            const sector_t *sector = &track->sectors[phys_sec];
+            const int sec = sector->log_sector;
+
+            if (!in_range(sec, &args.in_sectors)) continue;
+            if (sector->status == SECTOR_MISSING) continue;
+
+            if (size_code != -1 && track->sector_size_code != size_code) {
+                die("Tracks have inconsistent sector sizes");
+            }
+            if (size_code == -1) {
+                size_code = track->sector_size_code;
+                sector_size = sector_bytes(size_code);
+                track_out = malloc(num_sectors * sector_size);
+                if (track_out == NULL) {
+                    die("malloc failed");
+                }
+            }
+
+            if (!in_range(cyl, out_cyls) || !in_range(head, out_heads)
+                || !in_range(sec, out_sectors)) {
+                *problem = alloc_sprintf("Cylinder %d head %d sector %d is "
+                                         "outside the output ranges",
+                                         cyl, head, sec);
+                fits = false;
+                break;
+            }
+
+            const int i = sec - out_sectors->start;
+            if (have[i]) {
+                if (!args.permissive) {
+                    die("Two sectors found for cylinder %d head %d "
+                        "sector %d", cyl, head, sec);
+                }
+                continue;
             }
+            memcpy(track_out + (size_t) i * sector_size, sector->data,
+                   sector_size);
+            have[i] = true;
+            any = true;
+        }
+        free_track(track);
+        if (!fits || !any) continue;
+
+        const int this_track = (cyl - out_cyls->start) * num_heads
+                               + (head - out_heads->start);
+        if (this_track <= last_track) {
+            *problem = alloc_sprintf("Track %d.%d is out of order in the "
+                                     "image, so it can't be streamed",
+                                     cyl, head);
+            fits = false;
             continue;
         }
+        last_track = this_track;
 
-        const uint8_t *data = lump->data;
-        if (data == NULL) {
-            data = dummy_data;
+        // Fill in any sectors before this track, then write the track.
+        const size_t first_cell = (size_t) this_track * num_sectors;
+        write_fill(first_cell - next_cell, sector_size, flat);
+        for (int i = 0; i < num_sectors; i++) {
+            if (have[i]) {
+                if (fwrite(track_out + (size_t) i * sector_size, 1,
+                           sector_size, flat) != sector_size) {
+                    die_errno("cannot write flat file");
+                }
+            } else {
+                write_fill(1, sector_size, flat);
+            }
         }
-        fwrite(data, 1, sector_size, flat);
+        next_cell = first_cell + num_sectors;
+    }
+
+    if (fits && size_code != -1) {
+        write_fill(num_cells - next_cell, sector_size, flat);
     }
 
-    free(lumps);
+    free(track_out);
+    free_disk(&disk);
+    return fits;
+}
+
+// One of the images being merged.
+typedef struct {
+    const char *filename;
+    FILE *file;
+    disk_t disk;
+    track_t *track; // the next track to merge, or NULL at the end
+} merge_input_t;
+
+static int track_key(const track_t *track) {
+    return (track->phys_cyl * MAX_HEADS) + track->phys_head;
+}
+
+// Move on to the next track of an input, freeing the current one.
+static void next_merge_track(merge_input_t *input) {
+    int prev_key = -1;
+    if (input->track != NULL) {
+        prev_key = track_key(input->track);
+        free_track(input->track);
+    }
+
+    input->track = read_next_imd_track(input->file, &input->disk);
+    if (input->track != NULL && track_key(input->track) <= prev_key) {
+        die("%s: tracks are not in order", input->filename);
+    }
+}
+
+// How the sectors in a merged image were chosen.
+typedef struct {
+    int good;
+    int bad;
+    int voted; // bad sectors built from several bad copies
+    int missing;
+    int dropped; // copies of tracks that didn't match the others
+} merge_stats_t;
+
+// Fill in a sector's data by voting on each byte across several bad copies.
+// When there's a tie, the earliest copy wins.
+static void vote_sector(const sector_t **copies, int num_copies, int size,
+                        uint8_t *data) {
+    for (int i = 0; i < size; i++) {
+        int best_count = 0;
+        for (int j = 0; j < num_copies; j++) {
+            const uint8_t value = copies[j]->data[i];
+            int count = 0;
+            for (int k = 0; k < num_copies; k++) {
+                if (copies[k]->data[i] == value) count++;
+            }
+            if (count > best_count) {
+                best_count = count;
+                data[i] = value;
+            }
+        }
+    }
+}
+
+// If a copy of a track can't be merged with the base copy, say why.
+static const char *track_mismatch(const track_t *base, const track_t *copy) {
+    if (copy->num_sectors == 0) {
+        return NULL;
+    }
+    if (copy->sector_size_code != base->sector_size_code) {
+        return "a different sector size";
+    }
+    if (copy->data_mode != base->data_mode) {
+        return "a different data mode";
+    }
+    if (base->num_sectors > 0
+        && copy->sectors[0].log_cyl != base->sectors[0].log_cyl) {
+        return "a different logical cylinder";
+    }
+    return NULL;
+}
+
+// Merge several copies of the same track into out.
+// names[i] is the image that tracks[i] came from.
+static void merge_tracks(track_t **tracks, const char **names, int num_tracks,
+                         track_t *out, merge_stats_t *stats) {
+    // Use the layout of the copy with the most good sectors (and then the
+    // most sectors) -- it's the one most likely to have been probed right.
+    const track_t *base = tracks[0];
+    int base_good = -1;
+    for (int i = 0; i < num_tracks; i++) {
+        int good = 0;
+        for (int j = 0; j < tracks[i]->num_sectors; j++) {
+            if (tracks[i]->sectors[j].status == SECTOR_GOOD) good++;
+        }
+        if (good > base_good
+            || (good == base_good
+                && tracks[i]->num_sectors > base->num_sectors)) {
+            base = tracks[i];
+            base_good = good;
+        }
+    }
+
+    // Copies that disagree with it about the layout are probably from a
+    // different disk, or were probed wrongly, so can't be merged.
+    const track_t *usable[num_tracks];
+    int num_usable = 0;
+    for (int i = 0; i < num_tracks; i++) {
+        const char *mismatch = track_mismatch(base, tracks[i]);
+        if (mismatch == NULL) {
+            usable[num_usable++] = tracks[i];
+            continue;
+        }
+
+        fprintf(stderr, "%s: ignoring cyl %d head %d, which has %s\n",
+                names[i], tracks[i]->phys_cyl, tracks[i]->phys_head,
+                mismatch);
+        stats->dropped++;
+    }
+
+    // Work out which sectors the merged track has: the base's, followed by
+    // any that only appear in other copies.
+    const sector_t *addrs[MAX_SECS];
+    int num_addrs = 0;
+    for (int i = 0; i < base->num_sectors; i++) {
+        addrs[num_addrs++] = &base->sectors[i];
+    }
+    for (int i = 0; i < num_usable; i++) {
+        if (usable[i] == base) continue;
+
+        for (int j = 0; j < usable[i]->num_sectors; j++) {
+            const sector_t *sector = &usable[i]->sectors[j];
+
+            bool seen = false;
+            for (int k = 0; k < num_addrs; k++) {
+                if (same_sector_addr(addrs[k], sector)) {
+                    seen = true;
+                    break;
+                }
+            }
+            if (!seen && num_addrs < MAX_SECS) {
+                addrs[num_addrs++] = sector;
+            }
+        }
+    }
+
+    out->status = TRACK_PROBED;
+    out->data_mode = base->data_mode;
+    out->sector_size_code = base->sector_size_code;
+    resize_track(out, num_addrs);
+    const int size = sector_bytes(base->sector_size_code);
+
+    for (int i = 0; i < num_addrs; i++) {
+        sector_t *sector = &out->sectors[i];
+        sector->log_cyl = addrs[i]->log_cyl;
+        sector->log_head = addrs[i]->log_head;
+        sector->log_sector = addrs[i]->log_sector;
+        sector->phys_sector = i;
+
+        // Find the copies of this sector, preferring good to bad to missing.
+        const sector_t *good = NULL;
+        const sector_t *bad[num_usable];
+        int num_bad = 0;
+        for (int j = 0; j < num_usable && good == NULL; j++) {
+            for (int k = 0; k < usable[j]->num_sectors; k++) {
+                const sector_t *copy = &usable[j]->sectors[k];
+                if (!same_sector_addr(copy, sector)) continue;
+
+                if (copy->status == SECTOR_GOOD) {
+                    good = copy;
+                } else if (copy->status == SECTOR_BAD) {
+                    bad[num_bad++] = copy;
+                }
+                break;
+            }
+        }
+
+        if (good != NULL) {
+            sector->status = SECTOR_GOOD;
+            sector->deleted = good->deleted;
+            memcpy(alloc_sector_data(out, sector), good->data, size);
+            stats->good++;
+        } else if (num_bad > 0) {
+            sector->status = SECTOR_BAD;
+            sector->deleted = bad[0]->deleted;
+            vote_sector(bad, num_bad, size, alloc_sector_data(out, sector));
+            stats->bad++;
+            if (num_bad > 1) {
+                stats->voted++;
+            }
+        } else {
+            sector->status = SECTOR_MISSING;
+            stats->missing++;
+        }
+    }
+}
+
+// Merge all the images, track by track, into a single image.
+// Only one track from each image is in memory at once.
+static void merge_images(const char *merge_filename, FILE *out) {
+    merge_input_t inputs[args.num_images];
+    for (int i = 0; i < args.num_images; i++) {
+        merge_input_t *input = &inputs[i];
+        input->filename = args.image_filenames[i];
+        input->file = fopen(input->filename, "rb");
+        if (input->file == NULL) {
+            die_errno("cannot open %s", input->filename);
+        }
+        input->file = open_imz_stream(input->file);
+        init_disk(&input->disk);
+        start_read_imd(input->file, &input->disk);
+        input->track = NULL;
+        next_merge_track(input);
+    }
+
+    disk_t merged;
+    init_disk(&merged);
+    merged.comment_len = inputs[0].disk.comment_len;
+    merged.comment = malloc(merged.comment_len + 1);
+    if (merged.comment == NULL) {
+        die("malloc failed");
+    }
+    memcpy(merged.comment, inputs[0].disk.comment, merged.comment_len + 1);
+
+    FILE *image = fopen(merge_filename, "wb");
+    if (image == NULL) {
+        die_errno("cannot open %s", merge_filename);
+    }
+    const bool compress = is_imz_filename(merge_filename);
+    imz_writer_t imz;
+    if (compress) {
+        start_imz(image, &imz);
+        write_imz_header(&merged, &imz);
+    } else {
+        write_imd_header(&merged, image);
+    }
+    buffer_t track_buf;
+    init_buffer(&track_buf);
+
+    merge_stats_t stats = {0, 0, 0, 0, 0};
+    while (true) {
+        // Find the earliest track that any of the inputs has next.
+        int key = -1;
+        for (int i = 0; i < args.num_images; i++) {
+            const track_t *track = inputs[i].track;
+            if (track != NULL && (key == -1 || track_key(track) < key)) {
+                key = track_key(track);
+            }
+        }
+        if (key == -1) break;
+
+        track_t *tracks[args.num_images];
+        const char *names[args.num_images];
+        int num_tracks = 0;
+        for (int i = 0; i < args.num_images; i++) {
+            track_t *track = inputs[i].track;
+            if (track != NULL && track_key(track) == key) {
+                names[num_tracks] = inputs[i].filename;
+                tracks[num_tracks++] = track;
+            }
+        }
+
+        track_t *track = disk_track(&merged, key / MAX_HEADS, key % MAX_HEADS);
+        merge_tracks(tracks, names, num_tracks, track, &stats);
+        encode_imd_track(track, &track_buf);
+        if (compress) {
+            write_imz_track(track_buf.data, track_buf.len, &imz);
+        } else if (fwrite(track_buf.data, 1, track_buf.len, image)
+                   != track_buf.len) {
+            die_errno("cannot write %s", merge_filename);
+        }
+        free_track(track);
+
+        for (int i = 0; i < args.num_images; i++) {
+            if (inputs[i].track != NULL && track_key(inputs[i].track) == key) {
+                next_merge_track(&inputs[i]);
+            }
+        }
+    }
+
+    free_buffer(&track_buf);
+    if (compress) {
+        finish_imz(&imz);
+    }
+    if (fclose(image) != 0) {
+        die_errno("cannot write %s", merge_filename);
+    }
+    free_disk(&merged);
+    for (int i = 0; i < args.num_images; i++) {
+        fclose(inputs[i].file);
+        free_disk(&inputs[i].disk);
+    }
+
+    fprintf(out, "Merged %d images: %d good sectors, %d bad (%d voted), "
+                 "%d missing",
+            args.num_images, stats.good, stats.bad, stats.voted,
+            stats.missing);
+    if (stats.dropped > 0) {
+        fprintf(out, "; %d mismatched track copies ignored", stats.dropped);
+    }
+    fprintf(out, "\n");
 }
 
 static void usage(void) {
-    fprintf(stderr, "usage: imdcat [OPTION]... IMAGE-FILE\n");
+    fprintf(stderr, "usage: imdcat [OPTION]... IMAGE-FILE...\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "  -n         write comment to stdout\n");
-    fprintf(stderr, "  -o FILE    write sector data to flat file\n");
+    fprintf(stderr, "  -o FILE    write sector data to flat file (- for stdout)\n");
+    fprintf(stderr, "  -z FILE    write image to FILE as a compressed .IMZ container\n");
+    fprintf(stderr, "  -u FILE    write image to FILE as an uncompressed .IMD file\n");
     fprintf(stderr, "  -v         describe loaded image (default action)\n");
     fprintf(stderr, "  -x         show hexdump of data in image\n");
+    fprintf(stderr, "  -I         identify the disk's format, as shell assignments\n");
+    fprintf(stderr, "             (with -n, the comment is included as one too)\n");
+    fprintf(stderr, "  -V         check image against the track hashes in IMAGE-FILE.hashes\n");
+    fprintf(stderr, "  -W         write track hashes to IMAGE-FILE.hashes\n");
+    fprintf(stderr, "  -m FILE    merge several dumps of the same disk into FILE,\n");
+    fprintf(stderr, "             taking the best copy of each sector\n");
+    fprintf(stderr, "             (compressed if FILE ends in .imz)\n");
+    fprintf(stderr, "  -r DIR     read reference files (made by imdstore) using the\n");
+    fprintf(stderr, "             sector store DIR\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options for use with multiple images:\n");
+    fprintf(stderr, "  -l FILE    read image filenames from FILE, one per line\n");
+    fprintf(stderr, "  -j NUM     process NUM images at once (default: CPU count)\n");
+    fprintf(stderr, "  (With -o, -z or -u, %%s in FILE is replaced by the image's name without\n");
+    fprintf(stderr, "  its directory or extension, and must give each image a different name.\n");
+    fprintf(stderr, "  If an image can't be read, the others are still processed, and the\n");
+    fprintf(stderr, "  exit status is 1.)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Options for use with -o:\n");
     fprintf(stderr, "  -p         ignore duplicated input sectors\n");
@@ -233,10 +730,12 @@ static void usage(void) {
     fprintf(stderr, "  -C RANGE   output cylinders (default autodetect)\n");
     fprintf(stderr, "  -H RANGE   output heads (default autodetect)\n");
     fprintf(stderr, "  -S RANGE   output sectors (default autodetect)\n");
+    fprintf(stderr, "  (If -C, -H and -S are all given, the image is converted a track\n");
+    fprintf(stderr, "  at a time, and IMAGE-FILE can be - to read from stdin. Then every\n");
+    fprintf(stderr, "  sector must be in the output ranges, with tracks in order.)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Ranges are in the form FIRST:LAST, FIRST:, :LAST or "
                     "ONLY, inclusive.\n");
-    // FIXME: multiple input files, to be merged
     // FIXME: sort flat file by LH, LC, LS (default: LC, LH, LS)
     // FIXME: make the input limit options work with -x, etc.
     exit(1);
@@ -278,12 +777,534 @@ static void parse_range(const char *in, range *out) {
     out->end = value + 1;
 }
 
+static void add_image(const char *filename) {
+    args.image_filenames = realloc(args.image_filenames,
+                                   (args.num_images + 1)
+                                   * sizeof *args.image_filenames);
+    if (args.image_filenames == NULL) {
+        die("realloc failed");
+    }
+    args.image_filenames[args.num_images++] = filename;
+}
+
+// Read a list of filenames, one per line, into the list of images. The
+// names are malloc-d.
+static void read_image_list(const char *list_filename) {
+    FILE *f = stdin;
+    if (strcmp(list_filename, "-") != 0) {
+        f = fopen(list_filename, "r");
+        if (f == NULL) {
+            die_errno("cannot open %s", list_filename);
+        }
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, f)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) continue;
+
+        char *filename = strdup(line);
+        if (filename == NULL) {
+            die("strdup failed");
+        }
+        add_image(filename);
+    }
+    free(line);
+
+    if (f != stdin) {
+        fclose(f);
+    }
+}
+
+// Free the list of images, including the names from first_listed on, which
+// came from read_image_list.
+static void free_image_list(int first_listed) {
+    for (int i = first_listed; i < args.num_images; i++) {
+        free((char *) args.image_filenames[i]);
+    }
+    free(args.image_filenames);
+    args.image_filenames = NULL;
+    args.num_images = 0;
+}
+
+// Open a flat file for writing, with "-" meaning stdout. A file is written
+// under a temporary name, and close_flat moves it into place, so a failed
+// conversion doesn't leave part of a flat file behind.
+static FILE *open_flat(const char *flat_filename, char **temp_filename) {
+    *temp_filename = NULL;
+    if (strcmp(flat_filename, "-") == 0) return stdout;
+
+    return create_temp_file(flat_filename, temp_filename);
+}
+
+static void close_flat(FILE *f, char *temp_filename,
+                       const char *flat_filename) {
+    if (f != stdout) {
+        replace_with_temp_file(f, temp_filename, flat_filename);
+    } else if (fflush(f) != 0) {
+        die_errno("cannot write flat file");
+    }
+}
+
+// Throw away a flat file that's only been partly written.
+static void discard_flat(FILE *f, char *temp_filename) {
+    fclose(f);
+    unlink(temp_filename);
+    free(temp_filename);
+}
+
+// Convert one image to a flat file, a track at a time. If the image is a
+// file that can be read again, return false if its tracks don't fit the
+// output layout, so the caller can convert it by loading it instead.
+static bool process_image_stream(const char *image_filename) {
+    FILE *image = stdin;
+    if (strcmp(image_filename, "-") != 0) {
+        image = fopen(image_filename, "rb");
+        if (image == NULL) {
+            die_errno("cannot open %s", image_filename);
+        }
+    }
+    struct stat st;
+    if (fstat(fileno(image), &st) < 0) {
+        die_errno("cannot stat %s", image_filename);
+    }
+    const bool can_reload = S_ISREG(st.st_mode) && image != stdin;
+
+    // Output to stdout can't be taken back, so load the image if we might
+    // need to.
+    if (can_reload && strcmp(args.flat_filename, "-") == 0) {
+        fclose(image);
+        return false;
+    }
+
+    image = open_imz_stream(image);
+    char *flat_filename = make_output_filename(args.flat_filename,
+                                               image_filename);
+    if (flat_filename == NULL) {
+        die("out of memory");
+    }
+
+    char *temp_filename;
+    FILE *f = open_flat(flat_filename, &temp_filename);
+    char *problem = NULL;
+    const bool ok = stream_flat(image, f, &problem);
+    if (ok) {
+        close_flat(f, temp_filename, flat_filename);
+    } else {
+        if (f != stdout) {
+            discard_flat(f, temp_filename);
+        }
+        if (!can_reload) {
+            die("%s", problem == NULL ? "out of memory" : problem);
+        }
+        free(problem);
+    }
+
+    if (image != stdin) {
+        fclose(image);
+    }
+    free(flat_filename);
+    return ok;
+}
+
+// Copy an image to a new file, compressing or decompressing it. The file's
+// contents are copied as they are, rather than being loaded and re-encoded,
+// so the .IMD image inside is exactly the same.
+static void write_copy(const char *image_filename, const char *pattern,
+                       bool compress) {
+    char *filename = make_output_filename(pattern, image_filename);
+    if (filename == NULL) {
+        die("out of memory");
+    }
+
+    FILE *in = fopen(image_filename, "rb");
+    if (in == NULL) {
+        die_errno("cannot open %s", image_filename);
+    }
+
+    // Writing to a temporary file means the output could safely replace
+    // the input, but that's almost certainly a mistake in the pattern.
+    struct stat in_st, out_st;
+    if (fstat(fileno(in), &in_st) < 0) {
+        die_errno("cannot stat %s", image_filename);
+    }
+    if (stat(filename, &out_st) == 0
+        && out_st.st_dev == in_st.st_dev && out_st.st_ino == in_st.st_ino) {
+        die("%s would be overwritten by its own copy", image_filename);
+    }
+
+    in = open_imz_stream(in);
+    char *temp_filename;
+    FILE *out = create_temp_file(filename, &temp_filename);
+
+    if (compress) {
+        compress_imd(in, out);
+    } else {
+        uint8_t buf[65536];
+        size_t count;
+        while ((count = fread(buf, 1, sizeof buf, in)) > 0) {
+            if (fwrite(buf, 1, count, out) != count) {
+                die_errno("cannot write %s", temp_filename);
+            }
+        }
+        if (ferror(in)) {
+            die_errno("cannot read %s", image_filename);
+        }
+    }
+
+    fclose(in);
+    replace_with_temp_file(out, temp_filename, filename);
+    free(filename);
+}
+
+// Check a disk against the hashes saved for its image, reporting any
+// differences. Return true if it matches.
+static bool verify_disk(const char *image_filename, const disk_t *disk,
+                        int num_threads, FILE *out) {
+    char *filename = hashes_filename(image_filename);
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        // This shouldn't stop the rest of a batch from being checked.
+        if (errno == ENOENT) {
+            fprintf(out, "FAILED: no hashes file\n");
+        } else {
+            fprintf(out, "FAILED: cannot open %s: %s\n",
+                    filename, strerror(errno));
+        }
+        free(filename);
+        return false;
+    }
+    disk_hashes_t *saved = malloc(sizeof *saved);
+    disk_hashes_t *actual = malloc(sizeof *actual);
+    if (saved == NULL || actual == NULL) {
+        die("malloc failed");
+    }
+    read_disk_hashes(f, filename, saved);
+    fclose(f);
+
+    hash_disk(disk, num_threads, actual);
+
+    int num_tracks = 0, num_bad = 0;
+    for (int cyl = 0; cyl < MAX_CYLS; cyl++) {
+        for (int head = 0; head < MAX_HEADS; head++) {
+            const bool in_saved = saved->present[cyl][head];
+            const bool in_image = actual->present[cyl][head];
+            if (!in_saved && !in_image) continue;
+
+            num_tracks++;
+            const char *problem = NULL;
+            if (!in_image) {
+                problem = "missing from image";
+            } else if (!in_saved) {
+                problem = "not in hashes file";
+            } else if (memcmp(saved->track[cyl][head],
+                              actual->track[cyl][head], SHA256_BYTES) != 0) {
+                problem = "doesn't match";
+            }
+            if (problem != NULL) {
+                fprintf(out, "Track %d.%d %s\n", cyl, head, problem);
+                num_bad++;
+            }
+        }
+    }
+    const bool disk_ok = !saved->have_disk
+                         || memcmp(saved->disk, actual->disk,
+                                   SHA256_BYTES) == 0;
+
+    if (num_bad == 0 && disk_ok) {
+        fprintf(out, "OK: %d tracks match\n", num_tracks);
+    } else {
+        if (!disk_ok) {
+            fprintf(out, "Disk hash doesn't match\n");
+        }
+        fprintf(out, "FAILED: %d of %d tracks don't match\n",
+                num_bad, num_tracks);
+    }
+
+    free(saved);
+    free(actual);
+    free(filename);
+    return num_bad == 0 && disk_ok;
+}
+
+// Save hashes of a disk alongside its image.
+static void write_disk_hashes_file(const char *image_filename,
+                                   const disk_t *disk, int num_threads) {
+    disk_hashes_t *hashes = malloc(sizeof *hashes);
+    if (hashes == NULL) {
+        die("malloc failed");
+    }
+    hash_disk(disk, num_threads, hashes);
+
+    char *filename = hashes_filename(image_filename);
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        die_errno("cannot open %s", filename);
+    }
+    write_disk_hashes(hashes, f);
+    if (fclose(f) != 0) {
+        die_errno("cannot write %s", filename);
+    }
+
+    free(filename);
+    free(hashes);
+}
+
+// Do whatever we've been asked to do to one image, writing any output to out.
+// num_threads is how many threads it can use. Return false if verifying the
+// image failed.
+static bool process_image(const char *image_filename, disk_t *disk,
+                          int num_threads, FILE *out) {
+    // Only load as much of the image as we need.
+    imd_load_t what = IMD_LOAD_DATA;
+    if (!args.show_data && args.flat_filename == NULL && !args.identify
+        && !args.verify && !args.write_hashes) {
+        what = args.verbose ? IMD_LOAD_LAYOUT : IMD_LOAD_COMMENT;
+    }
+    load_imd(image_filename, what, disk);
+
+    if (args.show_comment && !args.verbose && !args.identify) {
+        show_comment(disk, out);
+    }
+
+    if (args.verbose) {
+        show_disk(disk, args.show_data, out);
+    }
+
+    if (args.identify) {
+        show_identity(disk, args.show_comment && !args.verbose, out);
+    }
+
+    bool ok = true;
+    if (args.verify) {
+        ok = verify_disk(image_filename, disk, num_threads, out);
+    }
+
+    if (args.write_hashes) {
+        write_disk_hashes_file(image_filename, disk, num_threads);
+    }
+
+    if (args.flat_filename != NULL) {
+        char *flat_filename = make_output_filename(args.flat_filename,
+                                                   image_filename);
+        if (flat_filename == NULL) {
+            die("out of memory");
+        }
+
+        char *temp_filename;
+        FILE *f = open_flat(flat_filename, &temp_filename);
+        write_flat(disk, f);
+        close_flat(f, temp_filename, flat_filename);
+
+        free(flat_filename);
+    }
+
+    if (args.imz_filename != NULL) {
+        write_copy(image_filename, args.imz_filename, true);
+    }
+    if (args.imd_filename != NULL) {
+        write_copy(image_filename, args.imd_filename, false);
+    }
+
+    free_disk(disk);
+    return ok;
+}
+
+// The state shared between batch worker threads.
+static struct {
+    pthread_mutex_t lock;
+    int next_image; // protected by lock
+    bool all_ok; // protected by lock
+    int num_failed; // protected by lock
+} batch;
+
+// Take images from the list and process them until there are none left.
+static void *batch_worker(void *unused) {
+    // Each worker keeps its own disk, and reuses it for each image.
+    disk_t disk;
+    init_disk(&disk);
+
+    while (true) {
+        pthread_mutex_lock(&batch.lock);
+        const int i = batch.next_image++;
+        pthread_mutex_unlock(&batch.lock);
+        if (i >= args.num_images) break;
+        const char *image_filename = args.image_filenames[i];
+
+        // Collect the output so that it doesn't get interleaved with other
+        // workers' output.
+        char *text = NULL;
+        size_t text_len = 0;
+        FILE *out = open_memstream(&text, &text_len);
+        if (out == NULL) {
+            die_errno("open_memstream failed");
+        }
+        // The images are already being processed in parallel, so each one
+        // only gets one thread.
+        //
+        // If something's wrong with the image, process_image will die; catch
+        // that, so one bad image doesn't stop the rest of the batch.
+        jmp_buf jump;
+        bool ok, died;
+        die_jump = &jump;
+        if (setjmp(jump) == 0) {
+            ok = process_image(image_filename, &disk, 1, out);
+            died = false;
+        } else {
+            // Throw away whatever it had loaded.
+            free_disk(&disk);
+            died = true;
+            ok = false;
+        }
+        die_jump = NULL;
+        fclose(out);
+
+        flockfile(stdout);
+        if (text_len > 0) {
+            printf("%s:\n", image_filename);
+            fwrite(text, 1, text_len, stdout);
+        }
+        funlockfile(stdout);
+        free(text);
+
+        if (died) {
+            fprintf(stderr, "%s: %s\n", image_filename,
+                    die_message == NULL ? "out of memory" : die_message);
+            free(die_message);
+            die_message = NULL;
+        }
+
+        if (!ok) {
+            pthread_mutex_lock(&batch.lock);
+            batch.all_ok = false;
+            if (died) {
+                batch.num_failed++;
+            }
+            pthread_mutex_unlock(&batch.lock);
+        }
+    }
+
+    free_disk(&disk);
+    return NULL;
+}
+
+// A file that a batch will write, and the image it's written from.
+typedef struct {
+    char *filename;
+    const char *image_filename;
+} batch_output_t;
+
+static int compare_batch_outputs(const void *a, const void *b) {
+    return strcmp(((const batch_output_t *) a)->filename,
+                  ((const batch_output_t *) b)->filename);
+}
+
+// Die if two images in a batch would be written to the same file. %s in an
+// output filename doesn't include the directory, so this happens if there
+// are images with the same name in different directories.
+static void check_batch_outputs(void) {
+    const char *patterns[] = {
+        args.flat_filename, args.imz_filename, args.imd_filename,
+    };
+    const int num_patterns = sizeof patterns / sizeof *patterns;
+
+    batch_output_t *outputs = malloc((size_t) args.num_images
+                                     * (num_patterns + 1) * sizeof *outputs);
+    if (outputs == NULL) {
+        die("malloc failed");
+    }
+    size_t num_outputs = 0;
+    for (int i = 0; i < args.num_images; i++) {
+        const char *image_filename = args.image_filenames[i];
+        for (int j = 0; j < num_patterns; j++) {
+            if (patterns[j] == NULL) continue;
+
+            batch_output_t *output = &outputs[num_outputs++];
+            output->filename = make_output_filename(patterns[j],
+                                                    image_filename);
+            if (output->filename == NULL) {
+                die("out of memory");
+            }
+            output->image_filename = image_filename;
+        }
+        if (args.write_hashes) {
+            batch_output_t *output = &outputs[num_outputs++];
+            output->filename = hashes_filename(image_filename);
+            output->image_filename = image_filename;
+        }
+    }
+
+    qsort(outputs, num_outputs, sizeof *outputs, compare_batch_outputs);
+    for (size_t i = 1; i < num_outputs; i++) {
+        if (strcmp(outputs[i - 1].filename, outputs[i].filename) == 0) {
+            die("%s and %s would both be written to %s",
+                outputs[i - 1].image_filename, outputs[i].image_filename,
+                outputs[i].filename);
+        }
+    }
+
+    for (size_t i = 0; i < num_outputs; i++) {
+        free(outputs[i].filename);
+    }
+    free(outputs);
+}
+
+// Return false if any image couldn't be processed, or failed verification.
+static bool process_batch(void) {
+    check_batch_outputs();
+
+    int num_jobs = args.num_jobs;
+    if (num_jobs > args.num_images) {
+        num_jobs = args.num_images;
+    }
+
+    pthread_mutex_init(&batch.lock, NULL);
+    batch.next_image = 0;
+    batch.all_ok = true;
+    batch.num_failed = 0;
+
+    pthread_t threads[num_jobs];
+    for (int i = 0; i < num_jobs; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, NULL) != 0) {
+            die("pthread_create failed");
+        }
+    }
+    for (int i = 0; i < num_jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&batch.lock);
+    if (batch.num_failed > 0) {
+        fprintf(stderr, "%d of %d images couldn't be processed\n",
+                batch.num_failed, args.num_images);
+    }
+    return batch.all_ok;
+}
+
 int main(int argc, char **argv) {
+    const char *list_filename = NULL;
+    args.image_filenames = NULL;
+    args.num_images = 0;
+    args.num_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (args.num_jobs < 1) {
+        args.num_jobs = 1;
+    }
     args.show_comment = false;
     args.flat_filename = NULL;
+    args.imz_filename = NULL;
+    args.imd_filename = NULL;
     args.verbose = false;
     args.show_data = false;
+    args.identify = false;
+    args.verify = false;
+    args.write_hashes = false;
     args.permissive = false;
+    args.merge_filename = NULL;
+    args.store_dir = NULL;
     args.in_cyls.start = 0;
     args.in_cyls.end = MAX_CYLS;
     args.in_heads.start = 0;
@@ -295,7 +1316,7 @@ int main(int argc, char **argv) {
     args.out_sectors.start = args.out_sectors.end = -1;
 
     while (true) {
-        int opt = getopt(argc, argv, "no:vxpc:h:s:C:H:S:");
+        int opt = getopt(argc, argv, "no:z:u:vxIVWm:r:l:j:pc:h:s:C:H:S:");
         if (opt == -1) break;
 
         switch (opt) {
@@ -305,12 +1326,42 @@ int main(int argc, char **argv) {
         case 'o':
             args.flat_filename = optarg;
             break;
+        case 'z':
+            args.imz_filename = optarg;
+            break;
+        case 'u':
+            args.imd_filename = optarg;
+            break;
         case 'v':
             args.verbose = true;
             break;
         case 'x':
             args.show_data = true;
             break;
+        case 'I':
+            args.identify = true;
+            break;
+        case 'V':
+            args.verify = true;
+            break;
+        case 'W':
+            args.write_hashes = true;
+            break;
+        case 'm':
+            args.merge_filename = optarg;
+            break;
+        case 'r':
+            args.store_dir = optarg;
+            break;
+        case 'l':
+            list_filename = optarg;
+            break;
+        case 'j':
+            args.num_jobs = atoi(optarg);
+            if (args.num_jobs < 1) {
+                usage();
+            }
+            break;
 
         case 'p':
             args.permissive = true;
@@ -339,42 +1390,79 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (optind + 1 != argc) {
-        usage();
+    for (int i = optind; i < argc; i++) {
+        add_image(argv[i]);
     }
-    args.image_filename = argv[optind];
-    if (!args.show_comment && args.flat_filename == NULL) {
-        args.verbose = true;
+    const int first_listed = args.num_images;
+    if (list_filename != NULL) {
+        read_image_list(list_filename);
     }
-    if (args.show_data) {
-        args.verbose = true;
+    if (args.num_images == 0) {
+        usage();
     }
 
-    disk_t disk;
-    init_disk(&disk);
-
-    FILE *f = fopen(args.image_filename, "rb");
-    if (f == NULL) {
-        die_errno("cannot open %s", args.image_filename);
+    sector_store_t store;
+    if (args.store_dir != NULL) {
+        open_sector_store(args.store_dir, &store);
+        set_imd_ref_store(&store);
     }
-    read_imd(f, &disk);
-    fclose(f);
 
-    if (args.show_comment && !args.verbose) {
-        show_comment(&disk, stdout);
+    if (args.merge_filename != NULL) {
+        merge_images(args.merge_filename, stdout);
+        free_image_list(first_listed);
+        return 0;
     }
 
-    if (args.verbose) {
-        show_disk(&disk, args.show_data, stdout);
+    if (!args.show_comment && args.flat_filename == NULL && !args.identify
+        && !args.verify && !args.write_hashes && args.imz_filename == NULL
+        && args.imd_filename == NULL) {
+        args.verbose = true;
+    }
+    if (args.show_data) {
+        args.verbose = true;
     }
 
-    if (args.flat_filename != NULL) {
-        f = fopen(args.flat_filename, "wb");
-        write_flat(&disk, f);
-        fclose(f);
+    // If we're only converting one image to a flat file, and we know the
+    // layout already, there's no need to load the whole image -- unless it
+    // turns out not to fit the layout. Reading from stdin needs this.
+    const bool stream = args.num_images == 1 && list_filename == NULL
+                        && args.flat_filename != NULL && !args.verbose
+                        && !args.show_comment && !args.identify
+                        && !args.verify && !args.write_hashes
+                        && args.imz_filename == NULL
+                        && args.imd_filename == NULL
+                        && args.store_dir == NULL
+                        && have_output_ranges();
+    for (int i = 0; i < args.num_images; i++) {
+        if (strcmp(args.image_filenames[i], "-") == 0 && !stream) {
+            die("Reading an image from stdin needs -o with -C, -H and -S");
+        }
     }
 
-    free_disk(&disk);
+    bool ok = true;
+    if (stream && process_image_stream(args.image_filenames[0])) {
+        // Done.
+    } else if (args.num_images == 1 && list_filename == NULL) {
+        disk_t disk;
+        init_disk(&disk);
+        ok = process_image(args.image_filenames[0], &disk, args.num_jobs,
+                           stdout);
+    } else {
+        if (args.flat_filename != NULL
+            && strstr(args.flat_filename, "%s") == NULL) {
+            die("-o FILE must contain %%s when processing multiple images");
+        }
+        if (args.imz_filename != NULL
+            && strstr(args.imz_filename, "%s") == NULL) {
+            die("-z FILE must contain %%s when processing multiple images");
+        }
+        if (args.imd_filename != NULL
+            && strstr(args.imd_filename, "%s") == NULL) {
+            die("-u FILE must contain %%s when processing multiple images");
+        }
+        ok = process_batch();
+    }
 
-    return 0;
+    free_image_list(first_listed);
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,238 @@
+/*
+    imdindex.c: random access to sectors in .IMD files
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "disk.h"
+#include "imd.h"
+#include "imdindex.h"
+#include "imz.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int cmp_entry(const void *left_v, const void *right_v) {
+    const imd_index_entry_t *left = left_v;
+    const imd_index_entry_t *right = right_v;
+
+    int d = left->log_cyl - right->log_cyl;
+    if (d != 0) return d;
+    d = left->log_head - right->log_head;
+    if (d != 0) return d;
+    d = left->log_sector - right->log_sector;
+    if (d != 0) return d;
+
+    // Keep sectors with the same address in file order.
+    if (left->offset < right->offset) return -1;
+    if (left->offset > right->offset) return 1;
+    return 0;
+}
+
+void open_imd_index(const char *filename, imd_index_t *index) {
+    // Loading just the layout records where each sector is, without
+    // touching the sector data.
+    disk_t disk;
+    init_disk(&disk);
+    load_imd(filename, IMD_LOAD_LAYOUT, &disk);
+    if (disk.mapped == NULL) {
+        die("%s is not a regular file", filename);
+    }
+
+    index->comment = disk.comment;
+    index->comment_len = disk.comment_len;
+    disk.comment = NULL;
+
+    int num_sectors = 0;
+    for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < disk.num_phys_heads; head++) {
+            num_sectors += disk_find_track(&disk, cyl, head)->num_sectors;
+        }
+    }
+
+    index->entries = malloc((num_sectors + 1) * sizeof *index->entries);
+    if (index->entries == NULL) {
+        die("malloc failed");
+    }
+
+    int n = 0;
+    const uint8_t *image = disk.mapped;
+    for (int cyl = 0; cyl < disk.num_phys_cyls; cyl++) {
+        for (int head = 0; head < disk.num_phys_heads; head++) {
+            const track_t *track = disk_find_track(&disk, cyl, head);
+
+            for (int i = 0; i < track->num_sectors; i++) {
+                const sector_t *sector = &track->sectors[i];
+                imd_index_entry_t *entry = &index->entries[n++];
+
+                entry->log_cyl = sector->log_cyl;
+                entry->log_head = sector->log_head;
+                entry->log_sector = sector->log_sector;
+                entry->phys_cyl = cyl;
+                entry->phys_head = head;
+                entry->sector_size_code = track->sector_size_code;
+                entry->status = sector->status;
+                entry->deleted = sector->deleted;
+                entry->offset = sector->data_offset;
+
+                // Even SDR types (other than 0, unavailable) are compressed.
+                const uint8_t type = image[sector->data_offset];
+                entry->compressed = type != 0 && (type % 2) == 0;
+            }
+        }
+    }
+    free_disk(&disk);
+
+    // Sort by address, and drop duplicates.
+    qsort(index->entries, n, sizeof *index->entries, cmp_entry);
+    index->num_entries = 0;
+    for (int i = 0; i < n; i++) {
+        const imd_index_entry_t *entry = &index->entries[i];
+        if (index->num_entries > 0) {
+            const imd_index_entry_t *last
+                = &index->entries[index->num_entries - 1];
+            if (last->log_cyl == entry->log_cyl
+                && last->log_head == entry->log_head
+                && last->log_sector == entry->log_sector) {
+                continue;
+            }
+        }
+        index->entries[index->num_entries++] = *entry;
+    }
+
+    index->fd = open(filename, O_RDONLY);
+    if (index->fd == -1) {
+        die_errno("cannot open %s", filename);
+    }
+
+    index->imz = NULL;
+    uint8_t magic[IMZ_MAGIC_LEN];
+    if (pread(index->fd, magic, IMZ_MAGIC_LEN, 0) == IMZ_MAGIC_LEN
+        && is_imz(magic, IMZ_MAGIC_LEN)) {
+        index->imz = malloc(sizeof *index->imz);
+        if (index->imz == NULL) {
+            die("malloc failed");
+        }
+        open_imz_reader(index->fd, index->imz);
+    }
+}
+
+void close_imd_index(imd_index_t *index) {
+    if (index->imz != NULL) {
+        // This closes the fd too.
+        close_imz_reader(index->imz);
+        free(index->imz);
+        index->imz = NULL;
+    } else {
+        close(index->fd);
+    }
+    index->fd = -1;
+    free(index->comment);
+    index->comment = NULL;
+    free(index->entries);
+    index->entries = NULL;
+    index->num_entries = 0;
+}
+
+const imd_index_entry_t *find_imd_sector(const imd_index_t *index,
+                                         int log_cyl, int log_head,
+                                         int log_sector) {
+    int low = 0;
+    int high = index->num_entries;
+    while (low < high) {
+        const int mid = (low + high) / 2;
+        const imd_index_entry_t *entry = &index->entries[mid];
+
+        int d = entry->log_cyl - log_cyl;
+        if (d == 0) d = entry->log_head - log_head;
+        if (d == 0) d = entry->log_sector - log_sector;
+
+        if (d == 0) {
+            return entry;
+        } else if (d < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+// Read exactly len bytes from the image at offset.
+static void pread_all(const imd_index_t *index, long offset,
+                      uint8_t *buf, size_t len) {
+    if (index->imz != NULL) {
+        read_imz_bytes(index->imz, offset, buf, len);
+        return;
+    }
+
+    while (len > 0) {
+        ssize_t count = pread(index->fd, buf, len, offset);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) {
+            die_errno("cannot read IMD sector data");
+        }
+        if (count == 0) {
+            die("Couldn't read IMD sector data");
+        }
+        buf += count;
+        len -= count;
+        offset += count;
+    }
+}
+
+bool read_imd_sector(const imd_index_t *index, const imd_index_entry_t *entry,
+                     uint8_t *buf) {
+    if (entry->status == SECTOR_MISSING) return false;
+
+    // Skip over the SDR type byte.
+    const int size = sector_bytes(entry->sector_size_code);
+    if (entry->compressed) {
+        uint8_t fill;
+        pread_all(index, entry->offset + 1, &fill, 1);
+        memset(buf, fill, size);
+    } else {
+        pread_all(index, entry->offset + 1, buf, size);
+    }
+    return true;
+}
+
+int read_imd_sectors(const imd_index_t *index, int log_cyl, int log_head,
+                     int first_sector, int count, int sector_size,
+                     uint8_t *buf) {
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        uint8_t *sector_buf = buf + (size_t) i * sector_size;
+        const imd_index_entry_t *entry
+            = find_imd_sector(index, log_cyl, log_head, first_sector + i);
+
+        if (entry != NULL
+            && sector_bytes(entry->sector_size_code) == sector_size
+            && read_imd_sector(index, entry, sector_buf)) {
+            found++;
+        } else {
+            memset(sector_buf, 0xFF, sector_size);
+        }
+    }
+    return found;
+}
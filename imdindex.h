@@ -0,0 +1,90 @@
+/*
+    imdindex.h: random access to sectors in .IMD files
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    An index lets a program read individual sectors from an image by their
+    logical address, without loading the rest of the image. Opening the
+    index scans the image's headers once; each sector read after that is a
+    single pread from the file.
+
+    The image can also be an .IMZ container. In that case, reading a sector
+    decompresses the track it's in (unless that was the last track used),
+    so an index for an .IMZ image mustn't be shared between threads.
+
+    As with the rest of the IMD code, a malformed image is a fatal error.
+*/
+
+#ifndef IMDINDEX_H
+#define IMDINDEX_H
+
+#include "disk.h"
+#include "imz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    uint8_t log_cyl;
+    uint8_t log_head;
+    uint8_t log_sector;
+    uint8_t phys_cyl;
+    uint8_t phys_head;
+    uint8_t sector_size_code;
+    sector_status_t status;
+    bool deleted;
+    bool compressed; // if so, the data is a single fill byte
+    long offset; // of the Sector Data Record in the (uncompressed) image
+} imd_index_entry_t;
+
+typedef struct {
+    int fd;
+    imz_reader_t *imz; // NULL unless the image is compressed
+    char *comment;
+    int comment_len;
+    // Sorted by logical cyl, head, sector. If the image has several sectors
+    // with the same address, only the first is included.
+    imd_index_entry_t *entries;
+    int num_entries;
+} imd_index_t;
+
+// Open an image (which must be a regular file) and index its sectors.
+void open_imd_index(const char *filename, imd_index_t *index);
+void close_imd_index(imd_index_t *index);
+
+// Find a sector by logical address. Returns NULL if it's not in the image.
+const imd_index_entry_t *find_imd_sector(const imd_index_t *index,
+                                         int log_cyl, int log_head,
+                                         int log_sector);
+
+// Read a sector's data into buf, which must have room for
+// sector_bytes(entry->sector_size_code) bytes.
+// Returns false (leaving buf alone) if the image has no data for it.
+bool read_imd_sector(const imd_index_t *index, const imd_index_entry_t *entry,
+                     uint8_t *buf);
+
+// Read count consecutive sectors of size sector_size from a logical track,
+// starting at first_sector, into buf. Sectors the image doesn't have (or of
+// a different size) are filled with 0xFF, as in a flat image.
+// Returns the number of sectors that were found.
+int read_imd_sectors(const imd_index_t *index, int log_cyl, int log_head,
+                     int first_sector, int count, int sector_size,
+                     uint8_t *buf);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+    imdstore: archive .IMD files into a shared sector store
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    Archiving many images of similar disks into the same store means that
+    each distinct sector's data is only kept once -- so copies of the same
+    software, and the filler sectors common to most disks, take up almost no
+    extra space. See sectorstore.h for how this works.
+*/
+
+#include "imz.h"
+#include "sectorstore.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct args {
+    const char *store_dir;
+    bool export;
+    const char *out_filename;
+    bool verbose;
+} args;
+
+static void usage(void) {
+    fprintf(stderr, "usage: imdstore -s DIR [OPTION]... FILE...\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Archive each FILE (an .IMD or .IMZ image) into the sector store DIR,\n");
+    fprintf(stderr, "writing a reference file for it; or with -x, rebuild an .IMD image from\n");
+    fprintf(stderr, "each FILE.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -s DIR     sector store directory (created if necessary)\n");
+    fprintf(stderr, "  -x         export images from reference files\n");
+    fprintf(stderr, "  -o FILE    write output to FILE, replacing %%s in FILE with the input\n");
+    fprintf(stderr, "             filename without its extension (default %%s.imdr, or\n");
+    fprintf(stderr, "             %%s.imd with -x, which must not exist already)\n");
+    fprintf(stderr, "  -v         show how much space the store saved\n");
+    exit(1);
+}
+
+static void process_file(const char *in_filename, sector_store_t *store) {
+    const char *pattern = args.out_filename;
+    if (pattern == NULL) {
+        pattern = args.export ? "%s.imd" : "%s.imdr";
+    }
+    char *out_filename = make_output_filename(pattern, in_filename);
+    if (out_filename == NULL) {
+        die("out of memory");
+    }
+    if (strcmp(out_filename, in_filename) == 0) {
+        die("%s would be overwritten", in_filename);
+    }
+    // The default name for an exported image is probably the name of the
+    // image that was archived, which may still be there.
+    if (args.export && args.out_filename == NULL
+        && access(out_filename, F_OK) == 0) {
+        die("%s already exists (use -o to choose a different name)",
+            out_filename);
+    }
+
+    FILE *in = fopen(in_filename, "rb");
+    if (in == NULL) {
+        die_errno("cannot open %s", in_filename);
+    }
+    // Write to a temporary file, so that nothing's replaced if this fails
+    // (e.g. because an object's missing from the store).
+    char *temp_filename;
+    FILE *out = create_temp_file(out_filename, &temp_filename);
+
+    if (args.export) {
+        export_imd(in, out, store);
+    } else {
+        in = open_imz_stream(in);
+        archive_imd(in, out, store);
+    }
+
+    fclose(in);
+    replace_with_temp_file(out, temp_filename, out_filename);
+    free(out_filename);
+}
+
+int main(int argc, char **argv) {
+    args.store_dir = NULL;
+    args.export = false;
+    args.out_filename = NULL;
+    args.verbose = false;
+
+    while (true) {
+        int opt = getopt(argc, argv, "s:xo:v");
+        if (opt == -1) break;
+
+        switch (opt) {
+        case 's':
+            args.store_dir = optarg;
+            break;
+        case 'x':
+            args.export = true;
+            break;
+        case 'o':
+            args.out_filename = optarg;
+            break;
+        case 'v':
+            args.verbose = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (args.store_dir == NULL || optind == argc) {
+        usage();
+    }
+    if (args.out_filename != NULL && argc - optind > 1
+        && strstr(args.out_filename, "%s") == NULL) {
+        die("-o FILE must contain %%s when processing multiple files");
+    }
+
+    sector_store_t store;
+    open_sector_store(args.store_dir, &store);
+
+    for (int i = optind; i < argc; i++) {
+        process_file(argv[i], &store);
+    }
+
+    if (args.verbose && !args.export) {
+        printf("Archived %ld sectors (%ld bytes), of which %ld (%ld bytes) "
+               "were new\n",
+               store.sectors, store.bytes, store.new_sectors, store.new_bytes);
+    }
+
+    return 0;
+}
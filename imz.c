@@ -0,0 +1,552 @@
+/*
+    imz.c: compressed containers for .IMD images
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+// For fopencookie and MAP_ANONYMOUS.
+#define _GNU_SOURCE
+
+#include "imz.h"
+#include "disk.h"
+#include "imd.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define IMZ_HEADER_LEN 12
+#define IMZ_ENTRY_LEN (IMZ_HEADER_LEN + 8)
+#define IMZ_TRAILER_LEN 16
+
+static void put_le32(uint8_t *p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static void put_le64(uint8_t *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static void encode_block_header(const imz_block_t *block, uint8_t *p) {
+    put_le32(p, block->raw_len);
+    put_le32(p + 4, block->packed_len);
+    p[8] = block->kind;
+    p[9] = block->phys_cyl;
+    p[10] = block->phys_head;
+    p[11] = block->flags;
+}
+
+static void decode_block_header(const uint8_t *p, imz_block_t *block) {
+    block->raw_len = get_le32(p);
+    block->packed_len = get_le32(p + 4);
+    block->kind = p[8];
+    block->phys_cyl = p[9];
+    block->phys_head = p[10];
+    block->flags = p[11];
+    if (block->kind > IMZ_TRACK) {
+        die("IMZ block has unknown kind: %d", block->kind);
+    }
+    if ((block->flags & ~IMZ_STORED) != 0) {
+        die("IMZ block has unsupported flags: %02x", block->flags);
+    }
+    if ((block->flags & IMZ_STORED) != 0
+        && block->packed_len != block->raw_len) {
+        die("IMZ stored block is the wrong size");
+    }
+}
+
+// Decompress a block's data, checking that it's the right length.
+static void inflate_block(const imz_block_t *block, const uint8_t *packed,
+                          uint8_t *raw) {
+    if (block->flags & IMZ_STORED) {
+        memcpy(raw, packed, block->raw_len);
+        return;
+    }
+
+    uLongf raw_len = block->raw_len;
+    if (uncompress(raw, &raw_len, packed, block->packed_len) != Z_OK
+        || raw_len != block->raw_len) {
+        die("IMZ block is corrupt");
+    }
+}
+
+bool is_imz(const void *data, size_t len) {
+    return len >= IMZ_MAGIC_LEN && memcmp(data, IMZ_MAGIC, IMZ_MAGIC_LEN) == 0;
+}
+
+bool is_imz_filename(const char *filename) {
+    const size_t len = strlen(filename);
+    return len >= 4 && strcasecmp(filename + len - 4, ".imz") == 0;
+}
+
+// The state of a stream returned by open_imz_stream.
+typedef struct {
+    FILE *in;
+    bool at_end;
+    buffer_t raw; // the current block
+    size_t pos; // how much of raw has been read
+    buffer_t packed;
+} imz_stream_t;
+
+static void read_stream_bytes(imz_stream_t *stream, uint8_t *buf, size_t len,
+                              const char *what) {
+    if (fread(buf, 1, len, stream->in) != len) {
+        die("Couldn't read IMZ %s", what);
+    }
+}
+
+static ssize_t read_imz_stream(void *cookie, char *buf, size_t size) {
+    imz_stream_t *stream = cookie;
+
+    while (stream->pos == stream->raw.len) {
+        // Get the next block.
+        if (stream->at_end) return 0;
+
+        // If writing the file was interrupted, it may end after a
+        // block without an end header.
+        uint8_t header[IMZ_HEADER_LEN];
+        const size_t count = fread(header, 1, IMZ_HEADER_LEN, stream->in);
+        if (count == 0 && feof(stream->in)) {
+            stream->at_end = true;
+            return 0;
+        }
+        if (count != IMZ_HEADER_LEN) {
+            die("Couldn't read IMZ block header");
+        }
+        imz_block_t block;
+        decode_block_header(header, &block);
+        if (block.kind == IMZ_END) {
+            // Ignore the index.
+            stream->at_end = true;
+            return 0;
+        }
+
+        stream->packed.len = 0;
+        buffer_reserve(&stream->packed, block.packed_len);
+        read_stream_bytes(stream, stream->packed.data, block.packed_len,
+                          "block");
+
+        stream->raw.len = 0;
+        inflate_block(&block, stream->packed.data,
+                      buffer_reserve(&stream->raw, block.raw_len));
+        stream->raw.len = block.raw_len;
+        stream->pos = 0;
+    }
+
+    size_t count = stream->raw.len - stream->pos;
+    if (count > size) {
+        count = size;
+    }
+    memcpy(buf, stream->raw.data + stream->pos, count);
+    stream->pos += count;
+    return count;
+}
+
+static int close_imz_stream(void *cookie) {
+    imz_stream_t *stream = cookie;
+    const int rc = fclose(stream->in);
+    free_buffer(&stream->raw);
+    free_buffer(&stream->packed);
+    free(stream);
+    return rc;
+}
+
+FILE *open_imz_stream(FILE *image) {
+    // Peek at the first byte, so it's still there for read_imd if this
+    // isn't an .IMZ file.
+    const int c = getc(image);
+    if (c == EOF) {
+        return image;
+    }
+    ungetc(c, image);
+    if (c != (uint8_t) IMZ_MAGIC[0]) {
+        return image;
+    }
+
+    uint8_t magic[IMZ_MAGIC_LEN];
+    if (fread(magic, 1, IMZ_MAGIC_LEN, image) != IMZ_MAGIC_LEN
+        || !is_imz(magic, IMZ_MAGIC_LEN)) {
+        die("Not an IMD or IMZ image");
+    }
+
+    imz_stream_t *stream = malloc(sizeof *stream);
+    if (stream == NULL) {
+        die("malloc failed");
+    }
+    stream->in = image;
+    stream->at_end = false;
+    init_buffer(&stream->raw);
+    stream->pos = 0;
+    init_buffer(&stream->packed);
+
+    const cookie_io_functions_t funcs = {
+        .read = read_imz_stream,
+        .write = NULL,
+        .seek = NULL,
+        .close = close_imz_stream,
+    };
+    FILE *f = fopencookie(stream, "rb", funcs);
+    if (f == NULL) {
+        die_errno("fopencookie failed");
+    }
+    return f;
+}
+
+void *inflate_imz(const uint8_t *data, size_t len, size_t *raw_len) {
+    if (!is_imz(data, len)) {
+        die("Not an IMZ image");
+    }
+
+    // Find out how big the image is, checking the blocks are all there.
+    size_t total = 0;
+    size_t pos = IMZ_MAGIC_LEN;
+    while (true) {
+        // The file may end after a block without an end header, if
+        // writing it was interrupted.
+        if (pos == len) break;
+        if (len - pos < IMZ_HEADER_LEN) {
+            die("Couldn't read IMZ block header");
+        }
+        imz_block_t block;
+        decode_block_header(data + pos, &block);
+        pos += IMZ_HEADER_LEN;
+        if (block.kind == IMZ_END) break;
+
+        if (len - pos < block.packed_len) {
+            die("Couldn't read IMZ block");
+        }
+        pos += block.packed_len;
+        total += block.raw_len;
+    }
+    if (total == 0) {
+        die("IMZ image is empty");
+    }
+
+    uint8_t *raw = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        die_errno("mmap failed");
+    }
+
+    size_t raw_pos = 0;
+    pos = IMZ_MAGIC_LEN;
+    while (pos < len) {
+        imz_block_t block;
+        decode_block_header(data + pos, &block);
+        pos += IMZ_HEADER_LEN;
+        if (block.kind == IMZ_END) break;
+
+        inflate_block(&block, data + pos, raw + raw_pos);
+        pos += block.packed_len;
+        raw_pos += block.raw_len;
+    }
+
+    *raw_len = total;
+    return raw;
+}
+
+static void write_imz_bytes(const uint8_t *data, size_t len,
+                            imz_writer_t *writer) {
+    if (fwrite(data, 1, len, writer->file) != len) {
+        die_errno("cannot write image");
+    }
+    writer->pos += len;
+}
+
+void start_imz(FILE *file, imz_writer_t *writer) {
+    writer->file = file;
+    writer->pos = 0;
+    writer->blocks = NULL;
+    writer->num_blocks = 0;
+    writer->blocks_size = 0;
+    writer->raw_pos = 0;
+    init_buffer(&writer->packed);
+
+    write_imz_bytes((const uint8_t *) IMZ_MAGIC, IMZ_MAGIC_LEN, writer);
+}
+
+// Compress data and write it as a block.
+static void write_imz_block(imz_kind_t kind, int phys_cyl, int phys_head,
+                            const uint8_t *data, size_t len,
+                            imz_writer_t *writer) {
+    if (writer->num_blocks == writer->blocks_size) {
+        writer->blocks_size = (writer->blocks_size == 0)
+                              ? 256 : (writer->blocks_size * 2);
+        writer->blocks = realloc(writer->blocks,
+                                 writer->blocks_size * sizeof *writer->blocks);
+        if (writer->blocks == NULL) {
+            die("realloc failed");
+        }
+    }
+    imz_block_t *block = &writer->blocks[writer->num_blocks++];
+
+    uLongf packed_len = compressBound(len);
+    writer->packed.len = 0;
+    uint8_t *buf = buffer_reserve(&writer->packed, packed_len);
+    if (compress2(buf, &packed_len, data, len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        die("compress2 failed");
+    }
+    const uint8_t *packed = buf;
+
+    block->flags = 0;
+    if (packed_len >= len) {
+        // It didn't get any smaller, so store it as it is.
+        packed = data;
+        packed_len = len;
+        block->flags |= IMZ_STORED;
+    }
+
+    block->offset = writer->pos;
+    block->raw_offset = writer->raw_pos;
+    block->raw_len = len;
+    block->packed_len = packed_len;
+    block->kind = kind;
+    block->phys_cyl = phys_cyl;
+    block->phys_head = phys_head;
+
+    uint8_t header[IMZ_HEADER_LEN];
+    encode_block_header(block, header);
+    write_imz_bytes(header, IMZ_HEADER_LEN, writer);
+    write_imz_bytes(packed, packed_len, writer);
+    writer->raw_pos += len;
+}
+
+void write_imz_header(const disk_t *disk, imz_writer_t *writer) {
+    const int comment_len = (disk->comment != NULL) ? disk->comment_len : 0;
+    uint8_t data[comment_len + 1];
+    if (comment_len > 0) {
+        memcpy(data, disk->comment, comment_len);
+    }
+    data[comment_len] = IMD_END_OF_COMMENT;
+    write_imz_block(IMZ_COMMENT, 0, 0, data, comment_len + 1, writer);
+}
+
+void write_imz_track(const uint8_t *record, size_t len, imz_writer_t *writer) {
+    write_imz_block(IMZ_TRACK, record[1], record[2] & IMD_HEAD_MASK,
+                    record, len, writer);
+}
+
+void finish_imz(imz_writer_t *writer) {
+    const imz_block_t end = {
+        .raw_len = 0,
+        .packed_len = 0,
+        .kind = IMZ_END,
+        .phys_cyl = 0,
+        .phys_head = 0,
+        .flags = 0,
+    };
+    uint8_t header[IMZ_HEADER_LEN];
+    encode_block_header(&end, header);
+    write_imz_bytes(header, IMZ_HEADER_LEN, writer);
+
+    const uint64_t index_offset = writer->pos;
+    for (int i = 0; i < writer->num_blocks; i++) {
+        uint8_t entry[IMZ_ENTRY_LEN];
+        encode_block_header(&writer->blocks[i], entry);
+        put_le64(entry + IMZ_HEADER_LEN, writer->blocks[i].offset);
+        write_imz_bytes(entry, IMZ_ENTRY_LEN, writer);
+    }
+
+    uint8_t trailer[IMZ_TRAILER_LEN];
+    put_le64(trailer, index_offset);
+    put_le32(trailer + 8, writer->num_blocks);
+    memcpy(trailer + 12, IMZ_INDEX_MAGIC, 4);
+    write_imz_bytes(trailer, IMZ_TRAILER_LEN, writer);
+
+    free(writer->blocks);
+    writer->blocks = NULL;
+    free_buffer(&writer->packed);
+}
+
+void compress_imd(FILE *image, FILE *imz) {
+    imz_writer_t writer;
+    start_imz(imz, &writer);
+
+    char *comment = NULL;
+    size_t size = 0;
+    const ssize_t count = getdelim(&comment, &size, IMD_END_OF_COMMENT, image);
+    if (count < 0 || comment[count - 1] != IMD_END_OF_COMMENT) {
+        die("Couldn't find IMD comment delimiter");
+    }
+    write_imz_block(IMZ_COMMENT, 0, 0, (const uint8_t *) comment, count,
+                    &writer);
+    free(comment);
+
+    buffer_t record;
+    init_buffer(&record);
+    imd_record_layout_t layout;
+    while (read_imd_record(image, 0, &record, &layout)) {
+        write_imz_track(record.data, record.len, &writer);
+    }
+    free_buffer(&record);
+
+    finish_imz(&writer);
+}
+
+// Read exactly len bytes from the file at offset.
+static void pread_imz(int fd, uint64_t offset, uint8_t *buf, size_t len,
+                      const char *what) {
+    while (len > 0) {
+        ssize_t count = pread(fd, buf, len, offset);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) {
+            die_errno("cannot read IMZ %s", what);
+        }
+        if (count == 0) {
+            die("Couldn't read IMZ %s", what);
+        }
+        buf += count;
+        len -= count;
+        offset += count;
+    }
+}
+
+void open_imz_reader(int fd, imz_reader_t *reader) {
+    reader->fd = fd;
+    reader->cached_block = -1;
+    init_buffer(&reader->cache);
+    init_buffer(&reader->packed);
+
+    const off_t file_len = lseek(fd, 0, SEEK_END);
+    if (file_len < 0) {
+        die_errno("cannot seek in IMZ image");
+    }
+    if (file_len < IMZ_MAGIC_LEN + IMZ_HEADER_LEN + IMZ_TRAILER_LEN) {
+        die("IMZ image is too short");
+    }
+
+    uint8_t trailer[IMZ_TRAILER_LEN];
+    pread_imz(fd, file_len - IMZ_TRAILER_LEN, trailer, IMZ_TRAILER_LEN,
+              "trailer");
+    if (memcmp(trailer + 12, IMZ_INDEX_MAGIC, 4) != 0) {
+        die("IMZ image has no index");
+    }
+    const uint64_t index_offset = get_le64(trailer);
+    reader->num_blocks = get_le32(trailer + 8);
+    if (index_offset > (uint64_t) file_len
+        || (file_len - IMZ_TRAILER_LEN - index_offset)
+           != (uint64_t) reader->num_blocks * IMZ_ENTRY_LEN) {
+        die("IMZ index is the wrong size");
+    }
+
+    const size_t index_len = (size_t) reader->num_blocks * IMZ_ENTRY_LEN;
+    uint8_t *index = malloc(index_len + 1);
+    reader->blocks = malloc((reader->num_blocks + 1) * sizeof *reader->blocks);
+    if (index == NULL || reader->blocks == NULL) {
+        die("malloc failed");
+    }
+    pread_imz(fd, index_offset, index, index_len, "index");
+
+    uint64_t raw_pos = 0;
+    for (int i = 0; i < reader->num_blocks; i++) {
+        imz_block_t *block = &reader->blocks[i];
+        const uint8_t *entry = index + (size_t) i * IMZ_ENTRY_LEN;
+        decode_block_header(entry, block);
+        block->offset = get_le64(entry + IMZ_HEADER_LEN);
+        block->raw_offset = raw_pos;
+        raw_pos += block->raw_len;
+
+        if (block->kind == IMZ_END
+            || block->offset + IMZ_HEADER_LEN + block->packed_len
+               > index_offset) {
+            die("IMZ index is corrupt");
+        }
+    }
+    free(index);
+}
+
+void close_imz_reader(imz_reader_t *reader) {
+    close(reader->fd);
+    reader->fd = -1;
+    free(reader->blocks);
+    reader->blocks = NULL;
+    reader->num_blocks = 0;
+    free_buffer(&reader->cache);
+    free_buffer(&reader->packed);
+}
+
+void read_imz_bytes(imz_reader_t *reader, uint64_t offset,
+                    uint8_t *buf, size_t len) {
+    // Find the last block that starts at or before offset.
+    int low = 0;
+    int high = reader->num_blocks;
+    while (high - low > 1) {
+        const int mid = (low + high) / 2;
+        if (reader->blocks[mid].raw_offset <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    const imz_block_t *block = &reader->blocks[low];
+    if (reader->num_blocks == 0 || offset < block->raw_offset
+        || offset + len > block->raw_offset + block->raw_len) {
+        die("Couldn't read IMD sector data");
+    }
+
+    if (reader->cached_block != low) {
+        reader->cached_block = -1;
+
+        // Check the block's header agrees with the index.
+        const size_t read_len = IMZ_HEADER_LEN + block->packed_len;
+        reader->packed.len = 0;
+        uint8_t *packed = buffer_reserve(&reader->packed, read_len);
+        pread_imz(reader->fd, block->offset, packed, read_len, "block");
+        imz_block_t check;
+        decode_block_header(packed, &check);
+        if (check.raw_len != block->raw_len
+            || check.packed_len != block->packed_len
+            || check.kind != block->kind) {
+            die("IMZ index doesn't match the blocks");
+        }
+
+        reader->cache.len = 0;
+        inflate_block(block, packed + IMZ_HEADER_LEN,
+                      buffer_reserve(&reader->cache, block->raw_len));
+        reader->cache.len = block->raw_len;
+        reader->cached_block = low;
+    }
+
+    memcpy(buf, reader->cache.data + (offset - block->raw_offset), len);
+}
@@ -0,0 +1,148 @@
+/*
+    imz.h: compressed containers for .IMD images
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    An .IMZ file holds an .IMD image split into blocks, each compressed
+    separately with zlib: one for the comment (including its terminator),
+    then one for each track record, in the same order as in the image.
+    Decompressing all the blocks and concatenating them gives back the
+    original .IMD file, byte for byte.
+
+    The file starts with IMZ_MAGIC. Each block has a 12-byte header --
+    uncompressed length (4 bytes), compressed length (4), kind, physical
+    cylinder, physical head and flags -- followed by the compressed data.
+    If compressing a block wouldn't make it any smaller, it's stored as it
+    is, with the IMZ_STORED flag. After the last block is an end header,
+    with kind IMZ_END and both lengths zero. So a reader can decompress the
+    image from a stream without seeking. If the file ends cleanly after a
+    block with no end header (because writing it was interrupted), readers
+    treat that as the end of the image.
+
+    Then comes an index, with an entry for each block: a copy of its header
+    followed by its offset in the file (8 bytes). The file ends with the
+    offset of the index (8 bytes), the number of entries (4) and
+    IMZ_INDEX_MAGIC. The index lets a reader load just the tracks it needs.
+
+    All numbers are little-endian.
+*/
+
+#ifndef IMZ_H
+#define IMZ_H
+
+#include "disk.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// This can't start with "I", so a single byte is enough to tell an .IMZ
+// file from an .IMD file.
+#define IMZ_MAGIC "\x89IMZ\r\n\x1a\n"
+#define IMZ_MAGIC_LEN 8
+#define IMZ_INDEX_MAGIC "IMZI"
+
+typedef enum {
+    IMZ_END = 0,
+    IMZ_COMMENT = 1,
+    IMZ_TRACK = 2
+} imz_kind_t;
+
+#define IMZ_STORED 0x01
+
+typedef struct {
+    uint64_t offset; // of the block's header in the file
+    uint64_t raw_offset; // of the block's data in the .IMD image
+    uint32_t raw_len;
+    uint32_t packed_len;
+    uint8_t kind;
+    uint8_t phys_cyl;
+    uint8_t phys_head;
+    uint8_t flags;
+} imz_block_t;
+
+// Return whether data looks like the start of an .IMZ file.
+bool is_imz(const void *data, size_t len);
+
+// Return whether a filename has the .imz extension, meaning that images
+// written to it should be compressed.
+bool is_imz_filename(const char *filename);
+
+// If the stream starts with an .IMZ file, return a new stream that reads
+// the .IMD image inside it (and closes image when it's closed).
+// Otherwise, return image as it is.
+FILE *open_imz_stream(FILE *image);
+
+// Decompress a whole .IMZ file in memory into an anonymous mapping, which
+// should be freed with munmap. Returns the mapping, and sets raw_len to
+// its length.
+void *inflate_imz(const uint8_t *data, size_t len, size_t *raw_len);
+
+// Writes an .IMZ file a block at a time.
+typedef struct {
+    FILE *file;
+    uint64_t pos; // bytes written so far
+    imz_block_t *blocks;
+    int num_blocks;
+    int blocks_size;
+    uint64_t raw_pos;
+    buffer_t packed;
+} imz_writer_t;
+
+// Start writing an .IMZ file to an open stream.
+void start_imz(FILE *file, imz_writer_t *writer);
+
+// Write the image's comment, as write_imd_header does.
+void write_imz_header(const disk_t *disk, imz_writer_t *writer);
+
+// Write an IMD track record, as produced by encode_imd_track.
+void write_imz_track(const uint8_t *record, size_t len, imz_writer_t *writer);
+
+// Write the end of the file and its index. This doesn't close the stream.
+void finish_imz(imz_writer_t *writer);
+
+// Copy an image (which may already be compressed, if it's been through
+// open_imz_stream) to an .IMZ file, without changing it.
+void compress_imd(FILE *image, FILE *imz);
+
+// Reads parts of an .IMD image from an .IMZ file on demand, using its
+// index. The most recently used block is kept decompressed, so reading
+// sectors in track order only decompresses each track once; this means a
+// reader mustn't be shared between threads.
+typedef struct {
+    int fd;
+    imz_block_t *blocks;
+    int num_blocks;
+    int cached_block; // -1 if none
+    buffer_t cache;
+    buffer_t packed;
+} imz_reader_t;
+
+// Open an .IMZ file (which must be seekable) and read its index.
+// The fd is closed along with the reader.
+void open_imz_reader(int fd, imz_reader_t *reader);
+void close_imz_reader(imz_reader_t *reader);
+
+// Read len bytes from offset in the .IMD image. They must all be within
+// one block, which is true of a sector data record.
+void read_imz_bytes(imz_reader_t *reader, uint64_t offset,
+                    uint8_t *buf, size_t len);
+
+#endif
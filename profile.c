@@ -0,0 +1,233 @@
+/*
+    profile.c: saved descriptions of known disk formats
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "disk.h"
+#include "profile.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Parse the next number from a profile line.
+static bool next_number(char **pos, int *value) {
+    char *end;
+    long n = strtol(*pos, &end, 10);
+    if (end == *pos) return false;
+    *value = n;
+    *pos = end;
+    return true;
+}
+
+// Skip over a "/" separator in a profile line.
+static bool next_separator(char **pos) {
+    while (**pos == ' ' || **pos == '\t') (*pos)++;
+    if (**pos != '/') return false;
+    (*pos)++;
+    return true;
+}
+
+static bool parse_profile(char *line, profile_t *profile) {
+    char *pos = line;
+
+    if (!next_number(&pos, &profile->num_heads)) return false;
+    if (profile->num_heads < 1 || profile->num_heads > MAX_HEADS) return false;
+    if (!next_number(&pos, &profile->cyl_scale)) return false;
+    if (profile->cyl_scale < 1) return false;
+
+    for (int head = 0; head < profile->num_heads; head++) {
+        profile_side_t *side = &profile->sides[head];
+
+        int mode;
+        if (!next_separator(&pos)) return false;
+        if (!next_number(&pos, &mode)) return false;
+        side->data_mode = NULL;
+        for (int i = 0; DATA_MODES[i].name != NULL; i++) {
+            if (DATA_MODES[i].imd_mode == mode) {
+                side->data_mode = &DATA_MODES[i];
+            }
+        }
+        if (side->data_mode == NULL) return false;
+
+        if (!next_number(&pos, &side->sector_size_code)) return false;
+        if (!next_number(&pos, &side->cyl_offset)) return false;
+        if (!next_number(&pos, &side->log_head)) return false;
+        if (!next_number(&pos, &side->num_sectors)) return false;
+        if (side->num_sectors < 1 || side->num_sectors > MAX_SECS) {
+            return false;
+        }
+
+        for (int i = 0; i < side->num_sectors; i++) {
+            int id;
+            if (!next_number(&pos, &id)) return false;
+            side->log_sectors[i] = id;
+        }
+    }
+
+    return true;
+}
+
+int load_profiles(const char *filename, profile_t **profiles) {
+    *profiles = NULL;
+
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        die_errno("cannot open %s", filename);
+    }
+
+    int num = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    for (int line_num = 1; getline(&line, &line_size, f) >= 0; line_num++) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+
+        *profiles = realloc(*profiles, (num + 1) * sizeof **profiles);
+        if (*profiles == NULL) {
+            die("realloc failed");
+        }
+        if (!parse_profile(line, &(*profiles)[num])) {
+            die("bad profile in %s line %d", filename, line_num);
+        }
+        num++;
+    }
+    free(line);
+    fclose(f);
+
+    return num;
+}
+
+void save_profile(const char *filename, const profile_t *profile) {
+    FILE *f = fopen(filename, "a");
+    if (f == NULL) {
+        die_errno("cannot open %s", filename);
+    }
+
+    fprintf(f, "%d %d", profile->num_heads, profile->cyl_scale);
+    for (int head = 0; head < profile->num_heads; head++) {
+        const profile_side_t *side = &profile->sides[head];
+        fprintf(f, " / %d %d %d %d %d",
+                side->data_mode->imd_mode, side->sector_size_code,
+                side->cyl_offset, side->log_head, side->num_sectors);
+        for (int i = 0; i < side->num_sectors; i++) {
+            fprintf(f, " %d", side->log_sectors[i]);
+        }
+    }
+    fprintf(f, "\n");
+
+    if (fclose(f) != 0) {
+        die_errno("cannot write %s", filename);
+    }
+}
+
+bool make_profile(const disk_t *disk, int cyl, int cyl_scale,
+                  profile_t *profile) {
+    profile->num_heads = disk->num_phys_heads;
+    profile->cyl_scale = cyl_scale;
+
+    for (int head = 0; head < profile->num_heads; head++) {
+        const track_t *track = disk_find_track(disk, cyl, head);
+        profile_side_t *side = &profile->sides[head];
+
+        if (track->status != TRACK_PROBED || track->num_sectors < 1) {
+            return false;
+        }
+
+        side->data_mode = track->data_mode;
+        side->sector_size_code = track->sector_size_code;
+        side->num_sectors = track->num_sectors;
+        side->cyl_offset = track->sectors[0].log_cyl - (cyl / cyl_scale);
+        side->log_head = track->sectors[0].log_head;
+
+        for (int i = 0; i < track->num_sectors; i++) {
+            const sector_t *sector = &track->sectors[i];
+
+            // Profiles can only describe tracks where all the sectors have
+            // the same logical cylinder and head.
+            if (sector->log_cyl != track->sectors[0].log_cyl
+                || sector->log_head != side->log_head) {
+                return false;
+            }
+            side->log_sectors[i] = sector->log_sector;
+        }
+    }
+
+    return true;
+}
+
+// Return whether two circular sequences of sector IDs are the same, starting
+// from any position.
+static bool same_sequence(const uint8_t *a, const uint8_t *b, int n) {
+    for (int start = 0; start < n; start++) {
+        bool same = true;
+        for (int i = 0; i < n && same; i++) {
+            same = (a[i] == b[(start + i) % n]);
+        }
+        if (same) return true;
+    }
+    return n == 0;
+}
+
+bool same_profile(const profile_t *a, const profile_t *b) {
+    if (a->num_heads != b->num_heads) return false;
+    if (a->cyl_scale != b->cyl_scale) return false;
+
+    for (int head = 0; head < a->num_heads; head++) {
+        const profile_side_t *sa = &a->sides[head];
+        const profile_side_t *sb = &b->sides[head];
+
+        if (sa->data_mode != sb->data_mode) return false;
+        if (sa->sector_size_code != sb->sector_size_code) return false;
+        if (sa->cyl_offset != sb->cyl_offset) return false;
+        if (sa->log_head != sb->log_head) return false;
+        if (sa->num_sectors != sb->num_sectors) return false;
+        if (!same_sequence(sa->log_sectors, sb->log_sectors,
+                           sa->num_sectors)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void apply_profile(const profile_t *profile, track_t *track) {
+    const profile_side_t *side = &profile->sides[track->phys_head];
+
+    free_track(track);
+
+    track->status = TRACK_GUESSED;
+    track->data_mode = side->data_mode;
+    resize_track(track, side->num_sectors);
+    track->sector_size_code = side->sector_size_code;
+
+    for (int i = 0; i < side->num_sectors; i++) {
+        sector_t *sector = &(track->sectors[i]);
+
+        sector->log_cyl = track->phys_cyl + side->cyl_offset;
+        sector->log_head = side->log_head;
+        sector->log_sector = side->log_sectors[i];
+        sector->phys_sector = i;
+    }
+}
@@ -0,0 +1,72 @@
+/*
+    profile.h: saved descriptions of known disk formats
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    A profile records the layout that probing found on cylinder 2 of a disk,
+    so that the next disk in the same format can be recognised by reading one
+    revolution of sector IDs rather than probing from scratch.
+
+    Profiles are stored in a text file, one per line:
+      HEADS SCALE / MODE SIZE-CODE CYL-OFFSET LOG-HEAD COUNT ID... / ...
+    with a "/ ..." section for each head. MODE is the IMD mode number, IDs
+    are logical sector IDs in physical order, and CYL-OFFSET is the logical
+    cylinder minus the (doublestepping-adjusted) physical cylinder.
+    Lines starting with # are ignored.
+*/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    const data_mode_t *data_mode;
+    int sector_size_code;
+    int cyl_offset;
+    int log_head;
+    int num_sectors;
+    uint8_t log_sectors[MAX_SECS]; // indexed by physical sector
+} profile_side_t;
+
+typedef struct {
+    int num_heads;
+    int cyl_scale;
+    profile_side_t sides[MAX_HEADS];
+} profile_t;
+
+// Load the profiles from a file into a malloc-d array, and return how many
+// there are. A file that doesn't exist has no profiles.
+int load_profiles(const char *filename, profile_t **profiles);
+
+// Append a profile to a file.
+void save_profile(const char *filename, const profile_t *profile);
+
+// Describe probed cylinder cyl of a disk as a profile.
+// Return false if it can't be described (e.g. a side wasn't probed).
+bool make_profile(const disk_t *disk, int cyl, int cyl_scale,
+                  profile_t *profile);
+
+bool same_profile(const profile_t *a, const profile_t *b);
+
+// Set the layout of a track from a profile, as a guess.
+void apply_profile(const profile_t *profile, track_t *track);
+
+#endif
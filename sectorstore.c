@@ -0,0 +1,268 @@
+/*
+    sectorstore.c: content-addressed storage for sector data
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+// For MAP_ANONYMOUS.
+#define _DEFAULT_SOURCE
+
+#include "sectorstore.h"
+#include "disk.h"
+#include "imd.h"
+#include "sha256.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+void open_sector_store(const char *dir, sector_store_t *store) {
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        die_errno("cannot create %s", dir);
+    }
+
+    store->dir = dir;
+    store->sectors = 0;
+    store->bytes = 0;
+    store->new_sectors = 0;
+    store->new_bytes = 0;
+}
+
+// Return the name of the file (and of the directory containing it) for a
+// hash in the store.
+static char *object_filename(const sector_store_t *store,
+                             const uint8_t hash[SHA256_BYTES],
+                             char **subdir) {
+    char hex[SHA256_BYTES * 2 + 1];
+    format_sha256(hash, hex);
+
+    char *filename = alloc_sprintf("%s/%.2s/%s", store->dir, hex, hex + 2);
+    *subdir = alloc_sprintf("%s/%.2s", store->dir, hex);
+    if (filename == NULL || *subdir == NULL) {
+        die("out of memory");
+    }
+    return filename;
+}
+
+// Add data to the store, if it isn't there already, and return its hash.
+static void put_object(sector_store_t *store, const uint8_t *data, size_t len,
+                       uint8_t hash[SHA256_BYTES]) {
+    sha256(data, len, hash);
+
+    char *subdir;
+    char *filename = object_filename(store, hash, &subdir);
+
+    store->sectors++;
+    store->bytes += len;
+    if (access(filename, F_OK) == 0) {
+        // We've seen this one before.
+        free(filename);
+        free(subdir);
+        return;
+    }
+
+    if (mkdir(subdir, 0777) < 0 && errno != EEXIST) {
+        die_errno("cannot create %s", subdir);
+    }
+
+    // Write to a temporary file and rename it into place, so that there's
+    // never an incomplete object, even if several programs are archiving
+    // into the store at once.
+    char *temp_filename = alloc_sprintf("%s/.tmpXXXXXX", subdir);
+    if (temp_filename == NULL) {
+        die("out of memory");
+    }
+    const int fd = mkstemp(temp_filename);
+    if (fd < 0) {
+        die_errno("cannot create %s", temp_filename);
+    }
+    if (write(fd, data, len) != (ssize_t) len) {
+        die_errno("cannot write %s", temp_filename);
+    }
+    if (fchmod(fd, 0444) < 0 || close(fd) < 0) {
+        die_errno("cannot write %s", temp_filename);
+    }
+    if (rename(temp_filename, filename) < 0) {
+        die_errno("cannot rename %s to %s", temp_filename, filename);
+    }
+
+    store->new_sectors++;
+    store->new_bytes += len;
+
+    free(temp_filename);
+    free(filename);
+    free(subdir);
+}
+
+// Read len bytes of data for a hash from the store, checking that it's
+// what it should be.
+static void get_object(sector_store_t *store, const uint8_t hash[SHA256_BYTES],
+                       uint8_t *data, size_t len) {
+    char *subdir;
+    char *filename = object_filename(store, hash, &subdir);
+
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        die_errno("cannot open %s", filename);
+    }
+    uint8_t extra;
+    if (fread(data, 1, len, f) != len || fread(&extra, 1, 1, f) != 0) {
+        die("%s is the wrong size", filename);
+    }
+    fclose(f);
+
+    uint8_t check[SHA256_BYTES];
+    sha256(data, len, check);
+    if (memcmp(check, hash, SHA256_BYTES) != 0) {
+        die("%s is corrupt", filename);
+    }
+
+    free(filename);
+    free(subdir);
+}
+
+static void write_bytes(const uint8_t *data, size_t len, FILE *out) {
+    if (fwrite(data, 1, len, out) != len) {
+        die_errno("cannot write IMD track");
+    }
+}
+
+// Copy the comment, including its terminator.
+static void copy_comment(FILE *in, FILE *out) {
+    char *comment = NULL;
+    size_t size = 0;
+    const ssize_t count = getdelim(&comment, &size, IMD_END_OF_COMMENT, in);
+    if (count < 0 || comment[count - 1] != IMD_END_OF_COMMENT) {
+        die("Couldn't find IMD comment delimiter");
+    }
+    if (fwrite(comment, 1, count, out) != count) {
+        die_errno("cannot write IMD comment");
+    }
+    free(comment);
+}
+
+// Copy a track record between an image and a reference file, in either
+// direction, converting the sector data records. record is a buffer to use
+// for the track record. Returns false at the end of the input.
+static bool convert_track(FILE *in, FILE *out, bool to_ref,
+                          sector_store_t *store, buffer_t *record) {
+    // In a reference file, the data is a hash.
+    imd_record_layout_t layout;
+    const size_t in_data_len = to_ref ? 0 : SHA256_BYTES;
+    if (!read_imd_record(in, in_data_len, record, &layout)) {
+        return false;
+    }
+    const size_t sector_size = layout.sector_size;
+
+    // Copy the record, replacing the data in each record that has it.
+    uint8_t data[sector_size];
+    uint8_t hash[SHA256_BYTES];
+    size_t pos = 0;
+    for (int i = 0; i < layout.num_sectors; i++) {
+        const size_t sdr = layout.sdr_offset[i];
+        const uint8_t type = record->data[sdr];
+        if (type == 0 || (type & 1) == 0) {
+            // No data, or compressed to a single byte; leave it alone.
+            continue;
+        }
+
+        write_bytes(record->data + pos, sdr + 1 - pos, out);
+        const uint8_t *in_data = record->data + sdr + 1;
+        if (to_ref) {
+            put_object(store, in_data, sector_size, hash);
+            write_bytes(hash, SHA256_BYTES, out);
+            pos = sdr + 1 + sector_size;
+        } else {
+            get_object(store, in_data, data, sector_size);
+            write_bytes(data, sector_size, out);
+            pos = sdr + 1 + SHA256_BYTES;
+        }
+    }
+    write_bytes(record->data + pos, record->len - pos, out);
+
+    return true;
+}
+
+void archive_imd(FILE *image, FILE *ref, sector_store_t *store) {
+    if (fputs(IMD_REF_MAGIC, ref) == EOF) {
+        die_errno("cannot write reference file");
+    }
+    copy_comment(image, ref);
+    buffer_t record;
+    init_buffer(&record);
+    while (convert_track(image, ref, true, store, &record)) {
+        // Nothing.
+    }
+    free_buffer(&record);
+}
+
+void export_imd(FILE *ref, FILE *image, sector_store_t *store) {
+    const size_t magic_len = strlen(IMD_REF_MAGIC);
+    char magic[magic_len];
+    if (fread(magic, 1, magic_len, ref) != magic_len
+        || memcmp(magic, IMD_REF_MAGIC, magic_len) != 0) {
+        die("Not a reference file");
+    }
+    copy_comment(ref, image);
+    buffer_t record;
+    init_buffer(&record);
+    while (convert_track(ref, image, false, store, &record)) {
+        // Nothing.
+    }
+    free_buffer(&record);
+}
+
+bool is_imd_ref(const void *data, size_t len) {
+    const size_t magic_len = strlen(IMD_REF_MAGIC);
+    return len >= magic_len && memcmp(data, IMD_REF_MAGIC, magic_len) == 0;
+}
+
+void *export_imd_mapping(const void *ref, size_t ref_len,
+                         sector_store_t *store, size_t *image_len) {
+    FILE *in = fmemopen((void *) ref, ref_len, "rb");
+    if (in == NULL) {
+        die_errno("fmemopen failed");
+    }
+    char *image_data = NULL;
+    size_t len = 0;
+    FILE *image = open_memstream(&image_data, &len);
+    if (image == NULL) {
+        die_errno("open_memstream failed");
+    }
+    export_imd(in, image, store);
+    fclose(image);
+    fclose(in);
+
+    // Other images are in mappings, so put this in one too.
+    void *map = mmap(NULL, (len > 0) ? len : 1, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        die_errno("mmap failed");
+    }
+    memcpy(map, image_data, len);
+    free(image_data);
+
+    *image_len = len;
+    return map;
+}
@@ -0,0 +1,75 @@
+/*
+    sectorstore.h: content-addressed storage for sector data
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    A sector store is a directory holding the data of sectors from many
+    images, each stored once in a file named by the SHA-256 of its contents
+    (as "DIR/ab/cdef...", split on the first two hex digits so that no
+    directory gets too large).
+
+    An image can be archived into a store as a reference file. This is
+    exactly the same as the .IMD file, except that it starts with
+    IMD_REF_MAGIC, and each sector data record that would contain the
+    sector's data has the 32-byte SHA-256 instead. (Records for sectors
+    filled with a single value are kept as they are, since they're smaller
+    than a hash.) Exporting the reference file with the same store gives
+    back the original .IMD file, byte for byte.
+*/
+
+#ifndef SECTORSTORE_H
+#define SECTORSTORE_H
+
+#include "disk.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define IMD_REF_MAGIC "IMDREF 1\n"
+
+typedef struct {
+    const char *dir;
+    // Counts of sector data records, and the bytes of data in them, that
+    // have been archived -- and how many of those weren't already there.
+    long sectors;
+    long bytes;
+    long new_sectors;
+    long new_bytes;
+} sector_store_t;
+
+// Use dir as a store, creating it if it doesn't exist.
+void open_sector_store(const char *dir, sector_store_t *store);
+
+// Copy an .IMD image to a reference file, putting its sector data into the
+// store.
+void archive_imd(FILE *image, FILE *ref, sector_store_t *store);
+
+// Rebuild an .IMD image from a reference file.
+void export_imd(FILE *ref, FILE *image, sector_store_t *store);
+
+// Return whether data looks like the start of a reference file.
+bool is_imd_ref(const void *data, size_t len);
+
+// Rebuild an .IMD image from a reference file in memory, into an anonymous
+// mapping, which should be freed with munmap. Sets image_len to its length.
+void *export_imd_mapping(const void *ref, size_t ref_len,
+                         sector_store_t *store, size_t *image_len);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+    sha256.h: SHA-256 message digest
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    This follows FIPS 180-4. It's here so that sector data can be identified
+    by its content, without needing an external crypto library.
+*/
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BYTES 32
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; // bytes hashed so far
+    uint8_t block[64];
+    size_t block_len;
+} sha256_t;
+
+void init_sha256(sha256_t *ctx);
+void update_sha256(sha256_t *ctx, const void *data, size_t len);
+void finish_sha256(sha256_t *ctx, uint8_t digest[SHA256_BYTES]);
+
+// Hash a buffer in one go.
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_BYTES]);
+
+// Write a digest as 64 hex digits and a terminator.
+void format_sha256(const uint8_t digest[SHA256_BYTES],
+                   char hex[SHA256_BYTES * 2 + 1]);
+
+#endif
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 void show_mode(const data_mode_t *mode, FILE *out) {
     if (mode == NULL) {
@@ -71,6 +72,75 @@ static int cmp_log_sector(const void *left_v, const void *right_v) {
     return left->phys_sector - right->phys_sector;
 }
 
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+// Format one line of a hexdump for len (<= 16) bytes of data at offset.
+// Returns the length of the line.
+static int format_hexdump_line(const uint8_t *data, int len, int offset,
+                               char *line) {
+    char *p = line;
+    for (int shift = 12; shift >= 0; shift -= 4) {
+        *p++ = HEX_DIGITS[(offset >> shift) & 0xF];
+    }
+    *p++ = ' ';
+
+    for (int i = 0; i < 16; i++) {
+        *p++ = ' ';
+        if (i < len) {
+            *p++ = HEX_DIGITS[data[i] >> 4];
+            *p++ = HEX_DIGITS[data[i] & 0xF];
+        } else {
+            *p++ = ' ';
+            *p++ = ' ';
+        }
+    }
+
+    *p++ = ' ';
+    *p++ = ' ';
+    *p++ = '|';
+    for (int i = 0; i < 16; i++) {
+        if (i < len) {
+            const uint8_t c = data[i];
+            *p++ = (c >= 32 && c < 127) ? c : '.';
+        } else {
+            *p++ = ' ';
+        }
+    }
+    *p++ = '|';
+    *p++ = '\n';
+
+    return p - line;
+}
+
+// Show data in the same format as "hexdump -C": lines that are the same as
+// the line before are replaced by a single "*". If the data ends with such
+// lines, the length of the data is shown at the end.
+static void show_hexdump(const uint8_t *data, int data_len, FILE *out) {
+    const int line_len = 16;
+    char line[128];
+    bool folding = false;
+
+    for (int i = 0; i < data_len; i += line_len) {
+        const int len = (data_len - i < line_len) ? (data_len - i) : line_len;
+
+        if (i > 0 && len == line_len
+            && memcmp(data + i, data + i - line_len, line_len) == 0) {
+            if (!folding) {
+                fwrite("*\n", 1, 2, out);
+                folding = true;
+            }
+            continue;
+        }
+        folding = false;
+
+        fwrite(line, 1, format_hexdump_line(data + i, len, i, line), out);
+    }
+
+    if (folding) {
+        fprintf(out, "%04x\n", data_len);
+    }
+}
+
 void show_track_data(const track_t *track, FILE *out) {
     // Sort list of sectors into logical sector order.
     const sector_t *sectors[MAX_SECS];
@@ -93,40 +163,7 @@ void show_track_data(const track_t *track, FILE *out) {
         }
         fprintf(out, ":\n");
 
-        // The format here is based on "hexdump -C".
-        // (Although it's not smart enough to fold identical data.)
-        const uint8_t *data = sector->data;
-        const int line_len = 16;
-        for (int i = 0; i < data_len; i += line_len) {
-            fprintf(out, "%04x ", i);
-
-            for (int j = 0; j < line_len; j++) {
-                const int pos = i + j;
-                if (pos < data_len) {
-                    fprintf(out, " %02x", data[pos]);
-                } else {
-                    fprintf(out, "   ");
-                }
-            }
-
-            fprintf(out, "  |");
-            for (int j = 0; j < line_len; j++) {
-                const int pos = i + j;
-                if (pos < data_len) {
-                    const uint8_t c = data[pos];
-                    if (c >= 32 && c < 127) {
-                        fprintf(out, "%c", c);
-                    } else {
-                        fprintf(out, ".");
-                    }
-                } else {
-                    fprintf(out, " ");
-                }
-            }
-
-            fprintf(out, "|\n");
-        }
-
+        show_hexdump(sector->data, data_len, out);
         fprintf(out, "\n");
     }
 }
@@ -142,13 +179,15 @@ void show_disk(const disk_t *disk, bool with_data, FILE *out) {
     fprintf(out, "\n");
     for (int phys_cyl = 0; phys_cyl < disk->num_phys_cyls; phys_cyl++) {
         for (int phys_head = 0; phys_head < disk->num_phys_heads; phys_head++) {
+            const track_t *track = disk_find_track(disk, phys_cyl, phys_head);
+
             fprintf(out, "%2d.%d:", phys_cyl, phys_head);
-            show_track(&disk->tracks[phys_cyl][phys_head], out);
+            show_track(track, out);
             fprintf(out, "\n");
 
             if (with_data) {
                 fprintf(out, "\n");
-                show_track_data(&disk->tracks[phys_cyl][phys_head], out);
+                show_track_data(track, out);
             }
         }
     }
@@ -0,0 +1,35 @@
+#!/bin/sh
+# simdump.sh: check that dumping an image through the simulated floppy
+# controller gives back the same image.
+#
+# usage: simdump.sh DUMPFLOPPY SOURCE-IMAGE WORK-DIR
+#
+# The comments will be different, so only the track records are compared,
+# byte for byte.
+
+set -e
+
+dumpfloppy="$1"
+source="$2"
+work="$3"
+
+mkdir -p "$work"
+name=$(basename "$source" .imd)
+dumped="$work/$name.dumped.imd"
+
+"$dumpfloppy" -D "$source" "$dumped" >"$work/$name.log" 2>&1 || {
+	cat "$work/$name.log" >&2
+	exit 1
+}
+
+# Print a file's bytes after the comment terminator.
+tracks () {
+	od -An -v -tx1 "$1" | tr -s ' \n' '\n\n' | sed '1,/^1a$/d'
+}
+
+tracks "$source" >"$work/$name.want"
+tracks "$dumped" >"$work/$name.got"
+if ! cmp "$work/$name.want" "$work/$name.got"; then
+	echo "$dumped doesn't match $source" >&2
+	exit 1
+fi
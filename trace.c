@@ -0,0 +1,147 @@
+/*
+    trace.c: timing of floppy controller commands
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+const char *PHASE_NAMES[NUM_PHASES] = {
+    "probe",
+    "read",
+    "recalibrate",
+};
+
+static FILE *trace_file = NULL;
+static bool trace_json;
+static bool trace_first;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void init_timing(timing_t *timing) {
+    for (int i = 0; i < NUM_PHASES; i++) {
+        timing->time[i] = 0.0;
+    }
+    timing->commands = 0;
+    timing->retries = 0;
+    timing->sectors = 0;
+}
+
+void add_timing(const timing_t *src, timing_t *dest) {
+    for (int i = 0; i < NUM_PHASES; i++) {
+        dest->time[i] += src->time[i];
+    }
+    dest->commands += src->commands;
+    dest->retries += src->retries;
+    dest->sectors += src->sectors;
+}
+
+static struct timespec epoch;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+
+static void set_epoch(void) {
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+}
+
+double trace_now(void) {
+    pthread_once(&epoch_once, set_epoch);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - epoch.tv_sec) + (now.tv_nsec - epoch.tv_nsec) / 1e9;
+}
+
+void open_trace(const char *filename) {
+    trace_file = fopen(filename, "w");
+    if (trace_file == NULL) {
+        die_errno("cannot open %s", filename);
+    }
+
+    const size_t len = strlen(filename);
+    trace_json = (len >= 5 && strcmp(filename + len - 5, ".json") == 0);
+    trace_first = true;
+
+    if (trace_json) {
+        fprintf(trace_file, "[\n");
+    } else {
+        fprintf(trace_file, "time,drive,command,phase,cyl,head,try,"
+                            "duration,ok,st0,st1,st2,id_c,id_h,id_r,id_n\n");
+    }
+}
+
+void write_trace(const trace_event_t *event) {
+    if (trace_file == NULL) return;
+
+    char status[3][8];
+    for (int i = 0; i < 3; i++) {
+        if (i < event->num_status) {
+            snprintf(status[i], sizeof status[i], "%d", event->status[i]);
+        } else {
+            strcpy(status[i], trace_json ? "null" : "");
+        }
+    }
+
+    char id[32];
+    if (!event->have_id) {
+        strcpy(id, trace_json ? "null" : ",,,");
+    } else if (trace_json) {
+        snprintf(id, sizeof id, "[%d, %d, %d, %d]",
+                 event->id[0], event->id[1], event->id[2], event->id[3]);
+    } else {
+        snprintf(id, sizeof id, "%d,%d,%d,%d",
+                 event->id[0], event->id[1], event->id[2], event->id[3]);
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_json) {
+        fprintf(trace_file,
+                "%s  {\"time\": %.6f, \"drive\": %d, \"command\": \"%s\", "
+                "\"phase\": \"%s\", \"cyl\": %d, \"head\": %d, \"try\": %d, "
+                "\"duration\": %.6f, \"ok\": %s, "
+                "\"st0\": %s, \"st1\": %s, \"st2\": %s, \"id\": %s}",
+                trace_first ? "" : ",\n",
+                event->start, event->drive, event->command,
+                PHASE_NAMES[event->phase], event->cyl, event->head,
+                event->try, event->duration, event->ok ? "true" : "false",
+                status[0], status[1], status[2], id);
+    } else {
+        fprintf(trace_file, "%.6f,%d,%s,%s,%d,%d,%d,%.6f,%d,%s,%s,%s,%s\n",
+                event->start, event->drive, event->command,
+                PHASE_NAMES[event->phase], event->cyl, event->head,
+                event->try, event->duration, event->ok ? 1 : 0,
+                status[0], status[1], status[2], id);
+    }
+    trace_first = false;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void close_trace(void) {
+    if (trace_file == NULL) return;
+
+    if (trace_json) {
+        fprintf(trace_file, "%s]\n", trace_first ? "" : "\n");
+    }
+    fclose(trace_file);
+    trace_file = NULL;
+}
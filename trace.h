@@ -0,0 +1,81 @@
+/*
+    trace.h: timing of floppy controller commands
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    Each command sent to the floppy controller can be recorded with how long
+    it took and what the result was. Times are accumulated into a timing_t
+    for summaries, and each command can also be written to a trace file:
+    as a JSON array of objects if the filename ends in ".json", or as CSV
+    with a header line otherwise. CSV traces can be replayed by the simulator
+    in fdcsim.c.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// What a command was being used for.
+typedef enum {
+    PHASE_PROBE = 0,
+    PHASE_READ,
+    PHASE_RECALIBRATE,
+    NUM_PHASES
+} phase_t;
+
+extern const char *PHASE_NAMES[NUM_PHASES];
+
+typedef struct {
+    double time[NUM_PHASES]; // seconds spent on commands in each phase
+    int commands;
+    int retries;
+    int sectors; // sectors read
+} timing_t;
+
+typedef struct {
+    double start; // seconds since the first command
+    double duration;
+    int drive;
+    const char *command;
+    phase_t phase;
+    int cyl; // physical, as sent to the drive
+    int head;
+    int try; // 0 for the first try at a track
+    bool ok;
+    int num_status; // how many of ST0-ST2 we got
+    uint8_t status[3];
+    bool have_id; // whether the reply included a sector address
+    uint8_t id[4]; // C, H, R, N
+} trace_event_t;
+
+void init_timing(timing_t *timing);
+void add_timing(const timing_t *src, timing_t *dest);
+
+// Return a timestamp in seconds, suitable for trace_event_t.start.
+double trace_now(void);
+
+void open_trace(const char *filename);
+// Write an event to the trace file, if there is one. Safe to call from
+// several threads.
+void write_trace(const trace_event_t *event);
+void close_trace(void);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+    trackhash.c: hashes of track contents, for checking images
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include "trackhash.h"
+#include "disk.h"
+#include "sha256.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void init_disk_hashes(disk_hashes_t *hashes) {
+    memset(hashes->present, 0, sizeof hashes->present);
+    hashes->have_disk = false;
+}
+
+void hash_track(const track_t *track, uint8_t digest[SHA256_BYTES]) {
+    sha256_t ctx;
+    init_sha256(&ctx);
+
+    const uint8_t header[5] = {
+        (track->data_mode != NULL) ? track->data_mode->imd_mode : 0xFF,
+        track->phys_cyl,
+        track->phys_head,
+        track->num_sectors,
+        track->sector_size_code,
+    };
+    update_sha256(&ctx, header, sizeof header);
+
+    const int sector_size = sector_bytes(track->sector_size_code);
+    for (int i = 0; i < track->num_sectors; i++) {
+        const sector_t *sector = &track->sectors[i];
+        const uint8_t addr[5] = {
+            sector->log_cyl,
+            sector->log_head,
+            sector->log_sector,
+            sector->status,
+            sector->deleted,
+        };
+        update_sha256(&ctx, addr, sizeof addr);
+
+        if (sector->status != SECTOR_MISSING) {
+            if (sector->data == NULL) {
+                die("hash_track: sector data not loaded");
+            }
+            update_sha256(&ctx, sector->data, sector_size);
+        }
+    }
+
+    finish_sha256(&ctx, digest);
+}
+
+void set_track_hash(const track_t *track, disk_hashes_t *hashes) {
+    hash_track(track,
+               hashes->track[track->phys_cyl][track->phys_head]);
+    hashes->present[track->phys_cyl][track->phys_head] = true;
+}
+
+void finish_disk_hashes(disk_hashes_t *hashes) {
+    sha256_t ctx;
+    init_sha256(&ctx);
+    for (int cyl = 0; cyl < MAX_CYLS; cyl++) {
+        for (int head = 0; head < MAX_HEADS; head++) {
+            if (!hashes->present[cyl][head]) continue;
+
+            const uint8_t addr[2] = {cyl, head};
+            update_sha256(&ctx, addr, sizeof addr);
+            update_sha256(&ctx, hashes->track[cyl][head], SHA256_BYTES);
+        }
+    }
+    finish_sha256(&ctx, hashes->disk);
+    hashes->have_disk = true;
+}
+
+// The state shared between the threads hashing a disk.
+typedef struct {
+    const disk_t *disk;
+    disk_hashes_t *hashes;
+    pthread_mutex_t lock;
+    int next_track; // protected by lock
+} hash_job_t;
+
+static void *hash_worker(void *job_v) {
+    hash_job_t *job = job_v;
+    const disk_t *disk = job->disk;
+    const int num_tracks = disk->num_phys_cyls * disk->num_phys_heads;
+
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        const int i = job->next_track++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= num_tracks) break;
+
+        // Each thread writes to different tracks' entries.
+        const track_t *track = disk->tracks[i / disk->num_phys_heads]
+                                           [i % disk->num_phys_heads];
+        if (track != NULL && track->status != TRACK_UNKNOWN) {
+            set_track_hash(track, job->hashes);
+        }
+    }
+
+    return NULL;
+}
+
+void hash_disk(const disk_t *disk, int num_threads, disk_hashes_t *hashes) {
+    init_disk_hashes(hashes);
+
+    hash_job_t job;
+    job.disk = disk;
+    job.hashes = hashes;
+    pthread_mutex_init(&job.lock, NULL);
+    job.next_track = 0;
+
+    if (num_threads <= 1) {
+        hash_worker(&job);
+    } else {
+        pthread_t threads[num_threads];
+        for (int i = 0; i < num_threads; i++) {
+            if (pthread_create(&threads[i], NULL, hash_worker, &job) != 0) {
+                die("pthread_create failed");
+            }
+        }
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    finish_disk_hashes(hashes);
+}
+
+char *hashes_filename(const char *image_filename) {
+    char *filename = alloc_sprintf("%s.hashes", image_filename);
+    if (filename == NULL) {
+        die("out of memory");
+    }
+    return filename;
+}
+
+void write_disk_hashes(const disk_hashes_t *hashes, FILE *out) {
+    char hex[SHA256_BYTES * 2 + 1];
+
+    fprintf(out, "# SHA-256 of each track's contents, and of the disk\n");
+    for (int cyl = 0; cyl < MAX_CYLS; cyl++) {
+        for (int head = 0; head < MAX_HEADS; head++) {
+            if (!hashes->present[cyl][head]) continue;
+
+            format_sha256(hashes->track[cyl][head], hex);
+            fprintf(out, "%d.%d %s\n", cyl, head, hex);
+        }
+    }
+    if (hashes->have_disk) {
+        format_sha256(hashes->disk, hex);
+        fprintf(out, "disk %s\n", hex);
+    }
+}
+
+// Parse a hash written by format_sha256.
+static bool parse_sha256(const char *hex, uint8_t digest[SHA256_BYTES]) {
+    if (strlen(hex) != SHA256_BYTES * 2) return false;
+
+    for (int i = 0; i < SHA256_BYTES; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return false;
+        digest[i] = byte;
+    }
+    return true;
+}
+
+void read_disk_hashes(FILE *in, const char *filename, disk_hashes_t *hashes) {
+    init_disk_hashes(hashes);
+
+    char line[256];
+    int line_num = 0;
+    while (fgets(line, sizeof line, in) != NULL) {
+        line_num++;
+        if (line[0] == '#' || line[0] == '\n') continue;
+
+        char what[16], hex[SHA256_BYTES * 2 + 2];
+        int cyl, head;
+        char dummy;
+        if (sscanf(line, "%15s %65s", what, hex) != 2) {
+            die("%s:%d: bad line", filename, line_num);
+        }
+
+        uint8_t *digest = NULL;
+        if (strcmp(what, "disk") == 0) {
+            digest = hashes->disk;
+            hashes->have_disk = true;
+        } else if (sscanf(what, "%d.%d%c", &cyl, &head, &dummy) == 2
+                   && cyl >= 0 && cyl < MAX_CYLS
+                   && head >= 0 && head < MAX_HEADS) {
+            digest = hashes->track[cyl][head];
+            hashes->present[cyl][head] = true;
+        } else {
+            die("%s:%d: bad track number", filename, line_num);
+        }
+
+        if (!parse_sha256(hex, digest)) {
+            die("%s:%d: bad hash", filename, line_num);
+        }
+    }
+}
@@ -0,0 +1,69 @@
+/*
+    trackhash.h: hashes of track contents, for checking images
+
+    Copyright (C) 2019 Adam Sampson <ats@offog.org>
+
+    Permission to use, copy, modify, and/or distribute this software for
+    any purpose with or without fee is hereby granted, provided that the
+    above copyright notice and this permission notice appear in all
+    copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+    WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+    WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+    AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+    DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+    PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+    TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+    PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+    Each track's hash is the SHA-256 of its decoded contents: its mode and
+    layout, then each sector's address, status and data. The way the image
+    happens to be encoded (e.g. which sectors are compressed) doesn't affect
+    it. The disk's hash covers the hashes of all its tracks.
+
+    Hashes are kept in a text file alongside the image (IMAGE.hashes), with
+    a line "CYL.HEAD HASH" for each track, and "disk HASH" at the end.
+*/
+
+#ifndef TRACKHASH_H
+#define TRACKHASH_H
+
+#include "disk.h"
+#include "sha256.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+    bool present[MAX_CYLS][MAX_HEADS];
+    uint8_t track[MAX_CYLS][MAX_HEADS][SHA256_BYTES];
+    bool have_disk;
+    uint8_t disk[SHA256_BYTES];
+} disk_hashes_t;
+
+void init_disk_hashes(disk_hashes_t *hashes);
+
+// Hash a track, whose sector data must be loaded.
+void hash_track(const track_t *track, uint8_t digest[SHA256_BYTES]);
+
+// Record the hash of a track.
+void set_track_hash(const track_t *track, disk_hashes_t *hashes);
+
+// Work out the disk's hash from the tracks' hashes.
+void finish_disk_hashes(disk_hashes_t *hashes);
+
+// Hash all the tracks in a disk, and the disk itself, using num_threads
+// threads.
+void hash_disk(const disk_t *disk, int num_threads, disk_hashes_t *hashes);
+
+// Return the name of the hashes file for an image, as a malloc-d string.
+char *hashes_filename(const char *image_filename);
+
+void write_disk_hashes(const disk_hashes_t *hashes, FILE *out);
+void read_disk_hashes(FILE *in, const char *filename, disk_hashes_t *hashes);
+
+#endif
@@ -25,8 +25,32 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+__thread jmp_buf *die_jump = NULL;
+__thread char *die_message = NULL;
+
 void die(const char *format, ...) {
     va_list ap;
+
+    if (die_jump != NULL) {
+        va_start(ap, format);
+        const int count = vsnprintf(NULL, 0, format, ap);
+        va_end(ap);
+
+        die_message = malloc(count + 1);
+        if (die_message != NULL) {
+            va_start(ap, format);
+            vsnprintf(die_message, count + 1, format, ap);
+            va_end(ap);
+        }
+        longjmp(*die_jump, 1);
+    }
+
     va_start(ap, format);
     vfprintf(stderr, format, ap);
     va_end(ap);
@@ -56,6 +80,48 @@ char *alloc_sprintf(const char *format, ...) {
     return s;
 }
 
+char *make_output_filename(const char *pattern, const char *input_filename) {
+    const char *subst = strstr(pattern, "%s");
+    if (subst == NULL) {
+        return alloc_sprintf("%s", pattern);
+    }
+
+    const char *base = strrchr(input_filename, '/');
+    base = (base == NULL) ? input_filename : base + 1;
+    const char *ext = strrchr(base, '.');
+    const int base_len = (ext == NULL || ext == base) ? strlen(base)
+                                                       : ext - base;
+
+    return alloc_sprintf("%.*s%.*s%s",
+                         (int) (subst - pattern), pattern,
+                         base_len, base,
+                         subst + 2);
+}
+
+FILE *create_temp_file(const char *filename, char **temp_filename) {
+    *temp_filename = alloc_sprintf("%s.tmp", filename);
+    if (*temp_filename == NULL) {
+        die("out of memory");
+    }
+
+    FILE *f = fopen(*temp_filename, "wb");
+    if (f == NULL) {
+        die_errno("cannot open %s", *temp_filename);
+    }
+    return f;
+}
+
+void replace_with_temp_file(FILE *f, char *temp_filename,
+                            const char *filename) {
+    if (fclose(f) != 0) {
+        die_errno("cannot write %s", temp_filename);
+    }
+    if (rename(temp_filename, filename) < 0) {
+        die_errno("cannot rename %s to %s", temp_filename, filename);
+    }
+    free(temp_filename);
+}
+
 void alloc_append(const char *append, int append_len,
                   char **buf, int *buf_len) {
     *buf = realloc(*buf, *buf_len + append_len);
@@ -66,3 +132,74 @@ void alloc_append(const char *append, int append_len,
     memcpy(*buf + *buf_len, append, append_len);
     *buf_len += append_len;
 }
+
+bool is_uniform(const uint8_t *data, size_t len) {
+    if (len == 0) return true;
+
+    const uint8_t first = data[0];
+    size_t i = 0;
+
+    // Compare a block at a time, using vector instructions where we can.
+#if defined(__SSE2__)
+    const __m128i fill = _mm_set1_epi8(first);
+    for (; i + 16 <= len; i += 16) {
+        const __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, fill)) != 0xFFFF) {
+            return false;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t fill = vdupq_n_u8(first);
+    for (; i + 16 <= len; i += 16) {
+        const uint8x16_t same = vceqq_u8(vld1q_u8(data + i), fill);
+        if (vminvq_u8(same) != 0xFF) {
+            return false;
+        }
+    }
+#else
+    const uint64_t fill = first * UINT64_C(0x0101010101010101);
+    for (; i + 8 <= len; i += 8) {
+        uint64_t block;
+        memcpy(&block, data + i, 8);
+        if (block != fill) {
+            return false;
+        }
+    }
+#endif
+
+    // Check any bytes left over at the end.
+    for (; i < len; i++) {
+        if (data[i] != first) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void init_buffer(buffer_t *buf) {
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+}
+
+void free_buffer(buffer_t *buf) {
+    free(buf->data);
+    init_buffer(buf);
+}
+
+uint8_t *buffer_reserve(buffer_t *buf, size_t count) {
+    if (buf->len + count > buf->size) {
+        size_t new_size = buf->size * 2;
+        if (new_size < buf->len + count) {
+            new_size = buf->len + count;
+        }
+
+        buf->data = realloc(buf->data, new_size);
+        if (buf->data == NULL) {
+            die("realloc failed");
+        }
+        buf->size = new_size;
+    }
+
+    return buf->data + buf->len;
+}
@@ -22,19 +22,62 @@
 #define UTIL_H
 
 #include <errno.h>
+#include <setjmp.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
+// Print a message and exit. If the calling thread has set die_jump, die
+// instead longjmps there, leaving the message in die_message (malloc-d, or
+// NULL if there wasn't enough memory). That lets a batch of jobs carry on
+// after one of them fails, at the cost of leaking whatever it had allocated.
 void die(const char *format, ...);
 #define die_errno(format, ...) \
     die(format ": %s", ##__VA_ARGS__, strerror(errno))
+extern __thread jmp_buf *die_jump;
+extern __thread char *die_message;
 
 // malloc a string (of the right size) and printf into it.
 // (Similar to GNU asprintf.)
 char *alloc_sprintf(const char *format, ...);
 
+// Make the name of an output file, by replacing %s in pattern with
+// input_filename minus its directory and extension. Returns a malloc-d
+// string.
+char *make_output_filename(const char *pattern, const char *input_filename);
+
+// Open a temporary file in the same directory as filename, to write a new
+// version of it to. Sets *temp_filename to the temporary file's name
+// (malloc-d).
+FILE *create_temp_file(const char *filename, char **temp_filename);
+
+// Close a temporary file and rename it over filename. This frees
+// temp_filename.
+void replace_with_temp_file(FILE *f, char *temp_filename,
+                            const char *filename);
+
 // Append data to a malloc-d buffer, reallocing it if necessary.
 void alloc_append(const char *append, int append_len,
                   char **buf, int *buf_len);
 
+// Return whether all len bytes of data have the same value as the first.
+// This stops as soon as it finds a difference.
+bool is_uniform(const uint8_t *data, size_t len);
+
+// A malloc-d buffer that grows as needed, and can be reused.
+typedef struct {
+    uint8_t *data;
+    size_t len; // bytes in use
+    size_t size; // bytes allocated
+} buffer_t;
+
+void init_buffer(buffer_t *buf);
+void free_buffer(buffer_t *buf);
+
+// Make sure there's room for count more bytes after the data in the buffer,
+// and return a pointer to where they should go. (This doesn't change len.)
+uint8_t *buffer_reserve(buffer_t *buf, size_t count);
+
 #endif